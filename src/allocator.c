@@ -0,0 +1,375 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* MAP_ANONYMOUS, madvise and mremap */
+#endif
+#include "allocator.h"
+#include "coo.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define COO_SLAB_CLASSES        21
+#define COO_SLAB_MAX_SIZE       8192
+#define COO_SLAB_BLOCK_SIZE     65536
+#define COO_ARENA_HEADER_SIZE   16 /* keeps arena allocations 16 byte aligned */
+#define COO_HUGE_PAGE_SIZE      (2 << 20)
+#define COO_PAGE_SIZE           4096
+
+
+static void *_malloc_alloc(CooAllocator *allocator, size_t size) {
+    (void)allocator;
+    return malloc(size);
+}
+
+static void _malloc_free(CooAllocator *allocator, void *ptr, size_t size) {
+    (void)allocator;
+    (void)size;
+    free(ptr);
+}
+
+static void _malloc_destroy(CooAllocator *allocator) {
+    (void)allocator;
+}
+
+CooAllocator CooMallocAllocator = { _malloc_alloc, _malloc_free, 0, _malloc_destroy };
+
+void coo_destroy_allocator(CooAllocator *allocator) {
+    if (allocator && allocator != &CooMallocAllocator)
+        allocator->destroy(allocator);
+}
+
+/* user functions */
+
+typedef struct CooUserAllocator {
+    CooAllocator base;
+    COO_ALLOC_FUNC alloc_func;
+    COO_FREE_FUNC free_func;
+    void *context;
+} CooUserAllocator;
+
+static void *_user_alloc(CooAllocator *allocator, size_t size) {
+    CooUserAllocator *u = (CooUserAllocator *)allocator;
+    return u->alloc_func(u->context, size);
+}
+
+static void _user_free(CooAllocator *allocator, void *ptr, size_t size) {
+    CooUserAllocator *u = (CooUserAllocator *)allocator;
+    u->free_func(u->context, ptr, size);
+}
+
+static void _user_destroy(CooAllocator *allocator) {
+    free(allocator);
+}
+
+CooAllocator *coo_create_allocator(COO_ALLOC_FUNC alloc_func, COO_FREE_FUNC free_func, void *context) {
+    assert(alloc_func != 0 && free_func != 0);
+    CooUserAllocator *u = malloc(sizeof(CooUserAllocator));
+    u->base.alloc = _user_alloc;
+    u->base.free = _user_free;
+    u->base.resize = 0;
+    u->base.destroy = _user_destroy;
+    u->alloc_func = alloc_func;
+    u->free_func = free_func;
+    u->context = context;
+    return &u->base;
+}
+
+/* slab, size classes of 16 byte steps up to 256 bytes and powers of two above that, each class
+   carves chunks from its own blocks and keeps a list of freed chunks, larger sizes use malloc */
+
+typedef struct CooSlabBlock {
+    struct CooSlabBlock *next;
+} CooSlabBlock;
+
+typedef struct CooSlabClass {
+    void *free_chunks; /* singly linked through first bytes of chunks */
+    char *bump, *bump_end;
+    size_t chunk_size;
+} CooSlabClass;
+
+typedef struct CooSlabAllocator {
+    CooAllocator base;
+    CooSlabClass classes[COO_SLAB_CLASSES];
+    CooSlabBlock *blocks;
+} CooSlabAllocator;
+
+static int _slab_class(size_t size) {
+    if (size <= 256)
+        return size ? (int)((size - 1) / 16) : 0;
+    int c = 16;
+    for (size_t class_size = 512; class_size < size; class_size *= 2)
+        ++c;
+    return c;
+}
+
+static void *_slab_alloc(CooAllocator *allocator, size_t size) {
+    if (size > COO_SLAB_MAX_SIZE)
+        return malloc(size);
+    CooSlabAllocator *a = (CooSlabAllocator *)allocator;
+    CooSlabClass *c = a->classes + _slab_class(size);
+    if (c->free_chunks) {
+        void *chunk = c->free_chunks;
+        c->free_chunks = *(void **)chunk;
+        return chunk;
+    }
+    if (c->bump == c->bump_end) { /* carve a new block, header is padded to keep chunks aligned */
+        CooSlabBlock *b = malloc(COO_ARENA_HEADER_SIZE + COO_SLAB_BLOCK_SIZE);
+        b->next = a->blocks;
+        a->blocks = b;
+        c->bump = (char *)b + COO_ARENA_HEADER_SIZE;
+        c->bump_end = c->bump + (COO_SLAB_BLOCK_SIZE / c->chunk_size) * c->chunk_size;
+    }
+    void *chunk = c->bump;
+    c->bump += c->chunk_size;
+    return chunk;
+}
+
+static void _slab_free(CooAllocator *allocator, void *ptr, size_t size) {
+    if (size > COO_SLAB_MAX_SIZE) {
+        free(ptr);
+        return;
+    }
+    CooSlabAllocator *a = (CooSlabAllocator *)allocator;
+    CooSlabClass *c = a->classes + _slab_class(size);
+    *(void **)ptr = c->free_chunks;
+    c->free_chunks = ptr;
+}
+
+static int _slab_resize(CooAllocator *allocator, void *ptr, size_t size, size_t new_size) {
+    (void)allocator;
+    (void)ptr;
+    return new_size <= COO_SLAB_MAX_SIZE && _slab_class(new_size) == _slab_class(size); /* fits into same chunk */
+}
+
+static void _slab_destroy(CooAllocator *allocator) {
+    CooSlabAllocator *a = (CooSlabAllocator *)allocator;
+    while (a->blocks) {
+        CooSlabBlock *b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    free(a);
+}
+
+CooAllocator *coo_create_slab_allocator() {
+    CooSlabAllocator *a = malloc(sizeof(CooSlabAllocator));
+    a->base.alloc = _slab_alloc;
+    a->base.free = _slab_free;
+    a->base.resize = _slab_resize;
+    a->base.destroy = _slab_destroy;
+    a->blocks = 0;
+    for (int i = 0; i < COO_SLAB_CLASSES; ++i) {
+        CooSlabClass *c = a->classes + i;
+        c->free_chunks = 0;
+        c->bump = c->bump_end = 0;
+        c->chunk_size = i < 16 ? (size_t)(i + 1) * 16 : (size_t)512 << (i - 16);
+    }
+    return &a->base;
+}
+
+/* arena, bump allocates from large blocks that count their live allocations, a block is
+   released as soon as all allocations in it are freed, so data allocated in one update is
+   released in bulk once the following update frees old versions of data */
+
+typedef struct CooArenaBlock {
+    struct CooArenaBlock *prev, *next;
+    char *bump, *end;
+    size_t live_count;
+} CooArenaBlock;
+
+typedef struct CooArenaAllocator {
+    CooAllocator base;
+    CooArenaBlock *blocks; /* first block is the current one */
+    size_t block_size;
+} CooArenaAllocator;
+
+static size_t _round_up_size(size_t value, size_t base) {
+    return (value + base - 1) / base * base;
+}
+
+static void _unlink_arena_block(CooArenaAllocator *a, CooArenaBlock *b) {
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        a->blocks = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+}
+
+static void *_arena_alloc(CooAllocator *allocator, size_t size) {
+    CooArenaAllocator *a = (CooArenaAllocator *)allocator;
+    size_t total = COO_ARENA_HEADER_SIZE + _round_up_size(size, COO_ARENA_HEADER_SIZE);
+    CooArenaBlock *b = a->blocks;
+    if (b == 0 || (size_t)(b->end - b->bump) < total) {
+        size_t block_size = total > a->block_size ? total : a->block_size;
+        size_t header_size = _round_up_size(sizeof(CooArenaBlock), COO_ARENA_HEADER_SIZE);
+        b = malloc(header_size + block_size);
+        b->bump = (char *)b + header_size;
+        b->end = b->bump + block_size;
+        b->live_count = 0;
+        b->prev = 0;
+        b->next = a->blocks;
+        if (a->blocks)
+            a->blocks->prev = b;
+        a->blocks = b;
+    }
+    *(CooArenaBlock **)b->bump = b; /* allocation header points to its block */
+    void *ptr = b->bump + COO_ARENA_HEADER_SIZE;
+    b->bump += total;
+    ++b->live_count;
+    return ptr;
+}
+
+static void _arena_free(CooAllocator *allocator, void *ptr, size_t size) {
+    (void)size;
+    CooArenaAllocator *a = (CooArenaAllocator *)allocator;
+    CooArenaBlock *b = *(CooArenaBlock **)((char *)ptr - COO_ARENA_HEADER_SIZE);
+    assert(b->live_count > 0);
+    if (--b->live_count == 0) {
+        if (b == a->blocks) /* reuse current block from the start */
+            b->bump = (char *)b + _round_up_size(sizeof(CooArenaBlock), COO_ARENA_HEADER_SIZE);
+        else {
+            _unlink_arena_block(a, b);
+            free(b);
+        }
+    }
+}
+
+static void _arena_destroy(CooAllocator *allocator) {
+    CooArenaAllocator *a = (CooArenaAllocator *)allocator;
+    while (a->blocks) {
+        CooArenaBlock *b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    free(a);
+}
+
+CooAllocator *coo_create_arena_allocator(size_t block_size) {
+    CooArenaAllocator *a = malloc(sizeof(CooArenaAllocator));
+    a->base.alloc = _arena_alloc;
+    a->base.free = _arena_free;
+    a->base.resize = 0;
+    a->base.destroy = _arena_destroy;
+    a->blocks = 0;
+    a->block_size = block_size ? block_size : (size_t)1 << 24;
+    return &a->base;
+}
+
+/* huge page, batches above threshold are mapped from the OS aligned to huge pages and
+   pre-faulted by a pool of threads, freeing unmaps them right away so large old versions of
+   data don't stay in the heap after update, smaller batches use malloc */
+
+typedef struct CooHugePageAllocator {
+    CooAllocator base;
+    size_t threshold;
+    CooPool *pool; /* 0 if pages are faulted by calling thread */
+} CooHugePageAllocator;
+
+typedef struct CooPrefault {
+    char *mem;
+    size_t size;
+} CooPrefault;
+
+static void _prefault_job(void *jobs, int index) { /* each job touches pages of a single huge page */
+    CooPrefault *p = jobs;
+    size_t begin = (size_t)index * COO_HUGE_PAGE_SIZE;
+    size_t end = begin + COO_HUGE_PAGE_SIZE < p->size ? begin + COO_HUGE_PAGE_SIZE : p->size;
+    for (size_t i = begin; i < end; i += COO_PAGE_SIZE)
+        p->mem[i] = 0;
+}
+
+static void *_map_huge_pages(size_t size) {
+#ifdef _WIN32
+    return VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    /* map an extra huge page and trim both ends so mapping starts at huge page boundary */
+    size_t mapped = size + COO_HUGE_PAGE_SIZE;
+    char *mem = mmap(0, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return 0;
+    char *aligned = (char *)_round_up_size((uintptr_t)mem, COO_HUGE_PAGE_SIZE);
+    if (aligned != mem)
+        munmap(mem, aligned - mem);
+    munmap(aligned + size, mem + mapped - (aligned + size));
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    return aligned;
+#endif
+}
+
+static void _unmap_huge_pages(void *ptr, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+static void *_huge_page_alloc(CooAllocator *allocator, size_t size) {
+    CooHugePageAllocator *a = (CooHugePageAllocator *)allocator;
+    if (size < a->threshold)
+        return malloc(size);
+    size_t mapped = _round_up_size(size, COO_HUGE_PAGE_SIZE);
+    CooPrefault p = { _map_huge_pages(mapped), mapped };
+    if (p.mem)
+        _run_jobs(a->pool, _prefault_job, &p, (int)(mapped / COO_HUGE_PAGE_SIZE));
+    return p.mem;
+}
+
+static void _huge_page_free(CooAllocator *allocator, void *ptr, size_t size) {
+    CooHugePageAllocator *a = (CooHugePageAllocator *)allocator;
+    if (size < a->threshold)
+        free(ptr);
+    else
+        _unmap_huge_pages(ptr, _round_up_size(size, COO_HUGE_PAGE_SIZE));
+}
+
+/* mapping is rounded up to huge pages, so it can grow within its last page, and beyond it only
+   if the following address range is still free */
+static int _huge_page_resize(CooAllocator *allocator, void *ptr, size_t size, size_t new_size) {
+    CooHugePageAllocator *a = (CooHugePageAllocator *)allocator;
+    if (size < a->threshold)
+        return 0;
+    size_t mapped = _round_up_size(size, COO_HUGE_PAGE_SIZE);
+    size_t new_mapped = _round_up_size(new_size, COO_HUGE_PAGE_SIZE);
+    if (new_mapped <= mapped)
+        return 1;
+#ifdef MREMAP_MAYMOVE
+    if (mremap(ptr, mapped, new_mapped, 0) == MAP_FAILED)
+        return 0;
+#ifdef MADV_HUGEPAGE
+    madvise((char *)ptr + mapped, new_mapped - mapped, MADV_HUGEPAGE);
+#endif
+    CooPrefault p = { (char *)ptr + mapped, new_mapped - mapped };
+    _run_jobs(a->pool, _prefault_job, &p, (int)(p.size / COO_HUGE_PAGE_SIZE));
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void _huge_page_destroy(CooAllocator *allocator) {
+    CooHugePageAllocator *a = (CooHugePageAllocator *)allocator;
+    _destroy_pool(a->pool);
+    free(a);
+}
+
+CooAllocator *coo_create_huge_page_allocator(size_t threshold, int threads_count) {
+    CooHugePageAllocator *a = malloc(sizeof(CooHugePageAllocator));
+    a->base.alloc = _huge_page_alloc;
+    a->base.free = _huge_page_free;
+    a->base.resize = _huge_page_resize;
+    a->base.destroy = _huge_page_destroy;
+    a->threshold = threshold ? threshold : COO_HUGE_PAGE_SIZE;
+    a->pool = _create_pool(threads_count);
+    return &a->base;
+}
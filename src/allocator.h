@@ -0,0 +1,18 @@
+#ifndef coo_allocator_h
+#define coo_allocator_h
+
+#include <stddef.h>
+
+
+typedef struct CooAllocator {
+    void *(*alloc)(struct CooAllocator *allocator, size_t size);
+    void (*free)(struct CooAllocator *allocator, void *ptr, size_t size);
+    /* grows block in place, returns 0 if it would have to move, 0 if allocator never grows in place */
+    int (*resize)(struct CooAllocator *allocator, void *ptr, size_t size, size_t new_size);
+    void (*destroy)(struct CooAllocator *allocator);
+} CooAllocator;
+
+/* default allocator using C's malloc and free */
+extern CooAllocator CooMallocAllocator;
+
+#endif
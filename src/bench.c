@@ -0,0 +1,203 @@
+#include "bench.h"
+#include "coo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <time.h>
+
+#define COO_BENCH_BATCH_COUNT   4096 /* elements per batch of migrated data */
+#define COO_BENCH_POINTERS      8 /* pointers per node of pointer graph */
+
+
+static const size_t _heap_sizes[] = { 1 << 20, 16 << 20, 64 << 20 };
+
+static double _now() {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static uint64_t _random(uint64_t *state) { /* xorshift64 */
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void _report(const char *name, size_t heap_bytes, const char *unit, double value) {
+    printf("%s,%zu,%s,%.4f\n", name, heap_bytes, unit, value);
+    fflush(stdout);
+}
+
+static int _is_selected(const char *name, int filters_count, char **filters) {
+    if (filters_count == 0)
+        return 1;
+    for (int i = 0; i < filters_count; ++i)
+        if (strncmp(name, filters[i], strlen(filters[i])) == 0)
+            return 1;
+    return 0;
+}
+
+/* migration, elements are migrated between two layouts of a type, nested type is optional */
+
+typedef struct CooBenchTypes {
+    CooType *type;
+    CooType *nested;
+} CooBenchTypes;
+
+typedef void (*COO_BENCH_LAYOUT_FUNC)(CooState *s, CooBenchTypes *t);
+
+static void _define_copy(CooState *s, CooBenchTypes *t) {
+    t->type = coo_create_type(s, "T");
+    coo_add_var(t->type, "a", &CooI64);
+    coo_add_var(t->type, "b", &CooI64);
+    coo_add_var(t->type, "c", &CooI64);
+    coo_add_var(t->type, "d", &CooI64);
+}
+
+static void _change_copy(CooState *s, CooBenchTypes *t) { /* shifts whole instance, one large copy */
+    (void)s;
+    coo_ins_var(t->type, "e", &CooI64, 0);
+}
+
+static void _define_cast(CooState *s, CooBenchTypes *t) {
+    t->type = coo_create_type(s, "T");
+    coo_add_arr(t->type, "a", &CooI32, 8);
+}
+
+static void _change_cast(CooState *s, CooBenchTypes *t) {
+    (void)s;
+    coo_retype_var(t->type, "a", &CooF64);
+}
+
+static void _define_nested(CooState *s, CooBenchTypes *t) {
+    t->nested = coo_create_type(s, "N");
+    coo_add_var(t->nested, "a", &CooI32);
+    coo_add_var(t->nested, "b", &CooF32);
+    t->type = coo_create_type(s, "T");
+    coo_add_arr(t->type, "n", t->nested, 4);
+    coo_add_var(t->type, "z", &CooI64);
+}
+
+static void _change_nested(CooState *s, CooBenchTypes *t) { /* every nested instance is copied separately */
+    (void)s;
+    coo_ins_var(t->nested, "c", &CooI32, 0);
+}
+
+static void _define_resize(CooState *s, CooBenchTypes *t) {
+    t->type = coo_create_type(s, "T");
+    coo_add_arr(t->type, "a", &CooI32, 16);
+    coo_add_var(t->type, "b", &CooI64);
+}
+
+static void _change_resize(CooState *s, CooBenchTypes *t) {
+    (void)s;
+    coo_resize_array(t->type, "a", 24);
+}
+
+static void _bench_migration(const char *name, COO_BENCH_LAYOUT_FUNC define, COO_BENCH_LAYOUT_FUNC change,
+                             size_t heap_bytes) {
+    CooState *s = coo_create_state();
+    CooBenchTypes t = { 0, 0 };
+    define(s, &t);
+    coo_begin_update(s);
+    coo_end_update(s);
+
+    CooAlloc *a = coo_get_alloc(s, t.type);
+    size_t batch_bytes = (size_t)coo_type_size(t.type) * COO_BENCH_BATCH_COUNT;
+    for (size_t bytes = 0; bytes < heap_bytes; bytes += batch_bytes)
+        memset(coo_alloc(a, COO_BENCH_BATCH_COUNT), 1, batch_bytes);
+
+    change(s, &t);
+    double begin = _now();
+    coo_begin_update(s);
+    coo_end_update(s);
+    double seconds = _now() - begin;
+    _report(name, heap_bytes, "GB/s", heap_bytes / seconds / 1e9);
+    coo_destroy_state(s);
+}
+
+/* allocation, batches are allocated and then freed in the same order */
+
+static void _bench_alloc(const char *name, int count, size_t heap_bytes) {
+    CooState *s = coo_create_state();
+    CooType *t = coo_create_type(s, "T");
+    coo_add_var(t, "a", &CooI64);
+    coo_add_var(t, "b", &CooI64);
+    coo_begin_update(s);
+    coo_end_update(s);
+
+    CooAlloc *a = coo_get_alloc(s, t);
+    int ops_count = (int)(heap_bytes / ((size_t)coo_type_size(t) * count));
+    void **batches = malloc(sizeof(void *) * ops_count);
+    double begin = _now();
+    for (int i = 0; i < ops_count; ++i)
+        batches[i] = coo_alloc(a, count);
+    for (int i = 0; i < ops_count; ++i)
+        coo_free(a, batches[i]);
+    double seconds = _now() - begin;
+    _report(name, heap_bytes, "ops/s", 2.0 * ops_count / seconds);
+    free(batches);
+    coo_destroy_state(s);
+}
+
+/* redirection, nodes that don't change point to random single element batches that move */
+
+static void _bench_redirection(const char *name, size_t heap_bytes) {
+    CooState *s = coo_create_state();
+    CooType *target = coo_create_type(s, "Target");
+    coo_add_var(target, "v", &CooI64);
+    CooType *node = coo_create_type(s, "Node");
+    coo_add_ptr_arr(node, "p", target, COO_BENCH_POINTERS);
+    coo_begin_update(s);
+    coo_end_update(s);
+
+    int nodes_count = (int)(heap_bytes / coo_type_size(node));
+    int targets_count = nodes_count / 16 + 1;
+    CooAlloc *target_alloc = coo_get_alloc(s, target);
+    void **targets = malloc(sizeof(void *) * targets_count);
+    for (int i = 0; i < targets_count; ++i)
+        targets[i] = coo_alloc(target_alloc, 1);
+    void **nodes = coo_alloc(coo_get_alloc(s, node), nodes_count);
+    uint64_t state = 88172645463325252ull;
+    for (int i = 0; i < nodes_count * COO_BENCH_POINTERS; ++i)
+        nodes[i] = targets[_random(&state) % targets_count];
+    free(targets);
+
+    coo_add_var(target, "w", &CooI64);
+    double begin = _now();
+    coo_begin_update(s);
+    coo_end_update(s);
+    double seconds = _now() - begin;
+    _report(name, heap_bytes, "pointers/s", (double)nodes_count * COO_BENCH_POINTERS / seconds);
+    coo_destroy_state(s);
+}
+
+void coo_bench(int filters_count, char **filters) {
+    struct {
+        const char *name;
+        COO_BENCH_LAYOUT_FUNC define, change;
+    } migrations[] = {
+        { "migrate_copy", _define_copy, _change_copy },
+        { "migrate_cast", _define_cast, _change_cast },
+        { "migrate_nested", _define_nested, _change_nested },
+        { "migrate_resize", _define_resize, _change_resize },
+    };
+    int heap_sizes_count = (int)(sizeof(_heap_sizes) / sizeof(_heap_sizes[0]));
+    printf("name,heap_bytes,unit,value\n");
+    for (int i = 0; i < (int)(sizeof(migrations) / sizeof(migrations[0])); ++i)
+        if (_is_selected(migrations[i].name, filters_count, filters))
+            for (int j = 0; j < heap_sizes_count; ++j)
+                _bench_migration(migrations[i].name, migrations[i].define, migrations[i].change, _heap_sizes[j]);
+    for (int j = 0; j < heap_sizes_count; ++j) {
+        if (_is_selected("alloc_single", filters_count, filters))
+            _bench_alloc("alloc_single", 1, _heap_sizes[j]);
+        if (_is_selected("alloc_batch", filters_count, filters))
+            _bench_alloc("alloc_batch", 64, _heap_sizes[j]);
+    }
+    if (_is_selected("redirect", filters_count, filters))
+        for (int j = 0; j < heap_sizes_count; ++j)
+            _bench_redirection("redirect", _heap_sizes[j]);
+}
@@ -0,0 +1,9 @@
+#ifndef coo_bench_h
+#define coo_bench_h
+
+
+/* runs benchmarks whose names start with one of the filters (all if there are none) and prints
+   one comma separated line per result */
+void coo_bench(int filters_count, char **filters);
+
+#endif
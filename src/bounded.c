@@ -0,0 +1,234 @@
+#include "bounded.h"
+#include "state.h"
+#include "layout.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#define COO_BOUNDED_FLUSH_DIVISOR 4 /* migrate batches in groups of at most budget / divisor bytes */
+
+
+typedef struct CooHolder { /* alloc and affected types its data can point to */
+    CooAlloc *alloc;
+    CooType **pointees;
+    int pointees_count, pointees_capacity;
+    int is_redirected;
+} CooHolder;
+
+typedef struct CooOldTag { /* migrated old batch that is not freed yet */
+    CooTag *tag;
+    CooType *type;
+} CooOldTag;
+
+typedef struct CooBounded {
+    CooHolder *holders;
+    int holders_count;
+    CooType **order; /* types in dependency order, pointees first */
+    int order_count, order_capacity;
+    CooOldTag *old_tags;
+    int old_tags_count, old_tags_capacity;
+    size_t old_bytes; /* duplicated bytes, size of new versions of old_tags */
+} CooBounded;
+
+static void _add_pointee(CooHolder *h, CooType *t) {
+    for (int i = 0; i < h->pointees_count; ++i)
+        if (h->pointees[i] == t)
+            return;
+    if (h->pointees_count == h->pointees_capacity) {
+        h->pointees_capacity = h->pointees_capacity ? h->pointees_capacity * 2 : 4;
+        h->pointees = realloc(h->pointees, sizeof(CooType *) * h->pointees_capacity);
+    }
+    h->pointees[h->pointees_count++] = t;
+}
+
+/* pointer to a type that doesn't move itself can point into moved data that contains it, so
+   it waits for all moved types */
+static void _add_pointees(CooState *s, CooHolder *h, CooType *t) {
+    if (t->is_moved)
+        _add_pointee(h, t);
+    else if (_is_relocated(t, s->is_relocated))
+        for (int i = 0; i < s->types_count; ++i)
+            if (s->types[i]->is_moved)
+                _add_pointee(h, s->types[i]);
+}
+
+static void _collect_pointees(CooState *s, CooHolder *h, CooType *t) {
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVar *v = t->vars + i;
+        if (v->is_ptr)
+            _add_pointees(s, h, v->type);
+        else if (v->type->points_to_moved)
+            _collect_pointees(s, h, v->type);
+    }
+}
+
+static void _init_holder(CooState *s, CooHolder *h, CooAlloc *a) {
+    h->alloc = a;
+    h->pointees = 0;
+    h->pointees_count = 0;
+    h->pointees_capacity = 0;
+    h->is_redirected = false;
+    if (a->is_ptr)
+        _add_pointees(s, h, a->type);
+    else if (a->type->points_to_moved)
+        _collect_pointees(s, h, a->type);
+    for (int i = 0; i < h->pointees_count; ++i)
+        ++h->pointees[i]->pending_holders;
+}
+
+static CooHolder *_struct_holder(CooState *s, CooType *t) {
+    CooAlloc *a = _find_alloc(s, t, false);
+    return a ? s->bounded->holders + a->index : 0;
+}
+
+static void _order_type(CooState *s, CooType *t, int update_id) {
+    CooBounded *b = s->bounded;
+    if (t->is_fixed || t->order_update_id == update_id)
+        return;
+    t->order_update_id = update_id;
+    CooHolder *h = _struct_holder(s, t);
+    if (h)
+        for (int i = 0; i < h->pointees_count; ++i)
+            _order_type(s, h->pointees[i], update_id);
+    if (b->order_count == b->order_capacity) {
+        b->order_capacity = b->order_capacity ? b->order_capacity * 2 : 16;
+        b->order = realloc(b->order, sizeof(CooType *) * b->order_capacity);
+    }
+    b->order[b->order_count++] = t;
+}
+
+/* frees migrated old batches of a type or all of them if type is 0 */
+static void _release_old_tags(CooState *s, CooType *type) {
+    CooBounded *b = s->bounded;
+    int kept = 0;
+    for (int i = 0; i < b->old_tags_count; ++i) {
+        CooOldTag *o = b->old_tags + i;
+        if (type == 0 || o->type == type) {
+            b->old_bytes -= (size_t)o->type->size * o->tag->count;
+            ++o->tag->alloc->stats.freed_batches;
+            _free_tag(o->tag);
+        }
+        else
+            b->old_tags[kept++] = *o;
+    }
+    b->old_tags_count = kept;
+}
+
+static void _push_old_tag(CooBounded *b, CooTag *tag, CooType *type) {
+    if (b->old_tags_count == b->old_tags_capacity) {
+        b->old_tags_capacity = b->old_tags_capacity ? b->old_tags_capacity * 2 : 64;
+        b->old_tags = realloc(b->old_tags, sizeof(CooOldTag) * b->old_tags_capacity);
+    }
+    CooOldTag *o = b->old_tags + b->old_tags_count++;
+    o->tag = tag;
+    o->type = type;
+    b->old_bytes += (size_t)type->size * tag->count;
+}
+
+static int _pointees_migrated(CooHolder *h) {
+    for (int i = 0; i < h->pointees_count; ++i)
+        if (h->pointees[i]->is_migrated == false)
+            return false;
+    return true;
+}
+
+static void _migrate_alloc(CooState *s, CooHolder *h) {
+    CooBounded *b = s->bounded;
+    CooAlloc *a = h->alloc;
+    size_t flush_bytes = s->update_budget / COO_BOUNDED_FLUSH_DIVISOR;
+    int redirect_pointers = _pointees_migrated(h); /* otherwise pointers are redirected when pointees are migrated */
+    h->is_redirected = redirect_pointers;
+    if (a->type->is_in_place) { /* nothing is duplicated */
+        s->jobs.jobs_count = 0;
+        for (CooTag *tag = a->first; tag; tag = tag->next)
+            _update_tag_data_layout(a, tag, &s->jobs, redirect_pointers);
+        _run_jobs(s->pool, _run_migration_job, s->jobs.jobs, s->jobs.jobs_count);
+        return;
+    }
+    CooTag *o_tag = a->first, *n_prev = 0;
+    a->first = 0;
+    while (o_tag) {
+        CooTag *o_begin = o_tag;
+        size_t bytes = 0;
+        s->jobs.jobs_count = 0;
+        do { /* migrate a group of batches */
+            _update_tag_data_layout(a, o_tag, &s->jobs, redirect_pointers);
+            bytes += (size_t)a->type->size * o_tag->count;
+            o_tag = o_tag->next;
+        } while (o_tag && bytes < flush_bytes);
+        _run_jobs(s->pool, _run_migration_job, s->jobs.jobs, s->jobs.jobs_count);
+        for (CooTag *tag = o_begin; tag != o_tag; tag = tag->next) { /* link new batches */
+            CooTag *n_tag = tag->redirect;
+            n_tag->prev = n_prev;
+            n_tag->next = 0;
+            if (n_prev)
+                n_prev->next = n_tag;
+            else
+                a->first = n_tag;
+            n_prev = n_tag;
+            _set_forward(&s->forwards, tag);
+            _push_old_tag(b, tag, a->type);
+        }
+        if (b->old_bytes > s->update_budget) /* over budget, free old batches and forward through addresses */
+            _release_old_tags(s, 0);
+    }
+}
+
+static void _redirect_ready_holders(CooState *s) {
+    CooBounded *b = s->bounded;
+    for (int i = 0; i < b->holders_count; ++i) {
+        CooHolder *h = b->holders + i;
+        if (h->is_redirected == false && _pointees_migrated(h)) {
+            if (h->alloc->is_ptr || h->alloc->type->is_affected == false || h->alloc->type->is_migrated)
+                _redirect_alloc_data(h->alloc);
+            else
+                continue; /* data not migrated yet */
+            h->is_redirected = true;
+        }
+        if (h->is_redirected && h->pointees_count) { /* nothing else in this alloc points to old data */
+            for (int j = 0; j < h->pointees_count; ++j)
+                if (--h->pointees[j]->pending_holders == 0)
+                    _release_old_tags(s, h->pointees[j]);
+            h->pointees_count = 0;
+        }
+    }
+}
+
+void _begin_bounded_update(CooState *s) {
+    CooBounded *b = s->bounded = calloc(1, sizeof(CooBounded));
+    for (int i = 0; i < s->types_count; ++i) {
+        s->types[i]->pending_holders = 0;
+        s->types[i]->is_migrated = false;
+    }
+    b->holders = malloc(sizeof(CooHolder) * (s->allocs_count ? s->allocs_count : 1));
+    b->holders_count = s->allocs_count;
+    for (int i = 0; i < s->allocs_count; ++i)
+        _init_holder(s, b->holders + i, s->allocs[i]);
+    for (int i = 0; i < s->types_count; ++i)
+        _order_type(s, s->types[i], s->update_id);
+
+    for (int i = 0; i < b->order_count; ++i) {
+        CooType *t = b->order[i];
+        CooHolder *h = _struct_holder(s, t);
+        if (h && t->is_affected)
+            _migrate_alloc(s, h);
+        t->is_migrated = true;
+        if (t->pending_holders == 0) /* nothing points to this type */
+            _release_old_tags(s, t);
+        _redirect_ready_holders(s);
+    }
+    _release_old_tags(s, 0);
+}
+
+void _end_bounded_update(CooState *s) {
+    CooBounded *b = s->bounded;
+    _deactivate_forwards(&s->forwards);
+    for (int i = 0; i < b->holders_count; ++i)
+        free(b->holders[i].pointees);
+    free(b->holders);
+    free(b->order);
+    free(b->old_tags);
+    free(b);
+    s->bounded = 0;
+}
@@ -0,0 +1,12 @@
+#ifndef coo_bounded_h
+#define coo_bounded_h
+
+
+struct CooState;
+
+/* bounded update migrates types in dependency order and frees old batches early to keep
+   memory overhead near the budget, called after type layouts are updated */
+void _begin_bounded_update(struct CooState *s);
+void _end_bounded_update(struct CooState *s);
+
+#endif
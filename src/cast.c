@@ -0,0 +1,143 @@
+#include "cast.h"
+#include "coo.h"
+#include "layout.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define COO_SSE2
+#endif
+
+
+/* contiguous aligned values go through simd kernel which returns how many values it converted,
+   rest are converted one by one, loops are simple enough to be vectorized by compiler, strided
+   values and values of packed types are copied through memcpy as they can be unaligned */
+#define COO_CAST(name, src_t, dst_t, simd) \
+    static void name(const void *src, void *dst, int count, int src_stride, int dst_stride) { \
+        if (src_stride == sizeof(src_t) && dst_stride == sizeof(dst_t) && \
+            (uintptr_t)src % sizeof(src_t) == 0 && (uintptr_t)dst % sizeof(dst_t) == 0) { \
+            const src_t *s = src; \
+            dst_t *d = dst; \
+            for (int i = simd(s, d, count); i < count; ++i) \
+                d[i] = (dst_t)s[i]; \
+        } \
+        else \
+            for (int i = 0; i < count; ++i) { \
+                src_t s; \
+                memcpy(&s, (const char *)src + (size_t)src_stride * i, sizeof(s)); \
+                dst_t d = (dst_t)s; \
+                memcpy((char *)dst + (size_t)dst_stride * i, &d, sizeof(d)); \
+            } \
+    }
+
+#define _no_simd(s, d, count) 0
+
+#ifdef COO_SSE2
+
+static void _store_i32_as_i64(int64_t *d, __m128i v) {
+    __m128i sign = _mm_srai_epi32(v, 31);
+    _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi32(v, sign));
+    _mm_storeu_si128((__m128i *)(d + 2), _mm_unpackhi_epi32(v, sign));
+}
+
+static void _store_i32_as_f64(double *d, __m128i v) {
+    _mm_storeu_pd(d, _mm_cvtepi32_pd(v));
+    _mm_storeu_pd(d + 2, _mm_cvtepi32_pd(_mm_srli_si128(v, 8)));
+}
+
+/* sign extension by duplicating values into both halves and shifting right arithmetically */
+static __m128i _i16_lo_to_i32(__m128i v) { return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16); }
+static __m128i _i16_hi_to_i32(__m128i v) { return _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16); }
+static __m128i _i8_lo_to_i16(__m128i v) { return _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8); }
+static __m128i _i8_hi_to_i16(__m128i v) { return _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8); }
+
+#define COO_SIMD_I8(name, dst_t, store) \
+    static int name(const int8_t *s, dst_t *d, int count) { \
+        int i = 0; \
+        for (; i + 16 <= count; i += 16) { \
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i)); \
+            __m128i lo = _i8_lo_to_i16(v), hi = _i8_hi_to_i16(v); \
+            store(d + i, _i16_lo_to_i32(lo)); \
+            store(d + i + 4, _i16_hi_to_i32(lo)); \
+            store(d + i + 8, _i16_lo_to_i32(hi)); \
+            store(d + i + 12, _i16_hi_to_i32(hi)); \
+        } \
+        return i; \
+    }
+
+#define COO_SIMD_I16(name, dst_t, store) \
+    static int name(const int16_t *s, dst_t *d, int count) { \
+        int i = 0; \
+        for (; i + 8 <= count; i += 8) { \
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i)); \
+            store(d + i, _i16_lo_to_i32(v)); \
+            store(d + i + 4, _i16_hi_to_i32(v)); \
+        } \
+        return i; \
+    }
+
+#define COO_SIMD_I32(name, dst_t, store) \
+    static int name(const int32_t *s, dst_t *d, int count) { \
+        int i = 0; \
+        for (; i + 4 <= count; i += 4) \
+            store(d + i, _mm_loadu_si128((const __m128i *)(s + i))); \
+        return i; \
+    }
+
+COO_SIMD_I8(_simd_i8_to_i64, int64_t, _store_i32_as_i64)
+COO_SIMD_I8(_simd_i8_to_f64, double, _store_i32_as_f64)
+COO_SIMD_I16(_simd_i16_to_i64, int64_t, _store_i32_as_i64)
+COO_SIMD_I16(_simd_i16_to_f64, double, _store_i32_as_f64)
+COO_SIMD_I32(_simd_i32_to_i64, int64_t, _store_i32_as_i64)
+COO_SIMD_I32(_simd_i32_to_f64, double, _store_i32_as_f64)
+
+static int _simd_f32_to_f64(const float *s, double *d, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_loadu_ps(s + i);
+        _mm_storeu_pd(d + i, _mm_cvtps_pd(v));
+        _mm_storeu_pd(d + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+    return i;
+}
+
+#else
+
+#define _simd_i8_to_i64 _no_simd
+#define _simd_i8_to_f64 _no_simd
+#define _simd_i16_to_i64 _no_simd
+#define _simd_i16_to_f64 _no_simd
+#define _simd_i32_to_i64 _no_simd
+#define _simd_i32_to_f64 _no_simd
+#define _simd_f32_to_f64 _no_simd
+
+#endif
+
+COO_CAST(_i8_to_i16, int8_t, int16_t, _no_simd)
+COO_CAST(_i8_to_i32, int8_t, int32_t, _no_simd)
+COO_CAST(_i8_to_i64, int8_t, int64_t, _simd_i8_to_i64)
+COO_CAST(_i8_to_f32, int8_t, float, _no_simd)
+COO_CAST(_i8_to_f64, int8_t, double, _simd_i8_to_f64)
+COO_CAST(_i16_to_i32, int16_t, int32_t, _no_simd)
+COO_CAST(_i16_to_i64, int16_t, int64_t, _simd_i16_to_i64)
+COO_CAST(_i16_to_f32, int16_t, float, _no_simd)
+COO_CAST(_i16_to_f64, int16_t, double, _simd_i16_to_f64)
+COO_CAST(_i32_to_i64, int32_t, int64_t, _simd_i32_to_i64)
+COO_CAST(_i32_to_f64, int32_t, double, _simd_i32_to_f64)
+COO_CAST(_f32_to_f64, float, double, _simd_f32_to_f64)
+
+void _add_primitive_casts() {
+    _add_cast(&CooI8, &CooI16, _i8_to_i16);
+    _add_cast(&CooI8, &CooI32, _i8_to_i32);
+    _add_cast(&CooI8, &CooI64, _i8_to_i64);
+    _add_cast(&CooI8, &CooF32, _i8_to_f32);
+    _add_cast(&CooI8, &CooF64, _i8_to_f64);
+    _add_cast(&CooI16, &CooI32, _i16_to_i32);
+    _add_cast(&CooI16, &CooI64, _i16_to_i64);
+    _add_cast(&CooI16, &CooF32, _i16_to_f32);
+    _add_cast(&CooI16, &CooF64, _i16_to_f64);
+    _add_cast(&CooI32, &CooI64, _i32_to_i64);
+    _add_cast(&CooI32, &CooF64, _i32_to_f64);
+    _add_cast(&CooF32, &CooF64, _f32_to_f64);
+}
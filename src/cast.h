@@ -0,0 +1,9 @@
+#ifndef coo_cast_h
+#define coo_cast_h
+
+
+/* registers casts between primitive types, widening casts to 64 bits use SIMD kernels for
+   contiguous values when available */
+void _add_primitive_casts();
+
+#endif
@@ -1,10 +1,25 @@
 #ifndef coo_h
 #define coo_h
 
+#include <stddef.h>
 
 typedef struct CooState CooState;
 typedef struct CooType CooType;
 typedef struct CooAlloc CooAlloc;
+typedef struct CooAllocator CooAllocator;
+
+typedef struct CooUpdateStats {
+    double layout_time, migration_time, redirection_time, free_time; /* in seconds, whole update only */
+    size_t copied_bytes, zeroed_bytes, defaulted_bytes, cast_bytes; /* written into migrated data */
+    size_t cast_values; /* cast functions are called for runs of values, not one by one */
+    size_t allocated_batches, freed_batches;
+    size_t redirected_pointers;
+} CooUpdateStats;
+
+typedef void *(*COO_ALLOC_FUNC)(void *context, size_t size);
+typedef void (*COO_FREE_FUNC)(void *context, void *ptr, size_t size);
+typedef void (*COO_UPDATE_STATS_FUNC)(void *context, CooState *s, const CooUpdateStats *stats);
+typedef void (*COO_CAST_FUNC)(const void *src, void *dst, int count, int src_stride, int dst_stride);
 
 /* create and destroy coo state */
 CooState *coo_create_state();
@@ -16,25 +31,141 @@ CooType *coo_create_type(CooState *s, const char *name);
 /* remove existing struct type and all allocs for that type */
 void coo_remove_type(CooState *s, const char *name);
 
+/* save all types and data into a file, and load them into a state without data, types in file
+   that differ from types in state are migrated to layouts in state, loaded data is mapped from
+   file and its memory is released when all of it is freed, false if file can't be used or if
+   state has pointers outside of coo data, whole file is validated before types or allocs are changed */
+int coo_save_state(CooState *s, const char *path);
+int coo_load_state(CooState *s, const char *path);
+
 /* find or create alloc for a specific type (struct or primitive) */
 CooAlloc *coo_get_alloc(CooState *s, CooType *type);
 
 /* find or create alloc for pointers to specific type (struct or primitive) */
 CooAlloc *coo_get_ptr_alloc(CooState *s, CooType *type);
 
+/* find or create alloc that stores each variable of a struct type in its own column, batches are
+   arrays of columns that are accessed with coo_get_column, unchanged columns are kept as they are
+   when type changes, pointers into columns that move are redirected like pointers into elements,
+   soa data can't be migrated by lazy or bounded update and can't be saved */
+CooAlloc *coo_get_soa_alloc(CooState *s, CooType *type);
+
+/* base of the column of a variable in a soa batch, element i of the variable is at index i
+   (or i * array length for array variables) */
+void *coo_get_column(CooAlloc *a, void *batch, const char *var_name);
+
 /* remove existing alloc for a specific type (struct or primitive) */
 void coo_remove_alloc(CooState *s, CooType *type);
 
 /* remove existing alloc for pointers to specific type (struct or primitive) */
 void coo_remove_ptr_alloc(CooState *s, CooType *type);
 
+/* remove existing soa alloc for specific struct type */
+void coo_remove_soa_alloc(CooState *s, CooType *type);
+
+/* allocators, must outlive all data allocated with them */
+CooAllocator *coo_create_allocator(COO_ALLOC_FUNC alloc_func, COO_FREE_FUNC free_func, void *context);
+CooAllocator *coo_create_slab_allocator(); /* size classes for small batches, larger ones use malloc */
+CooAllocator *coo_create_arena_allocator(size_t block_size); /* bump allocation, blocks freed when empty */
+/* maps batches of at least threshold bytes with huge pages pre-faulted by threads_count threads and
+   releases them to OS when freed, smaller batches use malloc */
+CooAllocator *coo_create_huge_page_allocator(size_t threshold, int threads_count);
+void coo_destroy_allocator(CooAllocator *allocator);
+
+/* allocator for all allocs in state (malloc and free by default) and allocator for new versions
+   of data created during update (same as allocs' allocator by default, 0 to reset) */
+void coo_set_allocator(CooState *s, CooAllocator *allocator);
+void coo_set_update_allocator(CooState *s, CooAllocator *allocator);
+
+/* allocator for data allocated in a single alloc with coo_alloc */
+void coo_set_alloc_allocator(CooAlloc *a, CooAllocator *allocator);
+
 /* delete all data in an alloc */
 void coo_clear_alloc(CooAlloc *a);
 
-/* struct layout updating with pointer redirection */
+/* number of threads used to migrate data during update, 1 by default */
+void coo_set_threads_count(CooState *s, int threads_count);
+
+/* limit memory duplicated during update to approximately budget bytes by migrating types in
+   dependency order and freeing old data early, 0 by default (all data is duplicated) */
+void coo_set_update_budget(CooState *s, size_t budget);
+
+/* struct layout updating with pointer redirection, between update begin and end pointers can point
+   anywhere inside elements and are mapped to the same value in the new layout, 0 if value was
+   removed, outside of update and in lazy update pointers have to point at start of a batch, while
+   any state is in update that is not lazy data of other states isn't migrated on access */
 void coo_begin_update(CooState *s);
 void coo_end_update(CooState *s);
 void *coo_update_pointer(void *ptr);
+void coo_update_pointers(void **ptrs, size_t count); /* large arrays are sorted by address first */
+
+/* host array of pointers into coo data that is updated with coo_update_pointers when update ends,
+   adding same array again changes its count, array has to stay valid until it is removed */
+void coo_add_roots(CooState *s, void **ptrs, size_t count);
+void coo_remove_roots(CooState *s, void **ptrs);
+
+/* async update migrates data into new batches on worker threads while host keeps using old data,
+   batches written to during migration have to be marked dirty and are migrated again when update
+   is finished, pointers are redirected when update is finished and host pointers can then be
+   updated until update ends, data can't be allocated or freed until update is finished, with a
+   single thread data is migrated when update is finished, budget and lazy update are ignored */
+void coo_begin_update_async(CooState *s);
+int coo_is_update_ready(CooState *s); /* migration is done and finishing update won't wait for it */
+void coo_finish_update(CooState *s);
+void coo_mark_dirty(void *batch); /* pointer to start of a batch, ignored if batch doesn't move */
+
+/* statistics of the last update, for whole state, for all allocs of a type or for a single alloc,
+   data migrated on access after lazy update isn't counted */
+CooUpdateStats coo_get_update_stats(CooState *s);
+CooUpdateStats coo_get_type_update_stats(CooState *s, CooType *t);
+CooUpdateStats coo_get_alloc_update_stats(CooAlloc *a);
+
+/* function called with statistics at the end of each update, 0 to remove it */
+void coo_set_update_stats_callback(CooState *s, COO_UPDATE_STATS_FUNC func, void *context);
+
+/* lazy update only bumps layout versions and migrates data the first time it is accessed through
+   coo_update_pointer, coo_next_batch or coo_touch, data reachable through its pointers is migrated
+   with it, off by default (all data is migrated during update), budget is ignored in lazy update */
+void coo_set_lazy_update(CooState *s, int is_lazy);
+
+/* migrate all data of an alloc that is not migrated yet */
+void coo_touch(CooAlloc *a);
+
+/* iterate batches of an alloc and migrate them if needed, pass 0 to get the first batch,
+   returns 0 after the last batch */
+void *coo_next_batch(CooAlloc *a, void *batch, int *count);
+
+/* size of type's instances in current layout, in bytes, without cold part */
+int coo_type_size(CooType *t);
+
+/* lay out variables by descending alignment instead of declaration order to minimize padding, off by
+   default, takes effect on next update that migrates data to the new order */
+void coo_set_optimized_layout(CooType *t, int is_optimized);
+
+/* pack(packing) for variables of a type, aligning them to at most packing bytes, and alignment of
+   at least alignment bytes for instances of a type, both powers of two and 0 for natural alignment,
+   batches of over-aligned types start at their alignment, changing either is a layout change */
+void coo_set_type_packing(CooType *t, int packing);
+void coo_set_type_alignment(CooType *t, int alignment);
+
+/* cold variables are stored apart from hot ones, in a side buffer of each batch with its own layout,
+   so loops over hot variables touch less memory, moving a variable between parts is a layout change,
+   batches with cold variables can't be migrated by lazy or bounded update and can't be saved, types
+   with cold variables can't be contained by value and pointers into cold variables aren't redirected */
+void coo_set_var_cold(CooType *t, const char *var_name, int is_cold);
+
+/* cold part of element i of a batch is at coo_get_cold(batch) + i * coo_cold_size(type) */
+void *coo_get_cold(void *batch);
+int coo_cold_size(CooType *t); /* 0 if type has no cold variables */
+
+/* offset of a variable in current layout, in bytes, relative to cold part for cold variables, -1 if
+   there's no such variable */
+int coo_var_offset(CooType *t, const char *var_name);
+
+/* write C struct definitions matching current layouts of all struct types in state, variables in
+   offset order, packed types in pack pragmas, cold part of a type is a struct with _cold suffix,
+   false if file can't be written */
+int coo_write_header(CooState *s, const char *path);
 
 /* adding/inserting single/array value variables */
 void coo_add_var(CooType *t, const char *v_name, CooType *v_type);
@@ -54,9 +185,24 @@ void coo_resize_array(CooType *t, const char *var_name, int length);
 void coo_move_var(CooType *t, const char *var_name, int position);
 void coo_retype_var(CooType *t, const char *var_name, CooType *to_type);
 
+/* default value of a primitive variable, value points to a single element of variable type and
+   is copied, 0 resets default to 0, used for new variables, new array elements, values without
+   a cast and data allocated with coo_alloc */
+void coo_set_var_default(CooType *t, const char *var_name, const void *value);
+
+/* register function that converts count values of from_type into to_type when a variable is
+   retyped, strides are in bytes, replaces previous function for the same types, also in lazily
+   migrated data that is not migrated yet, casts of primitive types are shared by all states and
+   can be registered before any state is created */
+void coo_register_cast(CooType *from_type, CooType *to_type, COO_CAST_FUNC func);
+
 /* allocating and freeing data in an alloc */
 void *coo_alloc(CooAlloc *a, int count);
 void coo_free(CooAlloc *a, void *data);
+/* grows or shrinks batch to count elements, new elements are initialized like in coo_alloc, batch
+   grows in place if its allocator can do it or there is capacity left from earlier growth, otherwise
+   it moves and old pointers to it are still valid until next update, call outside of update */
+void *coo_realloc(CooAlloc *a, void *data, int count);
 
 /* primitive types */
 extern CooType CooI8, CooI16, CooI32, CooI64, CooF32, CooF64;
@@ -0,0 +1,102 @@
+#include "state.h"
+#include "layout.h"
+#include "coo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+/* C header with struct definitions matching current layouts, variables are written in offset order
+   so standard alignment rules reproduce coo offsets, nested types are defined before types that
+   contain them by value, packing is written as pack pragma and over-alignment as _Alignas, which
+   pack pragma overrides, so packed over-aligned types get explicit tail padding instead */
+
+
+static const char *_c_type_name(CooType *t) {
+    if (t == &CooI8) return "int8_t";
+    if (t == &CooI16) return "int16_t";
+    if (t == &CooI32) return "int32_t";
+    if (t == &CooI64) return "int64_t";
+    if (t == &CooF32) return "float";
+    if (t == &CooF64) return "double";
+    return 0;
+}
+
+static void _write_type_name(FILE *file, CooType *t) {
+    const char *name = _c_type_name(t);
+    if (name)
+        fprintf(file, "%s", name);
+    else
+        fprintf(file, "struct %s", t->name);
+}
+
+/* hot or cold variables of a type, empty structs aren't valid C so forward declaration is enough */
+static void _write_part(FILE *file, CooType *t, int is_cold, int *order) {
+    int count = 0;
+    for (int i = 0; i < t->vars_count; ++i) { /* variables by offset */
+        if (t->vars[i].is_cold != is_cold)
+            continue;
+        int j = count++;
+        for (; j > 0 && t->vars[order[j - 1]].offset > t->vars[i].offset; --j)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    if (count == 0)
+        return;
+    const char *suffix = is_cold ? "_cold" : "";
+    int base = is_cold ? t->cold_offset : 0, end = 0;
+    if (t->packing)
+        fprintf(file, "\n#pragma pack(push, %d)", t->packing);
+    fprintf(file, "\nstruct %s%s {\n", t->name, suffix);
+    for (int i = 0; i < count; ++i) {
+        CooVar *v = t->vars + order[i];
+        fprintf(file, "    ");
+        if (is_cold == false && i == 0 && t->packing == 0 && t->min_alignment > 1)
+            fprintf(file, "_Alignas(%d) ", t->min_alignment);
+        else if (v->is_ptr == false && t->packing == 0 && v->type->packing && v->type->min_alignment > 1)
+            fprintf(file, "_Alignas(%d) ", v->type->alignment); /* packed over-aligned, see above */
+        _write_type_name(file, v->type);
+        fprintf(file, v->is_ptr ? " *%s" : " %s", v->name);
+        if (v->count > 1)
+            fprintf(file, "[%d]", v->count);
+        fprintf(file, "; /* offset %d */\n", v->offset - base);
+        end = v->offset - base + (v->is_ptr ? (int)sizeof(void *) : v->type->size) * v->count;
+    }
+    int size = is_cold ? t->cold_size : t->size;
+    if (is_cold == false && t->packing && t->min_alignment > 1 && size > end)
+        fprintf(file, "    uint8_t coo_padding[%d];\n", size - end);
+    fprintf(file, "};\n");
+    if (t->packing)
+        fprintf(file, "#pragma pack(pop)\n");
+    fprintf(file, "_Static_assert(sizeof(struct %s%s) == %d, \"%s%s layout\");\n", t->name, suffix, size,
+            t->name, suffix);
+}
+
+static void _write_struct(FILE *file, CooType *t, int *is_defined) {
+    if (t->is_fixed || is_defined[t->index])
+        return;
+    is_defined[t->index] = true;
+    for (int i = 0; i < t->vars_count; ++i)
+        if (t->vars[i].is_ptr == false)
+            _write_struct(file, t->vars[i].type, is_defined);
+    int *order = malloc(sizeof(int) * (t->vars_count + 1));
+    _write_part(file, t, false, order);
+    _write_part(file, t, true, order);
+    free(order);
+}
+
+int coo_write_header(CooState *s, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == 0)
+        return false;
+
+    fprintf(file, "/* generated by coo from current layouts */\n\n#include <stdint.h>\n\n");
+    for (int i = 0; i < s->types_count; ++i)
+        fprintf(file, "struct %s;\n", s->types[i]->name);
+    int *is_defined = calloc(s->types_count + 1, sizeof(int));
+    for (int i = 0; i < s->types_count; ++i)
+        _write_struct(file, s->types[i], is_defined);
+    free(is_defined);
+
+    int is_written = ferror(file) == 0;
+    return fclose(file) == 0 && is_written;
+}
@@ -1,9 +1,30 @@
 #include "layout.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
 
+#define COO_JOB_BYTES 262144 /* approximate size of data migrated by a single job */
+#define COO_COLD_HEADER_SIZE 16 /* size of side buffer stored before it, keeps cold data aligned like batch data */
+#define COO_PREFETCH_DISTANCE 8 /* pointers ahead of the updated one whose header or index slot is prefetched */
+#define COO_SORT_MIN_POINTERS 1024 /* fewer pointers are updated in their order */
+#define COO_RADIX_BITS 11 /* bits sorted by each pass of pointer sort */
+
+#if defined(__GNUC__) || defined(__clang__)
+#define COO_PREFETCH(ptr) __builtin_prefetch(ptr)
+#else
+#define COO_PREFETCH(ptr) ((void)(ptr))
+#endif
+
+
+static int _min(int a, int b) {
+    return (a < b) ? a : b;
+}
+
+static int _max(int a, int b) {
+    return (a > b) ? a : b;
+}
 
 static CooTag *_data_to_tag(void *data) {
     return (CooTag *)data - 1;
@@ -13,124 +34,845 @@ static void *_tag_to_data(CooTag *tag) {
     return (void *)(tag + 1);
 }
 
-static void *_update_pointer(void *ptr) {
-    return ptr ? _tag_to_data(_data_to_tag(ptr)->redirect) : 0;
+static size_t _data_bytes(CooTag *tag) { /* allocated for data, including capacity left from growth */
+    return tag->bytes - tag->padding - sizeof(CooTag);
+}
+
+static size_t *_cold_header(CooTag *tag) { /* allocated bytes of side buffer, including header */
+    return (size_t *)(tag->cold - COO_COLD_HEADER_SIZE);
+}
+
+static void _alloc_cold(CooTag *tag, size_t bytes) {
+    size_t total = COO_COLD_HEADER_SIZE + (bytes ? bytes : 1);
+    char *block = tag->allocator->alloc(tag->allocator, total);
+    assert(block != 0);
+    *(size_t *)block = total;
+    tag->cold = block + COO_COLD_HEADER_SIZE;
+}
+
+static void _free_cold(CooTag *tag) {
+    size_t *header = _cold_header(tag);
+    tag->allocator->free(tag->allocator, header, *header);
+}
+
+static CooForwards *_active_forwards = 0; /* of all states in update that is not lazy, under shared lock */
+
+static int _start_slot(CooForwards *f, char *ptr) { /* fibonacci hashing, a single multiplication */
+    return (int)(((uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ull) >> f->starts_shift);
+}
+
+/* batch starts are found through hash, other pointers through binary search that compiles to
+   conditional moves, since branches on random addresses are mispredicted half of the time */
+static CooForward *_find_forward(CooForwards *f, char *ptr) {
+    if (f->forwards_count == 0)
+        return 0;
+    int mask = f->starts_capacity - 1;
+    for (int i = _start_slot(f, ptr); f->starts[i]; i = (i + 1) & mask)
+        if (f->forwards[f->starts[i] - 1].begin == ptr)
+            return f->forwards + f->starts[i] - 1;
+    CooForward *w = f->forwards;
+    for (int count = f->forwards_count; count > 1; count -= count / 2)
+        w = w[count / 2].begin <= ptr ? w + count / 2 : w;
+    return w->begin < ptr && ptr < w->end ? w : 0;
+}
+
+static int _map_offset(CooType *t, int offset);
+static int _map_var_offset(CooType *t, CooVarDiff *vd, int offset);
+
+static void *_forward_pointer(CooForwards *f, char *ptr);
+
+static char *_follow_column_forward(CooForward *w, char *ptr) { /* values of a column keep their index */
+    CooType *t = w->type;
+    size_t offset = ptr - w->begin;
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVarDiff *vd = t->var_diffs + i;
+        if (vd->old_index != w->column)
+            continue;
+        int inner = _map_var_offset(t, vd, (int)(offset % vd->old_bytes));
+        if (inner == -1)
+            return 0;
+        return ((CooColumn *)_tag_to_data(w->tag))[i].mem + offset / vd->old_bytes * vd->bytes + inner;
+    }
+    return 0; /* variable was removed */
+}
+
+/* pointer anywhere inside an old batch is mapped to the same value in its new version, batch moved
+   by coo_realloc forwards to a batch that can be forwarded again */
+static char *_follow_forward(CooForwards *f, CooForward *w, char *ptr) {
+    if (w->tag == 0) /* bounded update, new version is not created yet */
+        return ptr;
+    if (w->column != -1)
+        return _follow_column_forward(w, ptr);
+    size_t offset = ptr - w->begin;
+    if (w->type && offset) { /* divisions are skipped for pointers to batch start */
+        int inner = _map_offset(w->type, (int)(offset % w->type->old_size));
+        if (inner == -1)
+            return 0; /* value was removed */
+        offset = offset / w->type->old_size * w->type->size + inner;
+    }
+    ptr = (char *)_tag_to_data(w->tag) + offset;
+    return w->type ? ptr : _forward_pointer(f, ptr); /* migrated data is never forwarded again */
+}
+
+static void *_forward_pointer(CooForwards *f, char *ptr) {
+    CooForward *w = _find_forward(f, ptr);
+    return w ? _follow_forward(f, w, ptr) : ptr;
+}
+
+/* pointers in data of a state only point into the same state, while its old batches are indexed any
+   pointer that misses the index doesn't move, otherwise pointers point at start of batches, which
+   redirect more than once if migrated by several lazy updates */
+static void *_resolve_pointer(CooForwards *f, void *ptr) {
+    if (ptr == 0)
+        return 0;
+    if (f && f->is_active)
+        return _forward_pointer(f, ptr);
+    CooTag *tag = _data_to_tag(ptr);
+    while (tag->redirect)
+        tag = tag->redirect;
+    return _tag_to_data(tag);
+}
+
+/* data of a state with active forwards is never stale, lazily migrated data is migrated on first access */
+void *_update_pointer(CooForwards *f, void *ptr) {
+    ptr = _resolve_pointer(f, ptr);
+    if (ptr && (f == 0 || f->is_active == false) && _data_to_tag(ptr)->alloc->stale_count)
+        ptr = _tag_to_data(_touch_tag(_data_to_tag(ptr)));
+    return ptr;
+}
+
+/* host pointers can point into any state, they are looked up in old batches of all states in update
+   that is not lazy and tags are only read when no state is in such update, called with shared lock */
+static void *_forward_host_pointer(void *ptr) {
+    for (CooForwards *f = _active_forwards; f && ptr; f = f->next_active) {
+        CooForward *w = _find_forward(f, ptr);
+        if (w)
+            return _follow_forward(f, w, ptr);
+    }
+    return ptr;
 }
 
 void *coo_update_pointer(void *ptr) {
-    return _update_pointer(ptr);
+    _lock_shared();
+    int is_indexed = _active_forwards != 0;
+    if (is_indexed)
+        ptr = _forward_host_pointer(ptr);
+    _unlock_shared();
+    return is_indexed ? ptr : _update_pointer(0, ptr);
 }
 
-void _init_type(CooType *t, const char *name, int size) {
-    assert(strlen(name) < COO_MAX_NAME);
+static void _prefetch_pointer(CooForwards *f, char *ptr) { /* index slot or header the pointer is resolved through */
+    if (ptr == 0)
+        return;
+    if (f == 0 || f->is_active == false)
+        COO_PREFETCH(_data_to_tag(ptr));
+    else if (f->forwards_count)
+        COO_PREFETCH(f->starts + _start_slot(f, ptr));
+}
+
+typedef struct CooSortedPointer {
+    uintptr_t ptr;
+    size_t index; /* in updated array */
+} CooSortedPointer;
+
+/* lsd radix sort by address relative to lowest address, so pointers into a heap of a few gigabytes
+   take three passes, returns items or scratch, whichever ends up sorted */
+static CooSortedPointer *_sort_pointers(CooSortedPointer *items, CooSortedPointer *scratch, size_t count) {
+    uintptr_t min = UINTPTR_MAX, max = 0;
+    for (size_t i = 0; i < count; ++i) {
+        min = items[i].ptr < min ? items[i].ptr : min;
+        max = items[i].ptr > max ? items[i].ptr : max;
+    }
+    size_t *counts = malloc(sizeof(size_t) << COO_RADIX_BITS);
+    uintptr_t mask = ((uintptr_t)1 << COO_RADIX_BITS) - 1;
+    for (int shift = 0; shift < 64 && ((max - min) >> shift); shift += COO_RADIX_BITS) {
+        memset(counts, 0, sizeof(size_t) << COO_RADIX_BITS);
+        for (size_t i = 0; i < count; ++i)
+            ++counts[((items[i].ptr - min) >> shift) & mask];
+        for (size_t i = 0, sum = 0; i <= mask; ++i) {
+            size_t digit_count = counts[i];
+            counts[i] = sum;
+            sum += digit_count;
+        }
+        for (size_t i = 0; i < count; ++i)
+            scratch[counts[((items[i].ptr - min) >> shift) & mask]++] = items[i];
+        CooSortedPointer *swap = items;
+        items = scratch;
+        scratch = swap;
+    }
+    free(counts);
+    return items;
+}
+
+/* sorted pointers are merged with sorted index of old batches instead of looked up one by one, and
+   repeated pointers are resolved once, outside of update they are resolved one by one with headers
+   prefetched ahead */
+static void _update_sorted_pointers(CooForwards *f, void **ptrs, CooSortedPointer *items, size_t count) {
+    int is_merged = f && f->is_active;
+    CooForward *w = is_merged ? f->forwards : 0, *end = is_merged ? f->forwards + f->forwards_count : 0;
+    char *last = 0, *resolved = 0;
+    for (size_t i = 0; i < count; ++i) {
+        char *ptr = (char *)items[i].ptr;
+        if (ptr != last) {
+            last = ptr;
+            if (is_merged == false) {
+                if (i + COO_PREFETCH_DISTANCE < count)
+                    _prefetch_pointer(f, (char *)items[i + COO_PREFETCH_DISTANCE].ptr);
+                resolved = _update_pointer(f, ptr);
+            }
+            else {
+                while (w < end && ptr >= w->end && ptr != w->begin) /* empty batches still match their begin */
+                    ++w;
+                resolved = w < end && w->begin <= ptr ? _follow_forward(f, w, ptr) : ptr;
+            }
+        }
+        ptrs[items[i].index] = resolved;
+    }
+}
+
+void _update_pointers(CooForwards *f, void **ptrs, size_t count) {
+    if (count < COO_SORT_MIN_POINTERS) {
+        for (size_t i = 0; i < count; ++i) {
+            if (i + COO_PREFETCH_DISTANCE < count)
+                _prefetch_pointer(f, ptrs[i + COO_PREFETCH_DISTANCE]);
+            ptrs[i] = _update_pointer(f, ptrs[i]);
+        }
+        return;
+    }
+    CooSortedPointer *items = malloc(sizeof(CooSortedPointer) * count * 2);
+    for (size_t i = 0; i < count; ++i) {
+        items[i].ptr = (uintptr_t)ptrs[i];
+        items[i].index = i;
+    }
+    _update_sorted_pointers(f, ptrs, _sort_pointers(items, items + count, count), count);
+    free(items);
+}
+
+void coo_update_pointers(void **ptrs, size_t count) {
+    _lock_shared();
+    CooForwards *f = _active_forwards;
+    if (f && f->next_active) /* several states in update */
+        for (size_t i = 0; i < count; ++i)
+            ptrs[i] = _forward_host_pointer(ptrs[i]);
+    else if (f)
+        _update_pointers(f, ptrs, count);
+    _unlock_shared();
+    if (f == 0)
+        _update_pointers(0, ptrs, count);
+}
+
+void _init_type(CooType *t, CooNames *names, const char *name, int size) {
     assert(size >= 0);
-    strcpy_s(t->name, COO_MAX_NAME, name);
+    t->name = names ? _intern_name(names, name) : name; /* primitive names are literals */
+    t->names = names;
+    t->vars = 0;
     t->vars_count = 0;
+    t->vars_capacity = 0;
+    t->new_vars = 0;
     t->new_vars_count = 0;
-    t->casts_count = 0;
+    t->new_vars_capacity = 0;
+    t->casts = 0;
+    t->diffs = 0;
     t->diffs_count = 0;
+    t->diffs_capacity = 0;
+    t->var_diffs = 0;
+    t->var_diffs_capacity = 0;
+    t->instrs = 0;
+    t->instrs_count = 0;
+    t->instrs_capacity = 0;
+    t->in_place_instrs = 0;
+    t->has_in_place_order = false;
+    t->is_identity = true;
+    t->defaults = 0;
+    t->copied_bytes = 0;
+    t->zeroed_bytes = 0;
+    t->defaulted_bytes = 0;
+    t->cast_bytes = 0;
+    t->cast_values = 0;
     t->size = size;
     t->old_size = size;
     t->alignment = size ? size : 1;
+    t->old_alignment = t->alignment;
+    t->packing = 0;
+    t->min_alignment = 0;
+    t->cold_size = 0;
+    t->old_cold_size = 0;
+    t->cold_offset = 0;
+    t->old_cold_offset = 0;
     t->update_id = 0;
     t->is_fixed = size != 0;
+    t->is_optimized = false;
+    t->is_modified = false;
+    t->is_affected = false;
+    t->is_in_place = false;
+    t->is_moved = false;
+    t->points_to_moved = false;
+    t->moved_batches_count = 0;
+    t->is_relocated = false;
+    t->ptr_runs = 0;
+    t->ptr_runs_count = 0;
+    t->ptr_runs_capacity = 0;
+    t->ptrs_count = 0;
+    t->pointers_update_id = 0;
+    t->order_update_id = 0;
+    t->pending_holders = 0;
+    t->is_migrated = false;
+    t->version = 0;
+    t->versions = 0;
+    t->versions_base = 0;
+    t->versions_count = 0;
+    t->versions_capacity = 0;
+    t->index = -1;
+}
+
+static void *_reserve(void *items, int *capacity, int count, size_t item_size) {
+    if (count <= *capacity)
+        return items;
+    int new_capacity = *capacity ? *capacity : 8;
+    while (new_capacity < count)
+        new_capacity *= 2;
+    *capacity = new_capacity;
+    return realloc(items, item_size * new_capacity);
+}
+
+/* registering a cast again replaces its function in place, so migrations that were already
+   prepared with it, like pending lazy versions, use the new function */
+void _add_cast(CooType *t, CooType *to_type, COO_CAST_FUNC func) {
+    assert(func != 0);
+    for (CooCast *c = t->casts; c; c = c->next)
+        if (c->to_type == to_type) {
+            c->func = func;
+            return;
+        }
+    CooCast *c = malloc(sizeof(CooCast));
+    c->to_type = to_type;
+    c->func = func;
+    c->next = t->casts;
+    t->casts = c;
 }
 
-void _init_alloc(CooAlloc *a, struct CooType *type, int is_ptr) {
+void _deinit_type(CooType *t) {
+    free(t->vars);
+    free(t->new_vars);
+    while (t->casts) {
+        CooCast *c = t->casts;
+        t->casts = c->next;
+        free(c);
+    }
+    free(t->diffs);
+    free(t->var_diffs);
+    t->var_diffs = 0;
+    t->var_diffs_capacity = 0;
+    t->vars = 0;
+    t->new_vars = 0;
+    t->diffs = 0;
+    t->vars_count = t->vars_capacity = 0;
+    t->new_vars_count = t->new_vars_capacity = 0;
+    t->diffs_count = t->diffs_capacity = 0;
+    free(t->instrs);
+    free(t->in_place_instrs);
+    free(t->ptr_runs);
+    free(t->defaults);
+    t->defaults = 0;
+    t->ptr_runs = 0;
+    t->ptr_runs_count = 0;
+    t->ptr_runs_capacity = 0;
+    t->instrs = 0;
+    t->in_place_instrs = 0;
+    t->instrs_count = 0;
+    t->instrs_capacity = 0;
+    _clear_versions(t);
+    free(t->versions);
+    t->versions = 0;
+    t->versions_capacity = 0;
+}
+
+void _init_alloc(CooAlloc *a, struct CooType *type, int is_ptr, int is_soa,
+                 CooAllocator *allocator, CooAllocator *update_allocator, CooForwards *forwards) {
     a->type = type;
     a->is_ptr = is_ptr;
+    a->is_soa = is_soa;
     a->first = 0;
     a->old_first = 0;
+    a->allocator = allocator;
+    a->update_allocator = update_allocator;
+    memset(&a->stats, 0, sizeof(CooUpdateStats));
+    a->stale_count = 0;
+    a->stubs = 0;
+    a->moved = 0;
+    a->points_to_moved = false;
+    a->forwards = forwards;
+    a->index = -1;
+}
+
+void _free_tag(CooTag *tag) {
+    CooColumn *columns = (CooColumn *)(tag + 1);
+    for (int i = 0; i < tag->columns_count; ++i)
+        if (columns[i].allocator)
+            columns[i].allocator->free(columns[i].allocator, columns[i].mem, columns[i].bytes);
+    if (tag->cold)
+        _free_cold(tag);
+    tag->allocator->free(tag->allocator, (char *)tag - tag->padding, tag->bytes);
 }
 
 void _clear_alloc(CooAlloc *a) {
+    _free_moved_batches(a);
     while (a->first) {
         CooTag *tag = a->first;
         a->first = a->first->next;
-        free(tag);
-    }
-}
-
-static void _apply_diffs(CooType *t, char *src_mem, char *dst_mem) {
-    for (int i = 0; i < t->diffs_count; ++i) {
-        CooDiff *d = t->diffs + i;
-        if (d->diff_type == CDT_COPY) {
-            if (d->is_ptr)
-                memcpy(dst_mem + d->dst_offset, src_mem + d->src_offset, sizeof(void *) * d->count);
-            else if (d->to_type->is_fixed)
-                memcpy(dst_mem + d->dst_offset, src_mem + d->src_offset, d->to_type->size * d->count);
-            else
-                for (int j = 0; j < d->count; ++j)
-                    _apply_diffs(d->to_type,
-                                 src_mem + d->src_offset + j * d->src_stride,
-                                 dst_mem + d->dst_offset + j * d->dst_stride);
-        }
-        else if (d->diff_type == CDT_CAST) {
-            if (d->is_ptr)
-                memset(dst_mem + d->dst_offset, 0, sizeof(void *) * d->count);
-            else if (d->cast)
-                for (int j = 0; j < d->count; ++j)
-                    d->cast->func(src_mem + d->src_offset + j * d->src_stride,
-                                  dst_mem + d->dst_offset + j * d->dst_stride);
-            else
-                memset(dst_mem + d->dst_offset, 0, d->to_type->size * d->count);
+        _free_tag(tag);
+    }
+    a->stale_count = 0;
+    _free_stubs(a);
+}
+
+/* fills count copies of pattern, doubling the filled range with each copy */
+static void _fill_pattern(char *dst, const void *pattern, size_t size, size_t count) {
+    size_t bytes = size * count;
+    if (bytes == 0)
+        return;
+    memcpy(dst, pattern, size);
+    for (size_t filled = size; filled < bytes; filled *= 2)
+        memcpy(dst + filled, dst, filled < bytes - filled ? filled : bytes - filled);
+}
+
+static void _run_instrs(CooInstr *instrs, int instrs_count, const char *defaults, char *src_mem, char *dst_mem) {
+    for (int i = 0; i < instrs_count; ++i) {
+        CooInstr *in = instrs + i;
+        if (in->instr_type == CIT_COPY)
+            memcpy(dst_mem + in->dst_offset, src_mem + in->src_offset, in->size);
+        else if (in->instr_type == CIT_NULL)
+            memset(dst_mem + in->dst_offset, 0, in->size);
+        else if (in->instr_type == CIT_DEFAULT)
+            memcpy(dst_mem + in->dst_offset, defaults + in->dst_offset, in->size);
+        else
+            in->cast->func(src_mem + in->src_offset, dst_mem + in->dst_offset,
+                          in->count, in->src_stride, in->dst_stride);
+    }
+}
+
+/* casts of single values are run across all elements with a single call, so cast functions
+   don't pay a call per value, this reorders instructions which is fine as src and dst don't overlap */
+static void _migrate_elements(CooType *t, char *src_mem, char *dst_mem, int count) {
+    if (t->is_identity) { /* whole batch is a single block copy */
+        memcpy(dst_mem, src_mem, t->size * count);
+        return;
+    }
+    if (t->cast_values == 0 || count == 1) {
+        for (int i = 0; i < count; ++i)
+            _run_instrs(t->instrs, t->instrs_count, t->defaults, src_mem + t->old_size * i, dst_mem + t->size * i);
+        return;
+    }
+    for (int i = 0; i < count; ++i)
+        for (int j = 0; j < t->instrs_count; ++j) {
+            CooInstr *in = t->instrs + j;
+            if (in->instr_type != CIT_CAST || in->count > 1)
+                _run_instrs(in, 1, t->defaults, src_mem + t->old_size * i, dst_mem + t->size * i);
         }
-        else if (d->diff_type == CDT_NULL) {
-            if (d->is_ptr)
-                memset(dst_mem + d->dst_offset, 0, sizeof(void *) * d->count);
-            else
-                memset(dst_mem + d->dst_offset, 0, d->to_type->size * d->count);
+    for (int j = 0; j < t->instrs_count; ++j) {
+        CooInstr *in = t->instrs + j;
+        if (in->instr_type == CIT_CAST && in->count == 1)
+            in->cast->func(src_mem + in->src_offset, dst_mem + in->dst_offset, count, t->old_size, t->size);
+    }
+}
+
+static void _run_in_place_instrs(CooType *t, char *mem) {
+    for (int i = 0; i < t->instrs_count; ++i) {
+        CooInstr *in = t->in_place_instrs + i;
+        if (in->instr_type == CIT_COPY)
+            memmove(mem + in->dst_offset, mem + in->src_offset, in->size);
+        else if (in->instr_type == CIT_NULL)
+            memset(mem + in->dst_offset, 0, in->size);
+        else if (in->instr_type == CIT_DEFAULT)
+            memcpy(mem + in->dst_offset, t->defaults + in->dst_offset, in->size);
+        else
+            in->cast->func(mem + in->src_offset, mem + in->dst_offset, in->count, in->src_stride, in->dst_stride);
+    }
+}
+
+/* dst_mem <= src_mem, elements are migrated in ascending order so an element never overwrites
+   data of following elements, elements overlapping their old version are either migrated
+   using instructions ordered for in-place migration or through a copy of the old version */
+static void _migrate_elements_in_place(CooType *t, char *src_mem, char *dst_mem, int count) {
+    char *scratch = 0;
+    for (int i = 0; i < count; ++i) {
+        char *src = src_mem + t->old_size * i;
+        char *dst = dst_mem + t->size * i;
+        if (dst + t->size <= src)
+            _run_instrs(t->instrs, t->instrs_count, t->defaults, src, dst);
+        else if (dst == src && t->has_in_place_order)
+            _run_in_place_instrs(t, dst);
+        else {
+            if (scratch == 0)
+                scratch = malloc(t->old_size);
+            memcpy(scratch, src, t->old_size);
+            _run_instrs(t->instrs, t->instrs_count, t->defaults, scratch, dst);
         }
     }
+    free(scratch);
 }
 
-static CooTag *_malloc_with_tag(int size, int count, CooTag *prev, CooTag *next) {
-    CooTag *tag = malloc(sizeof(CooTag) + size * count);
+/* allocators align blocks at least for pointers, which is natural alignment of all primitive
+   types, blocks of over-aligned types get room to move data to their alignment */
+static CooTag *_malloc_with_tag(CooAllocator *allocator, CooAlloc *a, int size, int count,
+                                CooTag *prev, CooTag *next) {
+    int alignment = a->is_ptr || a->is_soa ? 1 : a->type->alignment;
+    size_t padding = alignment > (int)sizeof(void *) ? alignment - 1 : 0;
+    size_t bytes = padding + sizeof(CooTag) + (size_t)size * count;
+    char *block = allocator->alloc(allocator, bytes);
+    assert(block != 0);
+    if (padding)
+        padding = (alignment - (uintptr_t)(block + sizeof(CooTag)) % alignment) % alignment;
+    CooTag *tag = (CooTag *)(block + padding);
+    tag->padding = (int)padding;
+    tag->allocator = allocator;
+    tag->alloc = a;
+    tag->version = a->type->version;
+    tag->is_dirty = false;
+    tag->bytes = bytes;
     tag->count = count;
+    tag->columns_count = 0;
+    tag->cold = 0;
     tag->prev = prev;
     tag->next = next;
+    tag->redirect = 0;
+    return tag;
+}
+
+static void _count_migration(CooUpdateStats *stats, CooType *t, int count) {
+    stats->copied_bytes += (size_t)t->copied_bytes * count;
+    stats->zeroed_bytes += (size_t)t->zeroed_bytes * count;
+    stats->defaulted_bytes += (size_t)t->defaulted_bytes * count;
+    stats->cast_bytes += (size_t)t->cast_bytes * count;
+    stats->cast_values += (size_t)t->cast_values * count;
+}
+
+/* stats are counted when jobs are queued, so workers don't have to share counters */
+static void _push_job(CooJobs *jobs, CooJobType job_type, CooAlloc *a, char *src_mem, char *dst_mem,
+                      int count, int redirect_pointers) {
+    if (jobs->jobs_count == jobs->jobs_capacity) {
+        jobs->jobs_capacity = jobs->jobs_capacity ? jobs->jobs_capacity * 2 : 64;
+        jobs->jobs = realloc(jobs->jobs, sizeof(CooJob) * jobs->jobs_capacity);
+    }
+    CooJob *j = jobs->jobs + jobs->jobs_count++;
+    if (job_type == CJT_REDIRECT_PTRS)
+        a->stats.redirected_pointers += count;
+    else if (redirect_pointers && job_type != CJT_MIGRATE_COLUMN && job_type != CJT_REDIRECT_COLUMN) /* column jobs are counted when they are pushed */
+        a->stats.redirected_pointers += (size_t)a->type->ptrs_count * count;
+    if (job_type == CJT_MIGRATE || job_type == CJT_MIGRATE_IN_PLACE)
+        _count_migration(&a->stats, a->type, count);
+    j->job_type = job_type;
+    j->type = a->type;
+    j->src_mem = src_mem;
+    j->dst_mem = dst_mem;
+    j->count = count;
+    j->redirect_pointers = redirect_pointers;
+    j->forwards = a->forwards;
+    j->var_index = -1;
+}
+
+static int _job_count(CooType *t) {
+    return _max(1, COO_JOB_BYTES / _max(1, _max(t->old_size, t->size)));
+}
+
+CooTag *_update_tag_data_layout(CooAlloc *a, CooTag *o_tag, CooJobs *jobs, int redirect_pointers) {
+    if (a->type->is_in_place) {
+        /* elements of shrinking types can overwrite old versions of elements in other jobs */
+        int job_count = a->type->size == a->type->old_size ? _job_count(a->type) : _max(1, o_tag->count);
+        for (int i = 0; i < o_tag->count; i += job_count)
+            _push_job(jobs, CJT_MIGRATE_IN_PLACE, a,
+                      (char *)_tag_to_data(o_tag) + a->type->old_size * i,
+                      (char *)_tag_to_data(o_tag) + a->type->size * i,
+                      _min(job_count, o_tag->count - i), redirect_pointers);
+        return o_tag;
+    }
+    CooTag *n_tag = _malloc_with_tag(a->update_allocator, a, a->type->size, o_tag->count, o_tag->prev, o_tag->next);
+    ++a->stats.allocated_batches;
+    int job_count = _job_count(a->type); /* split large batches so that they can be migrated by multiple threads */
+    for (int i = 0; i < o_tag->count; i += job_count)
+        _push_job(jobs, CJT_MIGRATE, a,
+                  (char *)_tag_to_data(o_tag) + a->type->old_size * i,
+                  (char *)_tag_to_data(n_tag) + a->type->size * i,
+                  _min(job_count, o_tag->count - i), redirect_pointers);
+    o_tag->redirect = n_tag; /* old tag redirects to new tag */
+    return n_tag;
+}
+
+static int _variable_size(CooVar *v);
+static void _redirect_pointers(CooForwards *f, char *mem, int count);
+static void _redirect_struct_pointers(CooForwards *f, char *mem, CooType *type, int count);
+
+/* soa batches, data of a batch is an array of columns, one for each variable */
+
+static void _alloc_column(CooColumn *c, CooAllocator *allocator, size_t bytes) {
+    c->bytes = bytes ? bytes : 1;
+    c->mem = allocator->alloc(allocator, c->bytes);
+    assert(c->mem != 0);
+    c->allocator = allocator;
+}
+
+static CooTag *_malloc_soa_tag(CooAllocator *allocator, CooAlloc *a, int count, CooTag *prev, CooTag *next) {
+    CooTag *tag = _malloc_with_tag(allocator, a, sizeof(CooColumn), a->type->vars_count, prev, next);
+    tag->count = count;
+    tag->columns_count = a->type->vars_count;
     return tag;
 }
 
-void _update_alloc_data_layout(CooAlloc *a) {
-    CooTag *o_tag = a->first;
-    if (a->is_ptr == false && a->type->is_fixed == false) {
-        while (o_tag) {
-            CooTag *n_tag = _malloc_with_tag(a->type->size, o_tag->count,
-                                             o_tag->prev, o_tag->next);
-            for (int i = 0; i < o_tag->count; ++i)
-                _apply_diffs(a->type,
-                             (char *)_tag_to_data(o_tag) + a->type->old_size * i,
-                             (char *)_tag_to_data(n_tag) + a->type->size * i);
-            o_tag->redirect = n_tag; /* old tag redirects to new tag */
-            o_tag = o_tag->next;
+static size_t _column_pointers(CooVar *v, int count) {
+    return (size_t)v->count * count * (v->is_ptr ? 1 : v->type->ptrs_count);
+}
+
+static void _redirect_column(CooForwards *f, CooVar *v, char *mem, int stride, int count) {
+    int bytes = _variable_size(v) * v->count;
+    if (stride != bytes) { /* values are interleaved with other variables in split batches */
+        for (int i = 0; i < count; ++i)
+            _redirect_column(f, v, mem + (size_t)stride * i, bytes, 1);
+        return;
+    }
+    if (v->is_ptr)
+        _redirect_pointers(f, mem, v->count * count);
+    else
+        _redirect_struct_pointers(f, mem, v->type, v->count * count);
+}
+
+static int _diff_elem_size(CooDiff *d) {
+    return d->is_ptr ? sizeof(void *) : d->to_type->size;
+}
+
+static void _apply_column_diff(CooType *t, CooDiff *d, char *src_mem, char *dst_mem, int count) {
+    int elem_size = _diff_elem_size(d);
+    if (d->diff_type == CDT_COPY) {
+        if (d->is_ptr || d->to_type->is_fixed || d->to_type->is_identity)
+            memcpy(dst_mem, src_mem, (size_t)elem_size * count);
+        else
+            _migrate_elements(d->to_type, src_mem, dst_mem, count);
+    }
+    else if (d->diff_type == CDT_CAST && d->is_ptr == false && d->cast)
+        d->cast->func(src_mem, dst_mem, count, d->src_stride, d->dst_stride);
+    else if (d->has_default && d->is_ptr == false)
+        _fill_pattern(dst_mem, t->defaults + d->dst_offset, elem_size, count);
+    else
+        memset(dst_mem, 0, (size_t)elem_size * count);
+}
+
+/* diffs are applied to whole column at once when they cover whole variable and its values are
+   contiguous, else element by element, strides are bytes between values of consecutive elements */
+static void _migrate_column(CooType *t, int var_index, char *src_mem, int src_stride,
+                            char *dst_mem, int dst_stride, int count) {
+    CooVarDiff *vd = t->var_diffs + var_index;
+    for (int i = 0; i < vd->diffs_count; ++i) {
+        CooDiff *d = t->diffs + vd->diffs_begin + i;
+        int src_offset = d->diff_type == CDT_NULL ? 0 : d->src_offset - vd->old_offset;
+        int dst_offset = d->dst_offset - vd->offset;
+        int is_whole = _diff_elem_size(d) * d->count == vd->bytes && dst_stride == vd->bytes &&
+                       (d->diff_type == CDT_NULL || (d->src_stride * d->count == vd->old_bytes &&
+                                                     src_stride == vd->old_bytes));
+        if (is_whole)
+            _apply_column_diff(t, d, src_mem, dst_mem, d->count * count);
+        else
+            for (int j = 0; j < count; ++j)
+                _apply_column_diff(t, d, src_mem ? src_mem + (size_t)src_stride * j + src_offset : 0,
+                                   dst_mem + (size_t)dst_stride * j + dst_offset, d->count);
+    }
+}
+
+static void _count_column(CooUpdateStats *stats, CooType *t, int var_index, int count) {
+    CooVarDiff *vd = t->var_diffs + var_index;
+    for (int i = 0; i < vd->diffs_count; ++i) {
+        CooDiff *d = t->diffs + vd->diffs_begin + i;
+        size_t bytes = (size_t)_diff_elem_size(d) * d->count * count;
+        if (d->diff_type == CDT_COPY)
+            stats->copied_bytes += bytes;
+        else if (d->diff_type == CDT_CAST && d->is_ptr == false && d->cast) {
+            stats->cast_bytes += bytes;
+            stats->cast_values += (size_t)d->count * count;
         }
+        else if (d->has_default && d->is_ptr == false)
+            stats->defaulted_bytes += bytes;
+        else
+            stats->zeroed_bytes += bytes;
     }
 }
 
-static CooCast *_find_cast(CooType *t, CooType *to_type) {
-    for (int i = 0; i < t->casts_count; ++i)
-        if (t->casts[i].to_type == to_type)
-            return t->casts + i;
-    return 0;
+static void _push_column_job(CooJobs *jobs, CooJobType job_type, CooAlloc *a, int var_index,
+                             char *src_mem, int src_stride, char *dst_mem, int dst_stride, int count) {
+    CooVar *v = a->type->vars + var_index;
+    int redirect_pointers = v->points_to_moved;
+    if (redirect_pointers)
+        a->stats.redirected_pointers += _column_pointers(v, count);
+    if (job_type == CJT_MIGRATE_COLUMN)
+        _count_column(&a->stats, a->type, var_index, count);
+    _push_job(jobs, job_type, a, src_mem, dst_mem, count, redirect_pointers);
+    CooJob *j = jobs->jobs + jobs->jobs_count - 1;
+    j->var_index = var_index;
+    j->src_stride = src_stride;
+    j->dst_stride = dst_stride;
 }
 
-static int _min(int a, int b) {
-    return (a < b) ? a : b;
+/* unchanged columns are taken over by the new batch, only changed and new columns are migrated */
+static void _update_soa_tag_data_layout(CooAlloc *a, CooTag *o_tag, CooJobs *jobs) {
+    CooType *t = a->type;
+    CooTag *n_tag = _malloc_soa_tag(a->update_allocator, a, o_tag->count, o_tag->prev, o_tag->next);
+    ++a->stats.allocated_batches;
+    CooColumn *o_columns = _tag_to_data(o_tag), *n_columns = _tag_to_data(n_tag);
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVarDiff *vd = t->var_diffs + i;
+        if (vd->is_kept) {
+            n_columns[i] = o_columns[vd->old_index];
+            o_columns[vd->old_index].allocator = 0; /* old version still reads it until update ends */
+            if (t->vars[i].points_to_moved)
+                _push_column_job(jobs, CJT_REDIRECT_COLUMN, a, i, n_columns[i].mem, vd->bytes, 0, 0, o_tag->count);
+            continue;
+        }
+        _alloc_column(n_columns + i, a->update_allocator, (size_t)vd->bytes * o_tag->count);
+        int job_count = _max(1, COO_JOB_BYTES / _max(1, _max(vd->bytes, vd->old_bytes)));
+        for (int j = 0; j < o_tag->count; j += job_count)
+            _push_column_job(jobs, CJT_MIGRATE_COLUMN, a, i,
+                             vd->old_index == -1 ? 0 : o_columns[vd->old_index].mem + (size_t)vd->old_bytes * j,
+                             vd->old_bytes, n_columns[i].mem + (size_t)vd->bytes * j, vd->bytes,
+                             _min(job_count, o_tag->count - j));
+    }
+    o_tag->redirect = n_tag;
 }
 
-static int _max(int a, int b) {
-    return (a > b) ? a : b;
+static void _update_soa_alloc_data_layout(CooAlloc *a, CooJobs *jobs) {
+    if (a->type->is_affected)
+        for (CooTag *o_tag = a->first; o_tag; o_tag = o_tag->next)
+            _update_soa_tag_data_layout(a, o_tag, jobs);
+    else if (a->type->points_to_moved)
+        for (CooTag *tag = a->first; tag; tag = tag->next)
+            for (int i = 0; i < a->type->vars_count; ++i)
+                if (a->type->vars[i].points_to_moved)
+                    _push_column_job(jobs, CJT_REDIRECT_COLUMN, a, i, ((CooColumn *)_tag_to_data(tag))[i].mem,
+                                     _variable_size(a->type->vars + i) * a->type->vars[i].count, 0, 0, tag->count);
+}
+
+/* split batches, hot variables are in batch data and cold variables in its side buffer, variables
+   are migrated like columns with strides of the part they are in */
+
+static int _has_cold(CooType *t) { /* in old or new layout */
+    return t->cold_size || t->old_cold_size;
+}
+
+static char *_split_var_mem(CooTag *tag, int offset, int is_cold, int cold_offset) {
+    return is_cold ? tag->cold + offset - cold_offset : (char *)_tag_to_data(tag) + offset;
+}
+
+static void _update_split_tag_data_layout(CooAlloc *a, CooTag *o_tag, CooJobs *jobs) {
+    CooType *t = a->type;
+    CooTag *n_tag = _malloc_with_tag(a->update_allocator, a, t->size, o_tag->count, o_tag->prev, o_tag->next);
+    if (t->cold_size)
+        _alloc_cold(n_tag, (size_t)t->cold_size * o_tag->count);
+    ++a->stats.allocated_batches;
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVarDiff *vd = t->var_diffs + i;
+        int src_stride = vd->was_cold ? t->old_cold_size : t->old_size;
+        int dst_stride = vd->is_cold ? t->cold_size : t->size;
+        char *src_mem = vd->old_index == -1 ? 0 : _split_var_mem(o_tag, vd->old_offset, vd->was_cold, t->old_cold_offset);
+        char *dst_mem = _split_var_mem(n_tag, vd->offset, vd->is_cold, t->cold_offset);
+        int job_count = _max(1, COO_JOB_BYTES / _max(1, _max(src_stride, dst_stride)));
+        for (int j = 0; j < o_tag->count; j += job_count)
+            _push_column_job(jobs, CJT_MIGRATE_COLUMN, a, i, src_mem ? src_mem + (size_t)src_stride * j : 0, src_stride,
+                             dst_mem + (size_t)dst_stride * j, dst_stride, _min(job_count, o_tag->count - j));
+    }
+    o_tag->redirect = n_tag;
+}
+
+static void _redirect_cold_vars(CooAlloc *a, CooTag *tag, CooJobs *jobs) { /* hot variables are redirected with ptr runs */
+    CooType *t = a->type;
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVar *v = t->vars + i;
+        if (v->is_cold && v->points_to_moved)
+            _push_column_job(jobs, CJT_REDIRECT_COLUMN, a, i, _split_var_mem(tag, v->offset, true, t->cold_offset),
+                             t->cold_size, 0, 0, tag->count);
+    }
+}
+
+static void _run_column_job(CooJob *j) {
+    CooVar *v = j->type->vars + j->var_index;
+    if (j->job_type == CJT_MIGRATE_COLUMN)
+        _migrate_column(j->type, j->var_index, j->src_mem, j->src_stride, j->dst_mem, j->dst_stride, j->count);
+    if (j->redirect_pointers && j->job_type == CJT_MIGRATE_COLUMN)
+        _redirect_column(j->forwards, v, j->dst_mem, j->dst_stride, j->count);
+    else if (j->redirect_pointers)
+        _redirect_column(j->forwards, v, j->src_mem, j->src_stride, j->count);
+}
+
+/* all old batches get their redirect before any job runs, so pointers can be redirected
+   while migrated elements are still in cache instead of in a separate pass */
+void _update_alloc_data_layout(CooAlloc *a, CooJobs *jobs) {
+    if (a->is_soa)
+        _update_soa_alloc_data_layout(a, jobs);
+    else if (a->is_ptr) {
+        if (a->points_to_moved)
+            for (CooTag *tag = a->first; tag; tag = tag->next)
+                for (int i = 0, job_count = COO_JOB_BYTES / sizeof(void *); i < tag->count; i += job_count)
+                    _push_job(jobs, CJT_REDIRECT_PTRS, a, (char *)_tag_to_data(tag) + sizeof(void *) * i, 0,
+                              _min(job_count, tag->count - i), true);
+    }
+    else if (a->type->is_affected && _has_cold(a->type))
+        for (CooTag *o_tag = a->first; o_tag; o_tag = o_tag->next)
+            _update_split_tag_data_layout(a, o_tag, jobs);
+    else if (a->type->is_affected)
+        for (CooTag *o_tag = a->first; o_tag; o_tag = o_tag->next)
+            _update_tag_data_layout(a, o_tag, jobs, a->type->points_to_moved);
+    else if (a->type->points_to_moved)
+        for (CooTag *tag = a->first; tag; tag = tag->next) {
+            for (int i = 0, job_count = _job_count(a->type); i < tag->count; i += job_count)
+                _push_job(jobs, CJT_REDIRECT, a, (char *)_tag_to_data(tag) + a->type->size * i, 0,
+                          _min(job_count, tag->count - i), true);
+            if (a->type->cold_size)
+                _redirect_cold_vars(a, tag, jobs);
+        }
+}
+
+void _run_migration_job(void *jobs, int index) {
+    CooJob *j = (CooJob *)jobs + index;
+    if (j->job_type == CJT_MIGRATE_COLUMN || j->job_type == CJT_REDIRECT_COLUMN) {
+        _run_column_job(j);
+        return;
+    }
+    if (j->job_type == CJT_MIGRATE)
+        _migrate_elements(j->type, j->src_mem, j->dst_mem, j->count);
+    else if (j->job_type == CJT_MIGRATE_IN_PLACE)
+        _migrate_elements_in_place(j->type, j->src_mem, j->dst_mem, j->count);
+    else if (j->job_type == CJT_REDIRECT)
+        _redirect_struct_pointers(j->forwards, j->src_mem, j->type, j->count);
+    else
+        _redirect_pointers(j->forwards, j->src_mem, j->count);
+    if (j->redirect_pointers && _is_migration_job(j))
+        _redirect_struct_pointers(j->forwards, j->dst_mem, j->type, j->count);
+}
+
+static CooCast *_find_cast(CooType *t, CooType *to_type) {
+    for (CooCast *c = t->casts; c; c = c->next)
+        if (c->to_type == to_type)
+            return c;
+    return 0;
+}
+
+static CooDiff *_push_diff(CooType *t) {
+    t->diffs = _reserve(t->diffs, &t->diffs_capacity, t->diffs_count + 1, sizeof(CooDiff));
+    return t->diffs + t->diffs_count++;
 }
 
 static int _round_up(int value, int base) {
     return value + (base - (value % base)) % base;
 }
 
+static int _joined_size(CooType *t) { /* of hot part followed by cold part */
+    return t->cold_size ? t->cold_offset + t->cold_size : t->size;
+}
+
 static int _variable_alignment(CooVar *v) {
     return v->is_ptr ? sizeof(void *) : v->type->alignment;
 }
 
+static int _member_alignment(CooType *t, CooVar *v) { /* within t, packing lowers natural alignment */
+    int alignment = _variable_alignment(v);
+    return t->packing ? _min(alignment, t->packing) : alignment;
+}
+
 static int _variable_size(CooVar *v) {
     return v->is_ptr ? sizeof(void *) : v->type->size;
 }
@@ -139,46 +881,299 @@ static int _variable_old_size(CooVar *v) {
     return v->is_ptr ? sizeof(void *) : v->type->old_size;
 }
 
+static void _push_instr(CooType *t, CooInstr *in) {
+    if (in->instr_type != CIT_CAST && in->size == 0)
+        return;
+    if (t->instrs_count) { /* try to coalesce with previous instruction */
+        CooInstr *last = t->instrs + t->instrs_count - 1;
+        int dst_gap = in->dst_offset - (last->dst_offset + last->size);
+        int src_gap = in->src_offset - (last->src_offset + last->size);
+        /* instructions are pushed in ascending destination order and don't overlap, so
+           destination bytes between them are padding and can be overwritten freely */
+        if (last->instr_type == CIT_COPY && in->instr_type == CIT_COPY && dst_gap >= 0 && dst_gap == src_gap) {
+            last->size += dst_gap + in->size;
+            return;
+        }
+        if (last->instr_type == in->instr_type && (in->instr_type == CIT_NULL || in->instr_type == CIT_DEFAULT) &&
+            dst_gap >= 0) {
+            last->size += dst_gap + in->size;
+            return;
+        }
+    }
+    if (t->instrs_count == t->instrs_capacity) {
+        t->instrs_capacity = t->instrs_capacity ? t->instrs_capacity * 2 : 8;
+        t->instrs = realloc(t->instrs, sizeof(CooInstr) * t->instrs_capacity);
+    }
+    t->instrs[t->instrs_count++] = *in;
+}
+
+static void _push_null_instr(CooType *t, int dst_offset, int size) {
+    CooInstr in = { .instr_type = CIT_NULL, .dst_offset = dst_offset, .size = size };
+    _push_instr(t, &in);
+}
+
+static void _push_default_instr(CooType *t, int dst_offset, int size) {
+    CooInstr in = { .instr_type = CIT_DEFAULT, .dst_offset = dst_offset, .size = size };
+    _push_instr(t, &in);
+}
+
+static void _push_copy_instr(CooType *t, int src_offset, int dst_offset, int size) {
+    CooInstr in = { .instr_type = CIT_COPY, .src_offset = src_offset, .dst_offset = dst_offset, .size = size };
+    _push_instr(t, &in);
+}
+
+static void _compile_diff(CooType *t, CooDiff *d) {
+    int elem_size = d->is_ptr ? sizeof(void *) : d->to_type->size;
+    if (d->diff_type == CDT_COPY) {
+        if (d->is_ptr || d->to_type->is_fixed || d->to_type->is_identity)
+            _push_copy_instr(t, d->src_offset, d->dst_offset, elem_size * d->count);
+        else /* flatten nested struct instructions */
+            for (int j = 0; j < d->count; ++j)
+                for (int k = 0; k < d->to_type->instrs_count; ++k) {
+                    CooInstr in = d->to_type->instrs[k];
+                    in.src_offset += d->src_offset + j * d->src_stride;
+                    in.dst_offset += d->dst_offset + j * d->dst_stride;
+                    _push_instr(t, &in);
+                }
+    }
+    else if (d->diff_type == CDT_CAST && d->is_ptr == false && d->cast) {
+        CooInstr in = {
+            .instr_type = CIT_CAST,
+            .cast = d->cast,
+            .src_offset = d->src_offset,
+            .dst_offset = d->dst_offset,
+            .src_stride = d->src_stride,
+            .dst_stride = d->dst_stride,
+            .count = d->count,
+        };
+        _push_instr(t, &in);
+    }
+    else if (d->has_default && d->is_ptr == false) /* new values or values without a cast */
+        _push_default_instr(t, d->dst_offset, elem_size * d->count);
+    else /* new values, pointers of changed type or values without a cast */
+        _push_null_instr(t, d->dst_offset, elem_size * d->count);
+}
+
+static void _count_instrs(CooType *t) {
+    t->copied_bytes = t->zeroed_bytes = t->defaulted_bytes = t->cast_bytes = t->cast_values = 0;
+    for (int i = 0; i < t->instrs_count; ++i) {
+        CooInstr *in = t->instrs + i;
+        if (in->instr_type == CIT_COPY)
+            t->copied_bytes += in->size;
+        else if (in->instr_type == CIT_NULL)
+            t->zeroed_bytes += in->size;
+        else if (in->instr_type == CIT_DEFAULT)
+            t->defaulted_bytes += in->size;
+        else {
+            t->cast_bytes += in->dst_stride * in->count;
+            t->cast_values += in->count;
+        }
+    }
+}
+
+static void _compile_instrs(CooType *t) {
+    t->instrs_count = 0;
+    for (int i = 0; i < t->diffs_count; ++i)
+        _compile_diff(t, t->diffs + i);
+    t->is_identity = t->size == t->old_size && t->cold_size == t->old_cold_size &&
+                     t->alignment == t->old_alignment && (t->size == 0 || (t->instrs_count == 1 &&
+                     t->instrs[0].instr_type == CIT_COPY &&
+                     t->instrs[0].src_offset == 0 && t->instrs[0].dst_offset == 0));
+    _count_instrs(t);
+}
+
+static void _instr_ranges(CooInstr *in, int *src_begin, int *src_end, int *dst_begin, int *dst_end) {
+    *dst_begin = in->dst_offset;
+    *src_begin = in->src_offset;
+    if (in->instr_type == CIT_CAST) {
+        *src_end = in->src_offset + in->src_stride * in->count;
+        *dst_end = in->dst_offset + in->dst_stride * in->count;
+    }
+    else {
+        int is_read = in->instr_type == CIT_COPY; /* null and default don't read source */
+        *src_end = is_read ? in->src_offset + in->size : in->src_offset;
+        *dst_end = in->dst_offset + in->size;
+    }
+}
+
+static int _instr_overwrites(CooInstr *writer, CooInstr *reader) {
+    int r_src_begin, r_src_end, r_dst_begin, r_dst_end;
+    int w_src_begin, w_src_end, w_dst_begin, w_dst_end;
+    _instr_ranges(reader, &r_src_begin, &r_src_end, &r_dst_begin, &r_dst_end);
+    _instr_ranges(writer, &w_src_begin, &w_src_end, &w_dst_begin, &w_dst_end);
+    return w_dst_begin < r_src_end && r_src_begin < w_dst_end;
+}
+
+/* orders instructions so that each one runs before instructions that overwrite its source,
+   there's no such order if overwriting is cyclic or a cast overwrites its own source */
+static void _compile_in_place_instrs(CooType *t) {
+    t->has_in_place_order = false;
+    if (t->size != t->old_size)
+        return;
+    free(t->in_place_instrs);
+    t->in_place_instrs = malloc(sizeof(CooInstr) * _max(1, t->instrs_count));
+    int *blockers = calloc(_max(1, t->instrs_count), sizeof(int)); /* unscheduled instrs overwriting source */
+    int *done = calloc(_max(1, t->instrs_count), sizeof(int));
+    for (int i = 0; i < t->instrs_count; ++i) {
+        if (t->instrs[i].instr_type == CIT_CAST && _instr_overwrites(t->instrs + i, t->instrs + i))
+            goto cleanup;
+        for (int j = 0; j < t->instrs_count; ++j)
+            if (i != j && _instr_overwrites(t->instrs + j, t->instrs + i))
+                ++blockers[j];
+    }
+    for (int scheduled = 0; scheduled < t->instrs_count; ++scheduled) {
+        int next = -1;
+        for (int i = 0; i < t->instrs_count && next == -1; ++i)
+            if (done[i] == false && blockers[i] == 0)
+                next = i;
+        if (next == -1) /* cycle */
+            goto cleanup;
+        done[next] = true;
+        t->in_place_instrs[scheduled] = t->instrs[next];
+        for (int j = 0; j < t->instrs_count; ++j) /* next no longer needs its source */
+            if (j != next && done[j] == false && _instr_overwrites(t->instrs + j, t->instrs + next))
+                --blockers[j];
+    }
+    t->has_in_place_order = true;
+cleanup:
+    free(blockers);
+    free(done);
+}
+
+static void _compile_identity_instrs(CooType *t) {
+    t->instrs_count = 0;
+    _push_copy_instr(t, 0, 0, t->size);
+    t->is_identity = true;
+    _count_instrs(t);
+}
+
+static int _var_has_default(CooVar *v) {
+    return v->is_ptr == false && (v->has_default || v->type->defaults);
+}
+
+/* rebuilt every update as defaults of nested types can change without changing any layout */
+static void _build_defaults(CooType *t) {
+    int has_defaults = false;
+    for (int i = 0; i < t->vars_count; ++i)
+        has_defaults |= _var_has_default(t->vars + i);
+    free(t->defaults);
+    t->defaults = 0;
+    if (has_defaults == false)
+        return;
+    t->defaults = calloc(1, _max(1, _joined_size(t)));
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVar *v = t->vars + i;
+        if (v->is_ptr == false && v->has_default)
+            _fill_pattern(t->defaults + v->offset, v->default_value, v->type->size, v->count);
+        else if (v->is_ptr == false && v->type->defaults)
+            _fill_pattern(t->defaults + v->offset, v->type->defaults, v->type->size, v->count);
+    }
+}
+
+static int _is_laid_out_before(CooType *t, CooVar *v, CooVar *other) {
+    if (v->is_cold != other->is_cold)
+        return other->is_cold;
+    return t->is_optimized && _member_alignment(t, v) > _member_alignment(t, other);
+}
+
+/* indices of new variables in the order they are laid out, hot variables before cold ones, stable
+   sort by descending alignment leaves no padding between variables since each size is a multiple
+   of its alignment, returns count of hot variables */
+static int _order_vars(CooType *t, int *order) {
+    int hot_count = 0;
+    for (int i = 0; i < t->new_vars_count; ++i) {
+        int j = i;
+        for (; j > 0 && _is_laid_out_before(t, t->new_vars + i, t->new_vars + order[j - 1]); --j)
+            order[j] = order[j - 1];
+        order[j] = i;
+        hot_count += t->new_vars[i].is_cold == false;
+    }
+    return hot_count;
+}
+
 void _update_type_layout(CooType *t, int update_id) {
     if (t->is_fixed || t->update_id == update_id) /* get out if fixed or already updated */
         return;
     t->update_id = update_id;
+    int nested_affected = false;
+    for (int i = 0; i < t->new_vars_count; ++i) {
+        CooVar *v = t->new_vars + i;
+        _update_type_layout(v->type, update_id);
+        assert(v->is_ptr || v->type->cold_size == 0); /* types with cold variables can't be nested by value */
+        if (v->is_ptr == false && v->type->is_affected)
+            nested_affected = true;
+    }
+    if (t->is_modified == false && nested_affected == false) { /* layout and data remain the same */
+        t->old_size = t->size;
+        t->old_alignment = t->alignment;
+        t->old_cold_size = t->cold_size;
+        t->old_cold_offset = t->cold_offset;
+        t->is_affected = false;
+        t->is_in_place = false;
+        t->is_moved = false;
+        _compile_identity_instrs(t);
+        _build_defaults(t);
+        return;
+    }
+    t->is_modified = false;
     t->old_size = t->size;
+    t->old_cold_size = t->cold_size;
+    t->old_cold_offset = t->cold_offset;
+    t->old_alignment = t->alignment;
     t->size = 0;
-    t->alignment = 1;
+    t->alignment = _max(1, t->min_alignment);
     t->diffs_count = 0;
-    for (int i = 0; i < t->new_vars_count; ++i) {
+    t->var_diffs = _reserve(t->var_diffs, &t->var_diffs_capacity, t->new_vars_count, sizeof(CooVarDiff));
+    int *order = malloc(sizeof(int) * _max(1, t->new_vars_count));
+    int hot_count = _order_vars(t, order), hot_size = 0, cold_alignment = 1;
+    for (int k = hot_count; k < t->new_vars_count; ++k)
+        cold_alignment = _max(cold_alignment, _member_alignment(t, t->new_vars + order[k]));
+    for (int k = 0; k < t->new_vars_count; ++k) { /* diffs are pushed in ascending offset order */
+        int i = order[k];
         CooVar *v = t->new_vars + i;
-        _update_type_layout(v->type, update_id);
-        v->offset = _round_up(t->size, _variable_alignment(v));
+        if (k == hot_count) { /* cold part follows hot part */
+            hot_size = _round_up(t->size, t->alignment);
+            t->size = t->cold_offset = _round_up(hot_size, cold_alignment);
+        }
+        v->offset = _round_up(t->size, _member_alignment(t, v));
+        CooVarDiff *vd = t->var_diffs + i;
+        vd->old_index = v->old_index;
+        vd->offset = v->offset;
+        vd->bytes = _variable_size(v) * v->count;
+        vd->diffs_begin = t->diffs_count;
+        vd->old_offset = vd->old_bytes = 0;
+        vd->is_cold = v->is_cold;
+        vd->was_cold = v->old_index != -1 && t->vars[v->old_index].is_cold;
 
         if (v->old_index == -1) { /* new variable */
-            assert(t->diffs_count < COO_MAX_DIFFS);
-            CooDiff *d = t->diffs + t->diffs_count++;
+            CooDiff *d = _push_diff(t);
             d->diff_type = CDT_NULL;
             d->dst_offset = v->offset;
             d->count = v->count;
             d->to_type = v->type;
             d->is_ptr = v->is_ptr;
+            d->has_default = _var_has_default(v);
         }
         else { /* old variable */
             CooVar *old_v = t->vars + v->old_index;
             int copied_count = _min(v->count, old_v->count);
+            vd->old_offset = old_v->offset;
+            vd->old_bytes = _variable_old_size(old_v) * old_v->count;
             if (v->type != old_v->type) { /* type changed, cast variable value(s) if cast exists */
-                assert(t->diffs_count < COO_MAX_DIFFS);
-                CooDiff *d = t->diffs + t->diffs_count++;
+                CooDiff *d = _push_diff(t);
                 d->diff_type = CDT_CAST;
                 d->src_offset = old_v->offset;
                 d->dst_offset = v->offset;
                 d->src_stride = _variable_old_size(old_v);
                 d->dst_stride = _variable_size(v);
                 d->count = copied_count;
+                d->to_type = v->type;
                 d->cast = _find_cast(old_v->type, v->type);
                 d->is_ptr = v->is_ptr;
+                d->has_default = _var_has_default(v);
             }
             else { /* type remained same, copy variable value(s) */
-                assert(t->diffs_count < COO_MAX_DIFFS);
-                CooDiff *d = t->diffs + t->diffs_count++;
+                CooDiff *d = _push_diff(t);
                 d->diff_type = CDT_COPY;
                 d->src_offset = old_v->offset;
                 d->dst_offset = v->offset;
@@ -189,101 +1184,574 @@ void _update_type_layout(CooType *t, int update_id) {
                 d->is_ptr = v->is_ptr;
             }
             if (v->count > old_v->count) { /* new array value(s), initialize to 0 */
-                assert(t->diffs_count < COO_MAX_DIFFS);
-                CooDiff *d = t->diffs + t->diffs_count++;
+                CooDiff *d = _push_diff(t);
                 d->diff_type = CDT_NULL;
                 d->dst_offset = v->offset + old_v->count * _variable_size(v);
                 d->count = v->count - old_v->count;
                 d->to_type = v->type;
                 d->is_ptr = v->is_ptr;
+                d->has_default = _var_has_default(v);
             }
         }
 
+        vd->diffs_count = t->diffs_count - vd->diffs_begin;
+        CooDiff *d = t->diffs + vd->diffs_begin;
+        vd->is_kept = vd->diffs_count == 1 && d->diff_type == CDT_COPY && vd->bytes == vd->old_bytes &&
+                      (d->is_ptr || d->to_type->is_affected == false);
         t->size = v->offset + _variable_size(v) * v->count;
-        t->alignment = _max(t->alignment, _variable_alignment(v));
+        if (v->is_cold == false)
+            t->alignment = _max(t->alignment, _member_alignment(t, v));
         v->old_index = i;
     }
-    t->size = _round_up(t->size, t->alignment);
-    for (int i = 0; i < t->new_vars_count; ++i)
-        t->vars[i] = t->new_vars[i];
+    free(order);
+    if (hot_count < t->new_vars_count) {
+        t->cold_size = _round_up(t->size - t->cold_offset, cold_alignment);
+        t->size = hot_size;
+    }
+    else {
+        t->cold_size = t->cold_offset = 0;
+        t->size = _round_up(t->size, t->alignment);
+    }
+    t->vars = _reserve(t->vars, &t->vars_capacity, t->new_vars_count, sizeof(CooVar));
+    memcpy(t->vars, t->new_vars, sizeof(CooVar) * t->new_vars_count);
     t->vars_count = t->new_vars_count;
+    _build_defaults(t);
+    _compile_instrs(t);
+    t->is_affected = t->is_identity == false;
+    t->is_in_place = t->is_affected && t->size <= t->old_size && t->alignment <= t->old_alignment &&
+                     _has_cold(t) == false; /* new version fits into old batches */
+    t->is_moved = t->is_affected && t->is_in_place == false;
+    if (t->is_in_place)
+        _compile_in_place_instrs(t);
+}
+
+/* maps offset inside an old instance to offset of the same value in new instance, offsets inside
+   nested structs are mapped recursively, -1 if value was removed */
+static int _map_offset(CooType *t, int offset) {
+    if (offset == 0 || t->is_affected == false)
+        return offset;
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVarDiff *vd = t->var_diffs + i;
+        if (vd->old_index == -1 || vd->was_cold || offset < vd->old_offset || offset >= vd->old_offset + vd->old_bytes)
+            continue;
+        if (vd->is_cold)
+            return -1; /* pointers into side buffers aren't redirected */
+        int inner = _map_var_offset(t, vd, offset - vd->old_offset);
+        return inner == -1 ? -1 : vd->offset + inner;
+    }
+    return -1;
+}
+
+/* maps offset inside old value of a variable to offset inside its new value, -1 if value was removed */
+static int _map_var_offset(CooType *t, CooVarDiff *vd, int offset) {
+    CooDiff *d = t->diffs + vd->diffs_begin; /* copy or cast of old values */
+    int index = offset / d->src_stride;
+    int inner = offset % d->src_stride;
+    if (index >= d->count)
+        return -1; /* array shrunk */
+    if (d->diff_type == CDT_CAST)
+        inner = 0;
+    else if (d->is_ptr == false)
+        inner = _map_offset(d->to_type, inner);
+    return inner == -1 ? -1 : index * d->dst_stride + inner;
+}
+
+/* primitive types are shared between states, so pointers to them can point into any data of a state */
+int _is_relocated(CooType *t, int is_data_relocated) {
+    return t->is_fixed ? is_data_relocated : t->is_relocated;
+}
+
+void _relocate_type(CooType *t) {
+    t->is_relocated = true;
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVar *v = t->vars + i;
+        if (v->is_ptr == false && v->type->is_fixed == false && v->type->is_relocated == false)
+            _relocate_type(v->type);
+    }
+}
+
+static void _push_ptr_run(CooType *t, int offset, int count) {
+    if (t->ptr_runs_count) { /* try to extend previous run */
+        CooPtrRun *last = t->ptr_runs + t->ptr_runs_count - 1;
+        if (last->offset + last->count * (int)sizeof(void *) == offset) {
+            last->count += count;
+            return;
+        }
+    }
+    if (t->ptr_runs_count == t->ptr_runs_capacity) {
+        t->ptr_runs_capacity = t->ptr_runs_capacity ? t->ptr_runs_capacity * 2 : 4;
+        t->ptr_runs = realloc(t->ptr_runs, sizeof(CooPtrRun) * t->ptr_runs_capacity);
+    }
+    CooPtrRun *r = t->ptr_runs + t->ptr_runs_count++;
+    r->offset = offset;
+    r->count = count;
+}
+
+void _update_type_pointers(CooType *t, int update_id, CooPtrRunsKind kind, int is_data_relocated) {
+    if (t->is_fixed || t->pointers_update_id == update_id)
+        return;
+    t->pointers_update_id = update_id;
+    t->ptr_runs_count = 0;
+    t->points_to_moved = false;
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVar *v = t->vars + i;
+        if (v->is_ptr) {
+            /* lazily migrated data can move whenever it is first accessed, so lazy update redirects
+               all pointers to struct types, pointers to primitive types can point into host memory */
+            int is_moved = kind == CPK_MOVED ? _is_relocated(v->type, is_data_relocated) : v->type->is_affected;
+            int is_run = is_moved || kind == CPK_ALL || (kind == CPK_LAZY && v->type->is_fixed == false);
+            if (is_run && v->is_cold == false) /* cold pointers are redirected as columns */
+                _push_ptr_run(t, v->offset, v->count);
+            v->points_to_moved = is_moved;
+        }
+        else { /* flatten nested struct pointers */
+            _update_type_pointers(v->type, update_id, kind, is_data_relocated);
+            for (int j = 0; j < v->count && v->is_cold == false; ++j)
+                for (int k = 0; k < v->type->ptr_runs_count; ++k) {
+                    CooPtrRun *r = v->type->ptr_runs + k;
+                    _push_ptr_run(t, v->offset + j * v->type->size + r->offset, r->count);
+                }
+            v->points_to_moved = v->type->points_to_moved;
+        }
+        t->points_to_moved |= v->points_to_moved;
+    }
+    t->ptrs_count = 0;
+    for (int i = 0; i < t->ptr_runs_count; ++i)
+        t->ptrs_count += t->ptr_runs[i].count;
 }
 
-static void _redirect_pointers(char *mem, int count) {
+void _push_version(CooType *t) {
+    if (t->versions_count == t->versions_capacity) {
+        t->versions_capacity = t->versions_capacity ? t->versions_capacity * 2 : 4;
+        t->versions = realloc(t->versions, sizeof(CooVersion) * t->versions_capacity);
+    }
+    CooVersion *v = t->versions + t->versions_count++;
+    v->instrs_count = t->is_identity ? 0 : t->instrs_count;
+    v->instrs = v->instrs_count ? malloc(sizeof(CooInstr) * v->instrs_count) : 0;
+    if (v->instrs_count)
+        memcpy(v->instrs, t->instrs, sizeof(CooInstr) * v->instrs_count);
+    v->is_identity = t->is_identity;
+    v->old_size = t->old_size;
+    v->size = t->size;
+    v->defaults = t->defaults ? malloc(t->size) : 0;
+    if (v->defaults)
+        memcpy(v->defaults, t->defaults, t->size);
+    ++t->version;
+}
+
+void _clear_versions(CooType *t) {
+    for (int i = 0; i < t->versions_count; ++i) {
+        free(t->versions[i].instrs);
+        free(t->versions[i].defaults);
+    }
+    t->versions_count = 0;
+    t->versions_base = t->version;
+}
+
+/* pointers of packed types can be unaligned, memcpy compiles to plain loads and stores */
+static void _redirect_pointers(CooForwards *f, char *mem, int count) {
     for (int i = 0; i < count; ++i) {
-        *(void **)mem = _update_pointer(*(void **)mem);
+        void *ptr;
+        memcpy(&ptr, mem, sizeof(ptr));
+        ptr = _update_pointer(f, ptr);
+        memcpy(mem, &ptr, sizeof(ptr));
         mem += sizeof(void *);
     }
 }
 
-static void _redirect_struct_pointers(char *mem, CooType *type, int count) {
-    if (type->vars_count == 0)
+static void _redirect_struct_pointers(CooForwards *f, char *mem, CooType *type, int count) {
+    if (type->points_to_moved == false)
         return;
     for (int i = 0; i < count; ++i) {
-        for (int j = 0; j < type->vars_count; ++j) {
-            CooVar *v = type->vars + j;
-            if (v->is_ptr == true) { /* pointers */
-                if (v->type->is_fixed == false) /* pointers to managed structs */
-                    _redirect_pointers(mem + v->offset, v->count);
-            }
-            else /* structs */
-                _redirect_struct_pointers(mem + v->offset, v->type, v->count);
-        }
+        for (int j = 0; j < type->ptr_runs_count; ++j)
+            _redirect_pointers(f, mem + type->ptr_runs[j].offset, type->ptr_runs[j].count);
         mem += type->size;
     }
 }
 
-void _update_alloc_pointers(CooAlloc *a) {
-    if (a->is_ptr == true) { /* pointers */
-        if (a->type->is_fixed == false) { /* pointers to managed structs */
-            for (CooTag *tag = a->first; tag; tag = tag->next)
-                _redirect_pointers((char *)_tag_to_data(tag), tag->count);
-        }
+void _redirect_alloc_data(CooAlloc *a) {
+    if (a->is_ptr) {
+        if (a->points_to_moved)
+            for (CooTag *tag = a->first; tag; tag = tag->next) {
+                _redirect_pointers(a->forwards, (char *)_tag_to_data(tag), tag->count);
+                a->stats.redirected_pointers += tag->count;
+            }
     }
-    else { /* structs */
-        if (a->type->is_fixed) { /* unmanaged structs */
-            for (CooTag *tag = a->first; tag; tag = tag->next)
-                _redirect_struct_pointers((char *)_tag_to_data(tag), a->type, tag->count);
+    else if (a->type->points_to_moved)
+        for (CooTag *tag = a->first; tag; tag = tag->next) {
+            _redirect_struct_pointers(a->forwards, (char *)_tag_to_data(tag), a->type, tag->count);
+            a->stats.redirected_pointers += (size_t)a->type->ptrs_count * tag->count;
         }
-        else { /* managed structs */
-            a->old_first = a->first; /* for freeing old data later */
-            CooTag *tag = a->first = a->first ? a->first->redirect : 0;
-            while (tag) {
-                tag->prev = tag->prev ? tag->prev->redirect : 0;
-                tag->next = tag->next ? tag->next->redirect : 0;
-                _redirect_struct_pointers((char *)_tag_to_data(tag), a->type, tag->count);
-                tag = tag->next;
+}
+
+static void _remigrate_column(CooAlloc *a, int var_index, char *src_mem, int src_stride,
+                              char *dst_mem, int dst_stride, int count) {
+    CooType *t = a->type;
+    _migrate_column(t, var_index, src_mem, src_stride, dst_mem, dst_stride, count);
+    _count_column(&a->stats, t, var_index, count);
+    if (t->vars[var_index].points_to_moved) {
+        _redirect_column(a->forwards, t->vars + var_index, dst_mem, dst_stride, count);
+        a->stats.redirected_pointers += _column_pointers(t->vars + var_index, count);
+    }
+}
+
+/* only migrated columns are migrated again, kept columns are shared with old batch */
+static void _remigrate_soa_tag(CooAlloc *a, CooTag *tag) {
+    CooType *t = a->type;
+    CooColumn *o_columns = _tag_to_data(tag), *n_columns = _tag_to_data(tag->redirect);
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVarDiff *vd = t->var_diffs + i;
+        if (vd->is_kept == false)
+            _remigrate_column(a, i, vd->old_index == -1 ? 0 : o_columns[vd->old_index].mem, vd->old_bytes,
+                              n_columns[i].mem, vd->bytes, tag->count);
+    }
+}
+
+static void _remigrate_split_tag(CooAlloc *a, CooTag *tag) {
+    CooType *t = a->type;
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVarDiff *vd = t->var_diffs + i;
+        _remigrate_column(a, i, vd->old_index == -1 ? 0 : _split_var_mem(tag, vd->old_offset, vd->was_cold, t->old_cold_offset),
+                          vd->was_cold ? t->old_cold_size : t->old_size,
+                          _split_var_mem(tag->redirect, vd->offset, vd->is_cold, t->cold_offset),
+                          vd->is_cold ? t->cold_size : t->size, tag->count);
+    }
+}
+
+void _remigrate_dirty_data(CooAlloc *a) {
+    for (CooTag *tag = a->first; tag; tag = tag->next)
+        if (tag->is_dirty) {
+            tag->is_dirty = false;
+            if (a->is_soa) {
+                if (a->type->is_affected)
+                    _remigrate_soa_tag(a, tag);
+                continue;
+            }
+            if (a->is_ptr == false && _has_cold(a->type)) {
+                if (a->type->is_affected)
+                    _remigrate_split_tag(a, tag);
+                continue;
             }
+            if (a->is_ptr || a->type->is_moved == false) /* batch is redirected in place after migration */
+                continue;
+            _migrate_elements(a->type, _tag_to_data(tag), _tag_to_data(tag->redirect), tag->count);
+            _redirect_struct_pointers(a->forwards, _tag_to_data(tag->redirect), a->type, tag->count);
+            _count_migration(&a->stats, a->type, tag->count);
+            a->stats.redirected_pointers += (size_t)a->type->ptrs_count * tag->count;
+        }
+}
+
+/* batch is looked up in old batches of states in update, batches that don't move aren't migrated again */
+void coo_mark_dirty(void *batch) {
+    _lock_shared();
+    for (CooForwards *f = _active_forwards; f && batch; f = f->next_active) {
+        CooForward *w = _find_forward(f, batch);
+        if (w) {
+            assert(w->begin == (char *)batch); /* only whole batches are marked */
+            _data_to_tag(batch)->is_dirty = true;
+            break;
+        }
+    }
+    _unlock_shared();
+}
+
+void _link_new_versions_of_data(CooAlloc *a) {
+    if (a->is_soa ? a->type->is_affected : a->is_ptr == false && a->type->is_moved) { /* link new batches, their pointers are already redirected */
+        a->old_first = a->first; /* for freeing old data later */
+        CooTag *tag = a->first = a->first ? a->first->redirect : 0;
+        while (tag) {
+            tag->prev = tag->prev ? tag->prev->redirect : 0;
+            tag->next = tag->next ? tag->next->redirect : 0;
+            tag = tag->next;
         }
     }
 }
 
 void _free_old_versions_of_data(CooAlloc *a) {
-    if (a->is_ptr == false && a->type->is_fixed == false) {
-        while (a->old_first) {
-            CooTag *tag = a->old_first;
-            a->old_first = a->old_first->next;
-            free(tag);
+    while (a->old_first) {
+        CooTag *tag = a->old_first;
+        a->old_first = a->old_first->next;
+        _free_tag(tag);
+        ++a->stats.freed_batches;
+    }
+}
+
+void _free_moved_batches(CooAlloc *a) {
+    while (a->moved) {
+        CooTag *tag = a->moved;
+        a->moved = a->moved->next;
+        _free_tag(tag);
+        --a->type->moved_batches_count;
+    }
+}
+
+int _is_migration_job(CooJob *j) {
+    return j->job_type == CJT_MIGRATE || j->job_type == CJT_MIGRATE_IN_PLACE || j->job_type == CJT_MIGRATE_COLUMN;
+}
+
+void _add_update_stats(CooUpdateStats *to, const CooUpdateStats *stats) {
+    to->layout_time += stats->layout_time;
+    to->migration_time += stats->migration_time;
+    to->redirection_time += stats->redirection_time;
+    to->free_time += stats->free_time;
+    to->copied_bytes += stats->copied_bytes;
+    to->zeroed_bytes += stats->zeroed_bytes;
+    to->defaulted_bytes += stats->defaulted_bytes;
+    to->cast_bytes += stats->cast_bytes;
+    to->cast_values += stats->cast_values;
+    to->allocated_batches += stats->allocated_batches;
+    to->freed_batches += stats->freed_batches;
+    to->redirected_pointers += stats->redirected_pointers;
+}
+
+static int _is_stale(CooTag *tag) {
+    return tag->version != tag->alloc->type->version;
+}
+
+static void _run_version(CooVersion *v, char *src_mem, char *dst_mem) {
+    if (v->is_identity)
+        memcpy(dst_mem, src_mem, v->size);
+    else
+        _run_instrs(v->instrs, v->instrs_count, v->defaults, src_mem, dst_mem);
+}
+
+/* migrates elements through all versions since the one they were written with, one element at
+   a time through scratch memory so that migration within the same batch never overwrites
+   elements that are not migrated yet */
+static void _migrate_versions(CooType *t, int version, char *src_mem, char *dst_mem, int count) {
+    CooVersion *first = t->versions + (version - t->versions_base);
+    CooVersion *end = t->versions + t->versions_count;
+    int max_size = 1;
+    for (CooVersion *v = first; v < end; ++v)
+        max_size = _max(max_size, _max(v->old_size, v->size));
+    char *scratch = calloc(2, max_size);
+    int is_ascending = src_mem != dst_mem || t->size <= first->old_size;
+    for (int k = 0; k < count; ++k) {
+        int i = is_ascending ? k : count - 1 - k;
+        char *src = scratch, *dst = scratch + max_size;
+        memcpy(src, src_mem + (size_t)first->old_size * i, first->old_size);
+        for (CooVersion *v = first; v < end; ++v) {
+            _run_version(v, src, dst);
+            char *swap = src;
+            src = dst;
+            dst = swap;
+        }
+        memcpy(dst_mem + (size_t)t->size * i, src, t->size);
+    }
+    free(scratch);
+}
+
+/* links new batch in place of old one, which is kept as a stub that redirects to it */
+static void _replace_with_stub(CooAlloc *a, CooTag *tag, CooTag *n_tag, CooTag **stubs) {
+    if (tag->prev)
+        tag->prev->next = n_tag;
+    else
+        a->first = n_tag;
+    if (tag->next)
+        tag->next->prev = n_tag;
+    tag->redirect = n_tag;
+    tag->prev = 0;
+    tag->next = *stubs;
+    *stubs = tag;
+}
+
+/* migrates batch written with an older version, batch that doesn't fit into its old memory is
+   replaced by a new one and kept as a stub that redirects to the new one */
+static CooTag *_migrate_stale_tag(CooTag *tag) {
+    CooAlloc *a = tag->alloc;
+    CooType *t = a->type;
+    int is_identity = true;
+    for (int i = tag->version - t->versions_base; i < t->versions_count; ++i)
+        is_identity &= t->versions[i].is_identity;
+    CooTag *n_tag = tag;
+    if (a->is_ptr || is_identity)
+        ; /* only pointers are redirected */
+    else if ((size_t)t->size * tag->count <= _data_bytes(tag) && (uintptr_t)_tag_to_data(tag) % t->alignment == 0)
+        _migrate_versions(t, tag->version, _tag_to_data(tag), _tag_to_data(tag), tag->count);
+    else {
+        n_tag = _malloc_with_tag(a->update_allocator, a, t->size, tag->count, tag->prev, tag->next);
+        _migrate_versions(t, tag->version, _tag_to_data(tag), _tag_to_data(n_tag), tag->count);
+        _replace_with_stub(a, tag, n_tag, &a->stubs);
+    }
+    n_tag->version = t->version;
+    --a->stale_count;
+    return n_tag;
+}
+
+typedef struct CooTouched { /* migrated batches whose pointers are not redirected yet */
+    CooTag **tags;
+    int tags_count, tags_capacity;
+} CooTouched;
+
+static void _push_touched(CooTouched *touched, CooTag *tag) {
+    if (touched->tags_count == touched->tags_capacity) {
+        touched->tags_capacity = touched->tags_capacity ? touched->tags_capacity * 2 : 16;
+        touched->tags = realloc(touched->tags, sizeof(CooTag *) * touched->tags_capacity);
+    }
+    touched->tags[touched->tags_count++] = tag;
+}
+
+static void _touch_pointers(char *mem, int count, CooTouched *touched) {
+    for (int i = 0; i < count; ++i) {
+        void *ptr;
+        memcpy(&ptr, mem, sizeof(ptr));
+        ptr = _resolve_pointer(0, ptr); /* lazily migrated data is never indexed */
+        if (ptr && _is_stale(_data_to_tag(ptr))) { /* pointed data is migrated before pointer is redirected */
+            CooTag *tag = _migrate_stale_tag(_data_to_tag(ptr));
+            _push_touched(touched, tag);
+            ptr = _tag_to_data(tag);
+        }
+        memcpy(mem, &ptr, sizeof(ptr));
+        mem += sizeof(void *);
+    }
+}
+
+/* data reachable from a migrated batch is migrated too, so migrated data never points to old batches */
+CooTag *_touch_tag(CooTag *tag) {
+    if (_is_stale(tag) == false)
+        return tag;
+    CooTouched touched = { 0, 0, 0 };
+    tag = _migrate_stale_tag(tag);
+    _push_touched(&touched, tag);
+    while (touched.tags_count) {
+        CooTag *t_tag = touched.tags[--touched.tags_count];
+        CooType *t = t_tag->alloc->type;
+        char *mem = _tag_to_data(t_tag);
+        if (t_tag->alloc->is_ptr)
+            _touch_pointers(mem, t_tag->count, &touched);
+        else if (t->ptr_runs_count)
+            for (int i = 0; i < t_tag->count; ++i)
+                for (int j = 0; j < t->ptr_runs_count; ++j)
+                    _touch_pointers(mem + (size_t)t->size * i + t->ptr_runs[j].offset, t->ptr_runs[j].count,
+                                    &touched);
+    }
+    free(touched.tags);
+    return tag;
+}
+
+void _touch_alloc(CooAlloc *a) {
+    for (CooTag *tag = a->first; tag && a->stale_count; tag = tag->next)
+        tag = _touch_tag(tag);
+}
+
+void _free_stubs(CooAlloc *a) {
+    for (CooTag *tag = a->moved; tag; tag = tag->next) /* skip stubs that are about to be freed */
+        while (tag->redirect->redirect)
+            tag->redirect = tag->redirect->redirect;
+    while (a->stubs) {
+        CooTag *tag = a->stubs;
+        a->stubs = a->stubs->next;
+        _free_tag(tag);
+    }
+}
+
+static void _push_forward(CooForwards *f, char *begin, size_t bytes, CooTag *tag, CooType *type, int column) {
+    if (f->forwards_count == f->forwards_capacity) {
+        f->forwards_capacity = f->forwards_capacity ? f->forwards_capacity * 2 : 64;
+        f->forwards = realloc(f->forwards, sizeof(CooForward) * f->forwards_capacity);
+    }
+    CooForward *w = f->forwards + f->forwards_count++;
+    w->begin = begin;
+    w->end = w->begin + bytes;
+    w->tag = tag;
+    w->type = type;
+    w->column = column;
+}
+
+void _add_moved_forwards(CooForwards *f, CooAlloc *a) {
+    for (CooTag *tag = a->moved; tag; tag = tag->next) /* offsets don't change, whole capacity is forwarded */
+        _push_forward(f, _tag_to_data(tag), _data_bytes(tag), tag->redirect, 0, -1);
+}
+
+void _add_alloc_forwards(CooForwards *f, CooAlloc *a) {
+    CooType *t = a->type;
+    if (a->is_soa && t->is_affected) /* whole soa batches and columns that move, kept columns don't move */
+        for (CooTag *tag = a->first; tag; tag = tag->next) {
+            CooColumn *columns = _tag_to_data(tag);
+            _push_forward(f, (char *)columns, sizeof(CooColumn) * tag->columns_count, tag->redirect, 0, -1);
+            for (int i = 0; i < tag->columns_count; ++i)
+                if (columns[i].allocator)
+                    _push_forward(f, columns[i].mem, columns[i].bytes, tag->redirect, t, i);
         }
+    else if (a->is_ptr == false && t->is_affected)
+        for (CooTag *tag = a->first; tag; tag = tag->next)
+            _push_forward(f, _tag_to_data(tag), (size_t)t->old_size * tag->count, t->is_moved ? tag->redirect : tag, t, -1);
+    _add_moved_forwards(f, a);
+}
+
+void _set_forward(CooForwards *f, CooTag *old_tag) {
+    _find_forward(f, _tag_to_data(old_tag))->tag = old_tag->redirect;
+}
+
+static int _compare_forwards(const void *a, const void *b) {
+    char *a_begin = ((CooForward *)a)->begin;
+    char *b_begin = ((CooForward *)b)->begin;
+    return (a_begin > b_begin) - (a_begin < b_begin);
+}
+
+void _sort_forwards(CooForwards *f) {
+    if (f->forwards_count == 0)
+        return;
+    qsort(f->forwards, f->forwards_count, sizeof(CooForward), _compare_forwards);
+    if (f->starts_capacity < f->forwards_count * 2) {
+        for (f->starts_capacity = 64, f->starts_shift = 58; f->starts_capacity < f->forwards_count * 2; --f->starts_shift)
+            f->starts_capacity *= 2;
+        free(f->starts);
+        f->starts = malloc(sizeof(int) * f->starts_capacity);
+    }
+    memset(f->starts, 0, sizeof(int) * f->starts_capacity);
+    int mask = f->starts_capacity - 1;
+    for (int i = 0; i < f->forwards_count; ++i) {
+        int j = _start_slot(f, f->forwards[i].begin);
+        while (f->starts[j])
+            j = (j + 1) & mask;
+        f->starts[j] = i + 1;
+    }
+}
+
+void _activate_forwards(CooForwards *f) {
+    if (f->is_active)
+        return;
+    _lock_shared();
+    f->is_active = true;
+    f->next_active = _active_forwards;
+    _active_forwards = f;
+    _unlock_shared();
+}
+
+void _deactivate_forwards(CooForwards *f) {
+    if (f->is_active) {
+        _lock_shared();
+        CooForwards **link = &_active_forwards;
+        while (*link != f)
+            link = &(*link)->next_active;
+        *link = f->next_active;
+        f->is_active = false;
+        _unlock_shared();
     }
+    f->forwards_count = 0;
 }
 
 static void _init_var(CooVar *v, const char *name, CooType *t, int count, int is_ptr) {
-    strcpy_s(v->name, COO_MAX_NAME, name);
+    v->name = name;
     v->type = t;
     v->count = count;
     v->is_ptr = is_ptr;
     v->old_index = -1;
+    v->has_default = false;
+    v->is_cold = false;
+    v->points_to_moved = false;
 }
 
 static void _add_var(CooType *t, const char *v_name, CooType *v_type,
                      int v_count, int v_index, int v_is_ptr) {
     assert(t->is_fixed == false);
-    assert(t->new_vars_count < COO_MAX_VARS); /* no room for another variable */
+    v_name = _intern_name(t->names, v_name);
     for (int i = 0; i < t->vars_count; ++i)
-        assert(strcmp(v_name, t->vars[i].name) != 0); /* no old variable with same name */
+        assert(v_name != t->vars[i].name); /* no old variable with same name */
     for (int i = 0; i < t->new_vars_count; ++i)
-        assert(strcmp(v_name, t->new_vars[i].name) != 0); /* no new variable with same name */
+        assert(v_name != t->new_vars[i].name); /* no new variable with same name */
+    t->new_vars = _reserve(t->new_vars, &t->new_vars_capacity, t->new_vars_count + 1, sizeof(CooVar));
     if (v_index < 0 || v_index > t->new_vars_count) /* if index out of range, append variable */
         v_index = t->new_vars_count;
     for (int i = t->new_vars_count - 1; i >= v_index; --i) /* make room for the new variable */
@@ -291,6 +1759,7 @@ static void _add_var(CooType *t, const char *v_name, CooType *v_type,
     CooVar *v = t->new_vars + v_index;
     _init_var(v, v_name, v_type, v_count, v_is_ptr);
     ++t->new_vars_count;
+    t->is_modified = true;
 }
 
 void coo_add_var(CooType *t, const char *v_name, CooType *v_type) {
@@ -325,33 +1794,38 @@ void coo_ins_ptr_arr(CooType *t, const char *v_name, CooType *v_type, int v_coun
     _add_var(t, v_name, v_type, v_count, v_count, true);
 }
 
-static int _variable_index(CooVar *vars, int vars_count, const char *v_name) {
-    for (int i = 0; i < vars_count; ++i)
-        if (strcmp(vars[i].name, v_name) == 0)
+static int _variable_index(CooType *t, const char *v_name) {
+    v_name = _find_name(t->names, v_name); /* interned names compare by pointer */
+    if (v_name == 0)
+        return -1;
+    for (int i = 0; i < t->new_vars_count; ++i)
+        if (t->new_vars[i].name == v_name)
             return i;
     return -1;
 }
 
 void coo_remove_var(CooType *t, const char *v_name) {
     assert(t->is_fixed == false);
-    int index = _variable_index(t->new_vars, t->new_vars_count, v_name);
+    int index = _variable_index(t, v_name);
     assert(index != -1); /* variable not found */
     for (int i = index + 1; i < t->new_vars_count; ++i)
         t->new_vars[i - 1] = t->new_vars[i];
     --t->new_vars_count;
+    t->is_modified = true;
 }
 
 void coo_resize_array(CooType *t, const char *v_name, int length) {
     assert(t->is_fixed == false);
     assert(length > 0);
-    int index = _variable_index(t->new_vars, t->new_vars_count, v_name);
+    int index = _variable_index(t, v_name);
     assert(index != -1); /* variable not found */
     t->new_vars[index].count = length;
+    t->is_modified = true;
 }
 
 void coo_move_var(CooType *t, const char *v_name, int new_index) {
     assert(t->is_fixed == false);
-    int old_index = _variable_index(t->new_vars, t->new_vars_count, v_name);
+    int old_index = _variable_index(t, v_name);
     assert(old_index != -1); /* variable not found */
     if (old_index == new_index)
         return;
@@ -363,38 +1837,272 @@ void coo_move_var(CooType *t, const char *v_name, int new_index) {
         for (int i = old_index; i < new_index; ++i)
             t->new_vars[i] = t->new_vars[i + 1];
     t->new_vars[new_index] = v;
+    t->is_modified = true;
 }
 
 void coo_retype_var(struct CooType *t, const char *v_name, struct CooType *to_type) {
     assert(t->is_fixed == false);
     assert(to_type != 0);
-    int index = _variable_index(t->new_vars, t->new_vars_count, v_name);
+    int index = _variable_index(t, v_name);
     assert(index != -1); /* variable not found */
     t->new_vars[index].type = to_type;
+    t->is_modified = true;
+}
+
+void coo_set_var_default(CooType *t, const char *v_name, const void *value) {
+    assert(t->is_fixed == false);
+    int index = _variable_index(t, v_name);
+    assert(index != -1); /* variable not found */
+    CooVar *v = t->new_vars + index;
+    assert(v->is_ptr == false && v->type->is_fixed); /* primitive variables only */
+    assert(v->type->size <= (int)sizeof(v->default_value));
+    v->has_default = value != 0;
+    memset(v->default_value, 0, sizeof(v->default_value));
+    if (value)
+        memcpy(v->default_value, value, v->type->size);
+    t->is_modified = true;
+}
+
+int coo_type_size(CooType *t) {
+    return t->size;
+}
+
+void coo_set_optimized_layout(CooType *t, int is_optimized) {
+    assert(t->is_fixed == false);
+    if (t->is_optimized == (is_optimized != 0))
+        return;
+    t->is_optimized = is_optimized != 0;
+    t->is_modified = true;
+}
+
+int coo_var_offset(CooType *t, const char *v_name) {
+    if (t->is_fixed)
+        return -1;
+    v_name = _find_name(t->names, v_name);
+    for (int i = 0; i < t->vars_count && v_name; ++i)
+        if (t->vars[i].name == v_name)
+            return t->vars[i].is_cold ? t->vars[i].offset - t->cold_offset : t->vars[i].offset;
+    return -1;
+}
+
+void coo_set_type_packing(CooType *t, int packing) {
+    assert(t->is_fixed == false);
+    assert(packing >= 0 && (packing & (packing - 1)) == 0); /* power of two */
+    t->packing = packing;
+    t->is_modified = true;
+}
+
+void coo_set_type_alignment(CooType *t, int alignment) {
+    assert(t->is_fixed == false);
+    assert(alignment >= 0 && (alignment & (alignment - 1)) == 0); /* power of two */
+    t->min_alignment = alignment;
+    t->is_modified = true;
+}
+
+void coo_set_var_cold(CooType *t, const char *v_name, int is_cold) {
+    assert(t->is_fixed == false);
+    int index = _variable_index(t, v_name);
+    assert(index != -1); /* variable not found */
+    if (t->new_vars[index].is_cold == (is_cold != 0))
+        return;
+    t->new_vars[index].is_cold = is_cold != 0;
+    t->is_modified = true;
+}
+
+int coo_cold_size(CooType *t) {
+    return t->cold_size;
+}
+
+void *coo_get_cold(void *batch) {
+    return batch ? _data_to_tag(batch)->cold : 0;
+}
+
+int _has_cold_vars(CooType *t) {
+    for (int i = 0; i < t->new_vars_count; ++i)
+        if (t->new_vars[i].is_cold)
+            return true;
+    return t->cold_size != 0;
+}
+
+/* new values of a column from element begin to end */
+static void _init_column(CooType *t, int var_index, char *mem, int begin, int end) {
+    CooVar *v = t->vars + var_index;
+    size_t bytes = (size_t)_variable_size(v) * v->count;
+    if (v->is_ptr == false && t->defaults)
+        _fill_pattern(mem + bytes * begin, t->defaults + v->offset, bytes, end - begin);
+    else
+        memset(mem + bytes * begin, 0, bytes * (end - begin));
+}
+
+static void *_alloc_soa(CooAlloc *a, int count) {
+    CooType *t = a->type;
+    CooTag *tag = _malloc_soa_tag(a->allocator, a, count, 0, a->first);
+    if (a->first)
+        a->first->prev = tag;
+    a->first = tag;
+    CooColumn *columns = _tag_to_data(tag);
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooVar *v = t->vars + i;
+        _alloc_column(columns + i, a->allocator, (size_t)_variable_size(v) * v->count * count);
+        _init_column(t, i, columns[i].mem, 0, count);
+    }
+    return columns;
+}
+
+/* new cold parts from element begin to end */
+static void _init_cold(CooType *t, char *cold, int begin, int end) {
+    if (t->defaults)
+        _fill_pattern(cold + (size_t)t->cold_size * begin, t->defaults + t->cold_offset, t->cold_size, end - begin);
+    else
+        memset(cold + (size_t)t->cold_size * begin, 0, (size_t)t->cold_size * (end - begin));
+}
+
+/* new elements from element begin to end */
+static void _init_elements(CooAlloc *a, char *mem, int size, int begin, int end) {
+    if (a->is_ptr == false && a->type->defaults)
+        _fill_pattern(mem + (size_t)size * begin, a->type->defaults, size, end - begin);
+    else
+        memset(mem + (size_t)size * begin, 0, (size_t)size * (end - begin)); /* zero all new allocated memory */
 }
 
 void *coo_alloc(CooAlloc *a, int count) {
     if (count <= 0)
         return 0;
+    if (a->is_soa)
+        return _alloc_soa(a, count);
     int size = a->is_ptr ? sizeof(void *) : a->type->size;
-    CooTag *tag = _malloc_with_tag(size, count, 0, a->first);
+    CooTag *tag = _malloc_with_tag(a->allocator, a, size, count, 0, a->first);
     if (a->first)
         a->first->prev = tag;
     a->first = tag;
     void *data = _tag_to_data(tag);
-    memset(data, 0, size * count); /* zero all new allocated memory */
+    _init_elements(a, data, size, 0, count);
+    if (a->is_ptr == false && a->type->cold_size) {
+        _alloc_cold(tag, (size_t)a->type->cold_size * count);
+        _init_cold(a->type, tag->cold, 0, count);
+    }
     return data;
 }
 
+static int _grown_count(int capacity, int count) { /* amortized, appending one element at a time copies each element O(1) times */
+    return _max(count, capacity + capacity / 2);
+}
+
+static int _resize_in_place(CooAllocator *allocator, void *ptr, size_t size, size_t new_size) {
+    return allocator->resize && allocator->resize(allocator, ptr, size, new_size);
+}
+
+static void _realloc_cold(CooType *t, CooTag *tag, int count) {
+    size_t *header = _cold_header(tag), bytes = *header - COO_COLD_HEADER_SIZE;
+    if ((size_t)t->cold_size * count > bytes) {
+        size_t new_bytes = (size_t)t->cold_size * _grown_count((int)(bytes / t->cold_size), count);
+        if (_resize_in_place(tag->allocator, header, *header, COO_COLD_HEADER_SIZE + new_bytes))
+            *header = COO_COLD_HEADER_SIZE + new_bytes;
+        else {
+            char *cold = tag->cold;
+            _alloc_cold(tag, new_bytes);
+            memcpy(tag->cold, cold, (size_t)t->cold_size * tag->count);
+            tag->allocator->free(tag->allocator, header, *header);
+        }
+    }
+    if (count > tag->count)
+        _init_cold(t, tag->cold, tag->count, count);
+}
+
+static void _realloc_soa(CooAlloc *a, CooTag *tag, int count) {
+    CooType *t = a->type;
+    CooColumn *columns = _tag_to_data(tag);
+    for (int i = 0; i < t->vars_count; ++i) {
+        CooColumn *c = columns + i;
+        size_t bytes = (size_t)_variable_size(t->vars + i) * t->vars[i].count;
+        if (bytes * count > c->bytes) {
+            size_t new_bytes = bytes * _grown_count((int)(c->bytes / bytes), count);
+            if (_resize_in_place(c->allocator, c->mem, c->bytes, new_bytes))
+                c->bytes = new_bytes;
+            else {
+                CooColumn n_column;
+                _alloc_column(&n_column, a->allocator, new_bytes);
+                memcpy(n_column.mem, c->mem, bytes * tag->count);
+                c->allocator->free(c->allocator, c->mem, c->bytes);
+                *c = n_column;
+            }
+        }
+        if (count > tag->count)
+            _init_column(t, i, c->mem, tag->count, count);
+    }
+    tag->count = count;
+}
+
+/* batch that can't grow in place moves, and old batch is kept as a stub that redirects to new one
+   until next update redirects pointers in coo state to it */
+static CooTag *_move_tag(CooAlloc *a, CooTag *tag, int size, int capacity) {
+    CooTag *n_tag = _malloc_with_tag(a->allocator, a, size, capacity, tag->prev, tag->next);
+    n_tag->count = tag->count;
+    memcpy(_tag_to_data(n_tag), _tag_to_data(tag), (size_t)size * tag->count);
+    if (tag->cold) { /* stub keeps its copy, like its data */
+        _alloc_cold(n_tag, (size_t)a->type->cold_size * capacity);
+        memcpy(n_tag->cold, tag->cold, (size_t)a->type->cold_size * tag->count);
+    }
+    _replace_with_stub(a, tag, n_tag, &a->moved);
+    ++a->type->moved_batches_count;
+    return n_tag;
+}
+
+void *coo_realloc(CooAlloc *a, void *data, int count) {
+    if (data == 0)
+        return coo_alloc(a, count);
+    if (count <= 0) {
+        coo_free(a, data);
+        return 0;
+    }
+    CooTag *tag = _data_to_tag(_update_pointer(a->forwards, data)); /* stale data is migrated first */
+    if (a->is_soa) {
+        _realloc_soa(a, tag, count);
+        return _tag_to_data(tag);
+    }
+    int size = a->is_ptr ? sizeof(void *) : a->type->size;
+    int capacity = size ? (int)(_data_bytes(tag) / size) : count;
+    if (count > capacity) {
+        int n_capacity = _grown_count(capacity, count);
+        size_t bytes = tag->padding + sizeof(CooTag) + (size_t)size * n_capacity;
+        if (_resize_in_place(tag->allocator, (char *)tag - tag->padding, tag->bytes, bytes))
+            tag->bytes = bytes;
+        else
+            tag = _move_tag(a, tag, size, n_capacity);
+    }
+    if (a->is_ptr == false && a->type->cold_size)
+        _realloc_cold(a->type, tag, count);
+    if (count > tag->count)
+        _init_elements(a, _tag_to_data(tag), size, tag->count, count);
+    tag->count = count;
+    return _tag_to_data(tag);
+}
+
 void coo_free(CooAlloc *a, void *data) {
     if (data == 0)
         return;
     CooTag *tag = _data_to_tag(data);
+    if (_is_stale(tag))
+        --a->stale_count;
     if (tag->prev)
         tag->prev->next = tag->next;
     else
         a->first = tag->next;
     if (tag->next)
         tag->next->prev = tag->prev;
-    free(tag);
+    _free_tag(tag);
+}
+
+void *coo_get_column(CooAlloc *a, void *batch, const char *v_name) {
+    assert(a->is_soa);
+    v_name = _find_name(a->type->names, v_name);
+    for (int i = 0; i < a->type->vars_count; ++i)
+        if (a->type->vars[i].name == v_name)
+            return ((CooColumn *)batch)[i].mem;
+    assert(false); /* variable not found */
+    return 0;
+}
+
+void coo_set_alloc_allocator(CooAlloc *a, CooAllocator *allocator) {
+    a->allocator = allocator ? allocator : &CooMallocAllocator;
 }
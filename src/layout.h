@@ -1,17 +1,15 @@
 #ifndef coo_type_h
 #define coo_type_h
 
-#define COO_MAX_NAME    256
-#define COO_MAX_VARS    64
-#define COO_MAX_DIFFS   64
-#define COO_MAX_CASTS   16
+#include "allocator.h"
+#include "map.h"
+#include "coo.h"
 
 
-typedef void (*COO_CAST_FUNC)(void *src, void *dst);
-
-typedef struct CooCast {
+typedef struct CooCast { /* allocated one by one, diffs, instructions and versions point to it */
     struct CooType *to_type;
-    COO_CAST_FUNC func;
+    COO_CAST_FUNC func; /* replaced when cast is registered again */
+    struct CooCast *next;
 } CooCast;
 
 typedef enum {
@@ -27,56 +25,236 @@ typedef struct CooDiff {
     int src_offset, dst_offset;
     int src_stride, dst_stride;
     int is_ptr;
+    int has_default; /* new values are filled from default instance instead of zeroed */
     int count;
 } CooDiff;
 
+typedef enum {
+    CIT_COPY, /* copy bytes */
+    CIT_NULL, /* zero bytes */
+    CIT_CAST, /* cast runs of values */
+    CIT_DEFAULT, /* copy bytes from default instance at dst_offset */
+} CooInstrType;
+
+typedef struct CooInstr { /* flattened and coalesced diff, offsets relative to instance start */
+    CooInstrType instr_type;
+    CooCast *cast; /* cast only */
+    int src_offset, dst_offset;
+    int src_stride, dst_stride; /* cast only */
+    int size; /* in bytes, copy, null and default only */
+    int count; /* cast only */
+} CooInstr;
+
+typedef struct CooPtrRun { /* consecutive pointers within an instance */
+    int offset;
+    int count;
+} CooPtrRun;
+
+typedef struct CooVarDiff { /* migration of a single variable, soa allocs migrate it as a column */
+    int old_index; /* -1 for new variable */
+    int offset, old_offset;
+    int bytes, old_bytes; /* whole variable, including array elements */
+    int diffs_begin, diffs_count;
+    int is_kept; /* old values are kept as they are, soa allocs reuse old column */
+    int is_cold, was_cold; /* offsets are in cold part of instance */
+} CooVarDiff;
+
+typedef struct CooVersion { /* lazy update only, migrates instances to the next version of a type */
+    CooInstr *instrs;
+    int instrs_count;
+    int is_identity;
+    int old_size, size;
+    char *defaults; /* default instance of the version, 0 if it has no defaults */
+} CooVersion;
+
 typedef struct CooVar {
-    char name[COO_MAX_NAME];
+    const char *name; /* interned */
     struct CooType *type;
     int count; /* int var[count]; */
     int is_ptr;
     int offset; /* derived, in bytes */
     int old_index;
+    int has_default; /* primitive variables only, default_value is used instead of 0 */
+    unsigned char default_value[8];
+    int is_cold; /* stored in side buffer of batch, offset is past cold_offset */
+    int points_to_moved; /* derived, values contain pointers to data that moves in current update */
 } CooVar;
 
 typedef struct CooType {
-    char name[COO_MAX_NAME];
-    CooVar vars[COO_MAX_VARS];
-    int vars_count;
-    CooVar new_vars[COO_MAX_VARS];
-    int new_vars_count;
-    CooCast casts[COO_MAX_CASTS];
-    int casts_count;
-    CooDiff diffs[COO_MAX_DIFFS];
-    int diffs_count;
-    int size, old_size;
-    int alignment;
+    const char *name; /* interned */
+    CooNames *names; /* for interning variable names, 0 for primitive types */
+    CooVar *vars;
+    int vars_count, vars_capacity;
+    CooVar *new_vars;
+    int new_vars_count, new_vars_capacity;
+    CooCast *casts; /* list */
+    CooDiff *diffs;
+    int diffs_count, diffs_capacity;
+    CooVarDiff *var_diffs; /* derived, for each variable, valid while type is affected */
+    int var_diffs_capacity;
+    CooInstr *instrs; /* derived from diffs, nested types flattened */
+    int instrs_count, instrs_capacity;
+    CooInstr *in_place_instrs; /* derived, instrs ordered so they don't overwrite data they read later */
+    int has_in_place_order; /* derived, in_place_instrs are valid */
+    int is_identity; /* derived, instrs copy whole instances unchanged */
+    int copied_bytes, zeroed_bytes, defaulted_bytes, cast_bytes, cast_values; /* derived, per migrated instance */
+    char *defaults; /* derived, default instance, 0 if all defaults are 0 */
+    int size, old_size; /* of hot part if type has cold variables */
+    int alignment, old_alignment;
+    int packing; /* variables are aligned to at most this, 0 for natural alignment */
+    int min_alignment; /* instances are aligned to at least this, 0 for natural alignment */
+    int cold_size, old_cold_size; /* derived, of cold part, 0 if type has no cold variables */
+    int cold_offset, old_cold_offset; /* derived, cold variable offsets are past it, defaults hold both parts */
     int update_id;
     int is_fixed;
+    int is_optimized; /* variables are laid out by descending alignment instead of declaration order */
+    int is_modified; /* variables changed since last update */
+    int is_affected; /* derived, data of instances changes in current update */
+    int is_in_place; /* derived, affected data is migrated within existing batches */
+    int is_moved; /* derived, affected data is migrated into new batches */
+    int points_to_moved; /* derived, instances contain pointers to data that moves in current update */
+    int moved_batches_count; /* moved by coo_realloc, pointers to them are redirected by next update that is not lazy */
+    int is_relocated; /* derived, data of type or data containing it by value moves or changes layout in current
+                         update, so pointers to it are redirected */
+    CooPtrRun *ptr_runs; /* derived, flattened offsets of pointers to data that moves in current update,
+                            offsets of all pointers to struct types in lazy update */
+    int ptr_runs_count, ptr_runs_capacity;
+    int ptrs_count; /* derived, pointers in ptr_runs */
+    int pointers_update_id;
+    int order_update_id; /* bounded update only */
+    int pending_holders; /* bounded update only, allocs that can still point to old data */
+    int is_migrated; /* bounded update only */
+    int version; /* lazy update only, bumped when instances have to be migrated or redirected */
+    CooVersion *versions; /* lazy update only, versions[i] migrates from version versions_base + i */
+    int versions_base, versions_count, versions_capacity;
+    int index; /* in state */
 } CooType;
 
-void _init_type(CooType *t, const char *name, int size);
+void _init_type(CooType *t, CooNames *names, const char *name, int size);
+void _add_cast(CooType *t, CooType *to_type, COO_CAST_FUNC func);
+void _deinit_type(CooType *t);
 void _update_type_layout(CooType *t, int update_id);
+typedef enum {
+    CPK_MOVED, /* pointers to data that moves in current update */
+    CPK_LAZY, /* pointers to struct types, lazily migrated data moves whenever it is first accessed */
+    CPK_ALL, /* all pointers, pointers to primitive types included */
+} CooPtrRunsKind;
+
+/* call after all type layouts are updated, is_data_relocated is true if any data of state moves */
+void _update_type_pointers(CooType *t, int update_id, CooPtrRunsKind kind, int is_data_relocated);
+void _relocate_type(CooType *t); /* marks type and types it contains by value as relocated */
+int _is_relocated(CooType *t, int is_data_relocated); /* pointers to type are redirected */
+int _has_cold_vars(CooType *t); /* in current or new layout */
+void _push_version(CooType *t); /* lazy update only, call after type layout is updated */
+void _clear_versions(CooType *t); /* lazy update only, call when no data of older versions is left */
 
 typedef struct CooTag {
     struct CooTag *prev, *next;
-    union {
-        int count; /* elements in the allocated batch */
-        struct CooTag *redirect; /* only used between update begin and end */
-    };
+    struct CooTag *redirect; /* new version of the batch, 0 if batch didn't move */
+    CooAllocator *allocator; /* that allocated the batch */
+    struct CooAlloc *alloc; /* that owns the batch */
+    int version; /* of type layout the batch was written with, older than type version if not migrated yet */
+    int is_dirty; /* async update only, written to while being migrated */
+    size_t bytes; /* allocated, including tag */
+    int count; /* elements in the allocated batch */
+    int columns_count; /* soa batches only, data is an array of columns */
+    int padding; /* bytes before tag in allocated block, over-aligned types only */
+    char *cold; /* side buffer of cold variables, 0 if type has none, its size is stored before it */
 } CooTag;
 
+typedef struct CooColumn { /* values of a single variable in a soa batch */
+    char *mem;
+    size_t bytes;
+    CooAllocator *allocator; /* 0 if column was taken over by new version of the batch */
+} CooColumn;
+
 typedef struct CooAlloc {
     CooType *type;
     CooTag *first;
     CooTag *old_first; /* only used between update begin and end */
     int is_ptr;
+    int is_soa; /* each variable is stored in its own column */
+    CooAllocator *allocator; /* for batches allocated with coo_alloc */
+    CooAllocator *update_allocator; /* for new versions of batches created during update */
+    CooUpdateStats stats; /* of last update, times are not used */
+    int stale_count; /* lazy update only, batches that are not migrated yet */
+    CooTag *stubs; /* lazy update only, old batches of migrated data that redirect to new ones */
+    CooTag *moved; /* old batches of data moved by coo_realloc that redirect to new ones */
+    int points_to_moved; /* derived, pointer alloc only, its pointers point to data that moves in current update */
+    struct CooForwards *forwards; /* of state, pointers in data are resolved through it while it is active */
+    int index; /* in state */
 } CooAlloc;
 
-void _init_alloc(CooAlloc *a, CooType *type, int is_ptr);
+typedef enum {
+    CJT_MIGRATE, /* migrate elements into new batch */
+    CJT_MIGRATE_IN_PLACE, /* migrate elements within old batch, dst_mem <= src_mem */
+    CJT_REDIRECT, /* only redirect pointers in elements, dst_mem is unused */
+    CJT_REDIRECT_PTRS, /* only redirect pointers in an array of pointers, dst_mem is unused */
+    CJT_MIGRATE_COLUMN, /* migrate elements of a soa column into new column, src_mem is 0 for new variable */
+    CJT_REDIRECT_COLUMN, /* only redirect pointers in a soa column, dst_mem is unused */
+} CooJobType;
+
+typedef struct CooJob { /* migration of a range of elements in a batch */
+    CooJobType job_type;
+    CooType *type;
+    char *src_mem, *dst_mem;
+    int count;
+    int redirect_pointers; /* redirect pointers in migrated elements right away */
+    struct CooForwards *forwards; /* of state that owns migrated data */
+    int var_index; /* column jobs only */
+    int src_stride, dst_stride; /* column jobs only, bytes between elements */
+} CooJob;
+
+typedef struct CooJobs {
+    CooJob *jobs;
+    int jobs_count, jobs_capacity;
+} CooJobs;
+
+void _init_alloc(CooAlloc *a, CooType *type, int is_ptr, int is_soa,
+                 CooAllocator *allocator, CooAllocator *update_allocator, struct CooForwards *forwards);
+void _add_update_stats(CooUpdateStats *to, const CooUpdateStats *stats);
+void _free_tag(CooTag *tag);
 void _clear_alloc(CooAlloc *a);
-void _update_alloc_data_layout(CooAlloc *a);
-void _update_alloc_pointers(CooAlloc *a);
+void _update_alloc_data_layout(CooAlloc *a, CooJobs *jobs); /* allocates new batches and queues their migration and redirection */
+CooTag *_update_tag_data_layout(CooAlloc *a, CooTag *o_tag, CooJobs *jobs, int redirect_pointers);
+void _run_migration_job(void *jobs, int index);
+void _redirect_alloc_data(CooAlloc *a); /* redirect pointers in current batches without moving them */
+void _remigrate_dirty_data(CooAlloc *a); /* async update only, migrates again batches written to during migration */
+void _link_new_versions_of_data(CooAlloc *a);
 void _free_old_versions_of_data(CooAlloc *a);
+void _free_moved_batches(CooAlloc *a); /* call once pointers to them are redirected */
+int _is_migration_job(CooJob *j); /* migrates elements as opposed to only redirecting pointers */
+
+CooTag *_touch_tag(CooTag *tag); /* migrates batch and batches reachable through its pointers, returns current version */
+void _touch_alloc(CooAlloc *a);
+void _free_stubs(CooAlloc *a);
+
+typedef struct CooForward { /* data range of an old batch */
+    char *begin, *end;
+    CooTag *tag; /* new version of the batch, 0 until it is created, old batch itself if migrated in place */
+    CooType *type; /* offsets inside elements are mapped to its new layout, 0 if offsets don't change */
+    int column; /* old column of a soa batch, -1 for whole batches */
+} CooForward;
+
+/* address range index of old batches of a state, sorted by address, pointers anywhere inside old
+   data are redirected through it during update that is not lazy, also once old batches are freed */
+typedef struct CooForwards {
+    CooForward *forwards;
+    int forwards_count, forwards_capacity;
+    int *starts; /* hash of batch starts, index of forward + 1 or 0, pointers mostly point at batch start */
+    int starts_capacity, starts_shift; /* power of 2, 64 - log2 of capacity */
+    int is_active;
+    struct CooForwards *next_active; /* list of all active forwards for host pointers, under shared lock */
+} CooForwards;
+
+void *_update_pointer(CooForwards *f, void *ptr); /* pointer in data of the state that owns f */
+void _update_pointers(CooForwards *f, void **ptrs, size_t count);
+
+void _add_moved_forwards(CooForwards *f, CooAlloc *a); /* batches moved by coo_realloc only */
+void _add_alloc_forwards(CooForwards *f, CooAlloc *a); /* call after new versions of batches are allocated */
+void _set_forward(CooForwards *f, CooTag *old_tag); /* bounded update only, new version of batch is created */
+void _sort_forwards(CooForwards *f); /* call after forwards are added, also hashes them */
+void _activate_forwards(CooForwards *f);
+void _deactivate_forwards(CooForwards *f); /* also clears forwards */
 
 #endif
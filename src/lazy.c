@@ -0,0 +1,57 @@
+#include "lazy.h"
+#include "state.h"
+#include "layout.h"
+#include <stdbool.h>
+
+
+static int _type_stale_count(CooState *s, CooType *t) {
+    CooAlloc *a = _find_alloc(s, t, false);
+    CooAlloc *p = _find_alloc(s, t, true);
+    return (a ? a->stale_count : 0) + (p ? p->stale_count : 0);
+}
+
+static int _tags_count(CooAlloc *a) {
+    int count = 0;
+    for (CooTag *tag = a->first; tag; tag = tag->next)
+        ++count;
+    return count;
+}
+
+/* stubs are only needed while data that is not migrated yet can point to them */
+static void _free_unreachable_stubs(CooState *s) {
+    for (int i = 0; i < s->allocs_count; ++i) {
+        CooAlloc *a = s->allocs[i];
+        if (a->stale_count && (a->is_ptr || a->type->ptr_runs_count))
+            return;
+    }
+    for (int i = 0; i < s->allocs_count; ++i)
+        _free_stubs(s->allocs[i]);
+}
+
+void _begin_lazy_update(CooState *s) {
+    _free_unreachable_stubs(s);
+    for (int i = 0; i < s->types_count; ++i) {
+        CooType *t = s->types[i];
+        if (t->is_affected == false && t->points_to_moved == false)
+            continue;
+        if (_type_stale_count(s, t) == 0) /* drop versions no data was written with */
+            _clear_versions(t);
+        _push_version(t);
+    }
+    for (int i = 0; i < s->allocs_count; ++i) { /* all batches of bumped types are stale now */
+        CooAlloc *a = s->allocs[i];
+        if (a->type->is_affected || a->type->points_to_moved) {
+            int count = _tags_count(a);
+            a->stale_count = count;
+        }
+    }
+}
+
+void _finish_lazy_updates(CooState *s) {
+    for (int i = 0; i < s->allocs_count; ++i)
+        _touch_alloc(s->allocs[i]);
+    for (int i = 0; i < s->allocs_count; ++i)
+        _free_stubs(s->allocs[i]);
+    for (int i = 0; i < s->types_count; ++i)
+        _clear_versions(s->types[i]);
+}
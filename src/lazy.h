@@ -0,0 +1,15 @@
+#ifndef coo_lazy_h
+#define coo_lazy_h
+
+
+struct CooState;
+
+/* lazy update only bumps versions of affected types and migrates data when it is first accessed,
+   called after type layouts are updated */
+void _begin_lazy_update(struct CooState *s);
+
+/* migrates all data written with older versions and frees old batches of migrated data,
+   called before type layouts of an update that is not lazy are updated */
+void _finish_lazy_updates(struct CooState *s);
+
+#endif
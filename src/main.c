@@ -1,7 +1,12 @@
 #include "test.h"
+#include "bench.h"
+#include <string.h>
 
 
-int main() {
-    coo_test_alloc();
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        coo_bench(argc - 2, argv + 2);
+    else
+        coo_test_alloc();
     return 0;
 }
@@ -0,0 +1,124 @@
+#include "map.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#define COO_MAP_REMOVED ((void *)&_removed_value) /* marks removed values so probing continues past them */
+
+
+static char _removed_value;
+
+void _init_map(CooMap *m) {
+    m->slots = 0;
+    m->capacity = 0;
+    m->count = 0;
+    m->used_count = 0;
+}
+
+void _deinit_map(CooMap *m) {
+    free(m->slots);
+    _init_map(m);
+}
+
+static void _resize_map(CooMap *m, int capacity) {
+    CooMapSlot *slots = m->slots;
+    int old_capacity = m->capacity;
+    m->slots = calloc(capacity, sizeof(CooMapSlot));
+    m->capacity = capacity;
+    m->count = 0;
+    m->used_count = 0;
+    for (int i = 0; i < old_capacity; ++i)
+        if (slots[i].value && slots[i].value != COO_MAP_REMOVED)
+            _map_insert(m, slots[i].hash, slots[i].value);
+    free(slots);
+}
+
+void *_map_find(CooMap *m, uint64_t hash, const void *key, COO_MAP_EQUAL_FUNC equal) {
+    if (m->count == 0)
+        return 0;
+    int mask = m->capacity - 1;
+    for (int i = (int)(hash & mask);; i = (i + 1) & mask) {
+        CooMapSlot *slot = m->slots + i;
+        if (slot->value == 0)
+            return 0;
+        if (slot->value != COO_MAP_REMOVED && slot->hash == hash && equal(key, slot->value))
+            return slot->value;
+    }
+}
+
+void _map_insert(CooMap *m, uint64_t hash, void *value) {
+    assert(value != 0);
+    if ((m->used_count + 1) * 4 > m->capacity * 3) /* keep load under 3/4, grow or just drop removed values */
+        _resize_map(m, m->capacity == 0 ? 16 : m->count * 2 >= m->capacity ? m->capacity * 2 : m->capacity);
+    int mask = m->capacity - 1;
+    int i = (int)(hash & mask);
+    while (m->slots[i].value && m->slots[i].value != COO_MAP_REMOVED)
+        i = (i + 1) & mask;
+    if (m->slots[i].value == 0)
+        ++m->used_count;
+    m->slots[i].hash = hash;
+    m->slots[i].value = value;
+    ++m->count;
+}
+
+void _map_remove(CooMap *m, uint64_t hash, void *value) {
+    if (m->count == 0)
+        return;
+    int mask = m->capacity - 1;
+    for (int i = (int)(hash & mask); m->slots[i].value; i = (i + 1) & mask)
+        if (m->slots[i].value == value) {
+            m->slots[i].value = COO_MAP_REMOVED;
+            --m->count;
+            return;
+        }
+}
+
+void _init_names(CooNames *n) {
+    _init_map(&n->map);
+}
+
+void _deinit_names(CooNames *n) {
+    for (int i = 0; i < n->map.capacity; ++i)
+        if (n->map.slots[i].value && n->map.slots[i].value != COO_MAP_REMOVED)
+            free(n->map.slots[i].value);
+    _deinit_map(&n->map);
+}
+
+static int _name_equal(const void *key, void *value) {
+    return strcmp(key, value) == 0;
+}
+
+const char *_find_name(CooNames *n, const char *name) {
+    return _map_find(&n->map, _hash_string(name), name, _name_equal);
+}
+
+const char *_intern_name(CooNames *n, const char *name) {
+    uint64_t hash = _hash_string(name);
+    char *interned = _map_find(&n->map, hash, name, _name_equal);
+    if (interned == 0) {
+        size_t size = strlen(name) + 1;
+        interned = malloc(size);
+        memcpy(interned, name, size);
+        _map_insert(&n->map, hash, interned);
+    }
+    return interned;
+}
+
+uint64_t _hash_string(const char *s) { /* FNV-1a */
+    uint64_t h = 14695981039346656037ull;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+uint64_t _hash_pointer(const void *p, int salt) {
+    uint64_t h = (uint64_t)(uintptr_t)p ^ ((uint64_t)salt << 60); /* salt goes into unused high bits */
+    h ^= h >> 33; /* murmur3 finalizer */
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
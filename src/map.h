@@ -0,0 +1,38 @@
+#ifndef coo_map_h
+#define coo_map_h
+
+#include <stdint.h>
+
+
+typedef int (*COO_MAP_EQUAL_FUNC)(const void *key, void *value);
+
+typedef struct CooMapSlot {
+    uint64_t hash;
+    void *value; /* 0 if slot is empty */
+} CooMapSlot;
+
+typedef struct CooMap { /* open addressing hash map of values that contain their own keys */
+    CooMapSlot *slots;
+    int capacity; /* power of 2 */
+    int count, used_count; /* values, values and removed values */
+} CooMap;
+
+void _init_map(CooMap *m);
+void _deinit_map(CooMap *m);
+void *_map_find(CooMap *m, uint64_t hash, const void *key, COO_MAP_EQUAL_FUNC equal);
+void _map_insert(CooMap *m, uint64_t hash, void *value);
+void _map_remove(CooMap *m, uint64_t hash, void *value);
+
+typedef struct CooNames { /* interned names, equal names have equal pointers */
+    CooMap map;
+} CooNames;
+
+void _init_names(CooNames *n);
+void _deinit_names(CooNames *n);
+const char *_intern_name(CooNames *n, const char *name);
+const char *_find_name(CooNames *n, const char *name); /* 0 if name is not interned */
+
+uint64_t _hash_string(const char *s);
+uint64_t _hash_pointer(const void *p, int salt);
+
+#endif
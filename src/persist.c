@@ -0,0 +1,798 @@
+#include "state.h"
+#include "layout.h"
+#include "lazy.h"
+#include "coo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define COO_FILE_MAGIC      "COOSTATE"
+#define COO_FILE_VERSION    2
+#define COO_FILE_ALIGNMENT  16 /* of batch data in file, keeps mapped batches aligned */
+#define COO_NO_OFFSET       UINT64_MAX /* pointer outside of saved batches */
+
+/* file layout:
+   header
+   types: name, size, alignment, packing, min alignment, vars count, vars (name, type name, count, is ptr, offset)
+   allocs: type name, is ptr, batches count, batches (offset in file, count)
+   batches: room for tag followed by data aligned to file alignment or type alignment if larger,
+            pointers stored as offsets of pointed data in file */
+
+
+typedef struct CooFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t ptr_size;
+    uint32_t tag_size;
+    uint32_t types_count;
+    uint32_t allocs_count;
+    uint32_t padding;
+} CooFileHeader;
+
+static size_t _round_up_offset(size_t value, size_t base) {
+    return (value + base - 1) / base * base;
+}
+
+/* mapped file, batches loaded from it are freed by unmapping the file once all of them are freed */
+
+typedef struct CooMappedAllocator {
+    CooAllocator base;
+    char *mem;
+    size_t size;
+    size_t live_count;
+} CooMappedAllocator;
+
+static void _unmap_file(char *mem, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(mem);
+#else
+    munmap(mem, size);
+#endif
+}
+
+static char *_map_file(const char *path, size_t *size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+    LARGE_INTEGER file_size;
+    char *mem = 0;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, 0, PAGE_WRITECOPY, 0, 0, 0);
+        if (mapping) {
+            mem = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = (size_t)file_size.QuadPart;
+    }
+    CloseHandle(file);
+    return mem;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    char *mem = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        mem = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); /* copy on write */
+        if (mem == MAP_FAILED)
+            mem = 0;
+        *size = st.st_size;
+    }
+    close(fd);
+    return mem;
+#endif
+}
+
+static void *_mapped_alloc(CooAllocator *allocator, size_t size) {
+    (void)allocator;
+    (void)size;
+    assert(false); /* only frees batches loaded from file */
+    return 0;
+}
+
+static void _mapped_destroy(CooAllocator *allocator) {
+    CooMappedAllocator *m = (CooMappedAllocator *)allocator;
+    _unmap_file(m->mem, m->size);
+    free(m);
+}
+
+static void _mapped_free(CooAllocator *allocator, void *ptr, size_t size) {
+    (void)ptr;
+    (void)size;
+    CooMappedAllocator *m = (CooMappedAllocator *)allocator;
+    assert(m->live_count > 0);
+    if (--m->live_count == 0)
+        _mapped_destroy(allocator);
+}
+
+/* saving */
+
+typedef struct CooWriter {
+    FILE *file; /* 0 if only counting bytes */
+    size_t offset;
+} CooWriter;
+
+static void _write(CooWriter *w, const void *data, size_t size) {
+    if (w->file)
+        fwrite(data, 1, size, w->file);
+    w->offset += size;
+}
+
+static void _write_u32(CooWriter *w, uint32_t value) {
+    _write(w, &value, sizeof(value));
+}
+
+static void _write_u64(CooWriter *w, uint64_t value) {
+    _write(w, &value, sizeof(value));
+}
+
+static void _write_string(CooWriter *w, const char *s) {
+    uint32_t size = (uint32_t)strlen(s) + 1;
+    _write_u32(w, size);
+    _write(w, s, size);
+}
+
+static void _write_zeros(CooWriter *w, size_t size) {
+    static const char zeros[COO_FILE_ALIGNMENT] = { 0 };
+    for (; size > COO_FILE_ALIGNMENT; size -= COO_FILE_ALIGNMENT)
+        _write(w, zeros, COO_FILE_ALIGNMENT);
+    _write(w, zeros, size);
+}
+
+static void _write_padding(CooWriter *w, size_t alignment) {
+    _write_zeros(w, _round_up_offset(w->offset, alignment) - w->offset);
+}
+
+static size_t _data_alignment(int alignment, int is_ptr) {
+    return is_ptr || alignment < COO_FILE_ALIGNMENT ? COO_FILE_ALIGNMENT : (size_t)alignment;
+}
+
+static uint64_t _tag_offset(uint64_t offset, CooAlloc *a) { /* first offset after given one where batch can start */
+    return _round_up_offset(offset + sizeof(CooTag), _data_alignment(a->type->alignment, a->is_ptr)) - sizeof(CooTag);
+}
+
+typedef struct CooSavedTag { /* data range of a batch and its data offset in file */
+    char *begin, *end;
+    uint64_t offset;
+} CooSavedTag;
+
+static int _compare_saved_tags(const void *a, const void *b) {
+    char *a_begin = ((CooSavedTag *)a)->begin;
+    char *b_begin = ((CooSavedTag *)b)->begin;
+    return (a_begin > b_begin) - (a_begin < b_begin);
+}
+
+static uint64_t _pointer_offset(CooSavedTag *tags, int tags_count, char *ptr) {
+    if (ptr == 0)
+        return 0;
+    int begin = 0, end = tags_count;
+    while (begin < end) {
+        int middle = (begin + end) / 2;
+        CooSavedTag *t = tags + middle;
+        if (ptr < t->begin)
+            end = middle;
+        else if (ptr >= t->end && ptr != t->begin)
+            begin = middle + 1;
+        else
+            return t->offset + (ptr - t->begin);
+    }
+    return COO_NO_OFFSET;
+}
+
+/* false if a pointer doesn't point into coo state */
+static int _write_pointers(CooState *s, char *mem, int count, CooSavedTag *tags, int tags_count) {
+    for (int i = 0; i < count; ++i) {
+        char *ptr;
+        memcpy(&ptr, mem, sizeof(ptr));
+        uint64_t offset = _pointer_offset(tags, tags_count, _update_pointer(&s->forwards, ptr));
+        if (offset == COO_NO_OFFSET)
+            return false;
+        memcpy(mem, &offset, sizeof(void *));
+        mem += sizeof(void *);
+    }
+    return true;
+}
+
+static void _write_meta(CooWriter *w, CooState *s, uint64_t data_offset) {
+    CooFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COO_FILE_MAGIC, sizeof(header.magic));
+    header.version = COO_FILE_VERSION;
+    header.ptr_size = sizeof(void *);
+    header.tag_size = sizeof(CooTag);
+    header.types_count = s->types_count;
+    header.allocs_count = s->allocs_count;
+    _write(w, &header, sizeof(header));
+    for (int i = 0; i < s->types_count; ++i) {
+        CooType *t = s->types[i];
+        _write_string(w, t->name);
+        _write_u32(w, t->size);
+        _write_u32(w, t->alignment);
+        _write_u32(w, t->packing);
+        _write_u32(w, t->min_alignment);
+        _write_u32(w, t->vars_count);
+        for (int j = 0; j < t->vars_count; ++j) {
+            CooVar *v = t->vars + j;
+            _write_string(w, v->name);
+            _write_string(w, v->type->name);
+            _write_u32(w, v->count);
+            _write_u32(w, v->is_ptr);
+            _write_u32(w, v->offset);
+        }
+    }
+    uint64_t offset = data_offset;
+    for (int i = 0; i < s->allocs_count; ++i) {
+        CooAlloc *a = s->allocs[i];
+        int size = a->is_ptr ? sizeof(void *) : a->type->size;
+        uint32_t tags_count = 0;
+        for (CooTag *tag = a->first; tag; tag = tag->next)
+            ++tags_count;
+        _write_string(w, a->type->name);
+        _write_u32(w, a->is_ptr);
+        _write_u32(w, tags_count);
+        for (CooTag *tag = a->first; tag; tag = tag->next) {
+            offset = _tag_offset(offset, a);
+            _write_u64(w, offset);
+            _write_u32(w, tag->count);
+            offset += sizeof(CooTag) + (size_t)size * tag->count;
+        }
+    }
+}
+
+/* without file only checks that all pointers can be saved */
+static int _write_batches(CooWriter *w, CooState *s, CooSavedTag *tags, int tags_count) {
+    CooTag empty_tag;
+    memset(&empty_tag, 0, sizeof(empty_tag));
+    char *buffer = 0;
+    size_t buffer_size = 0;
+    int is_saved = true;
+    for (int i = 0; i < s->allocs_count && is_saved; ++i) {
+        CooAlloc *a = s->allocs[i];
+        CooType *t = a->type;
+        size_t size = a->is_ptr ? sizeof(void *) : t->size;
+        for (CooTag *tag = a->first; tag && is_saved; tag = tag->next) {
+            char *data = (char *)(tag + 1);
+            size_t bytes = size * tag->count;
+            _write_zeros(w, _tag_offset(w->offset, a) - w->offset);
+            _write(w, &empty_tag, sizeof(empty_tag));
+            if (a->is_ptr || t->ptr_runs_count) { /* pointers are written as offsets into file */
+                if (buffer_size < bytes) {
+                    buffer_size = bytes;
+                    buffer = realloc(buffer, buffer_size);
+                }
+                memcpy(buffer, data, bytes);
+                if (a->is_ptr)
+                    is_saved = _write_pointers(s, buffer, tag->count, tags, tags_count);
+                else
+                    for (int j = 0; j < tag->count && is_saved; ++j)
+                        for (int k = 0; k < t->ptr_runs_count && is_saved; ++k)
+                            is_saved = _write_pointers(s, buffer + size * j + t->ptr_runs[k].offset,
+                                                       t->ptr_runs[k].count, tags, tags_count);
+                data = buffer;
+            }
+            _write(w, data, bytes);
+        }
+    }
+    free(buffer);
+    return is_saved;
+}
+
+int coo_save_state(CooState *s, const char *path) {
+    assert(s->is_async == false);
+    for (int i = 0; i < s->allocs_count; ++i)
+        if (s->allocs[i]->is_soa) /* columns are separate allocations, file only holds contiguous batches */
+            return false;
+    for (int i = 0; i < s->types_count; ++i)
+        if (_has_cold_vars(s->types[i])) /* same for side buffers, and cold offsets overlap hot ones */
+            return false;
+    _finish_lazy_updates(s); /* all data is saved with current layouts */
+
+    ++s->update_id; /* offsets of all pointers */
+    for (int i = 0; i < s->types_count; ++i)
+        _update_type_pointers(s->types[i], s->update_id, CPK_ALL, false);
+    for (int i = 0; i < s->allocs_count; ++i) /* pointers into batches moved by coo_realloc are saved as moved */
+        _add_moved_forwards(&s->forwards, s->allocs[i]);
+    _sort_forwards(&s->forwards);
+    _activate_forwards(&s->forwards);
+
+    CooWriter counter = { 0, 0 };
+    _write_meta(&counter, s, 0);
+    uint64_t data_offset = _round_up_offset(counter.offset, COO_FILE_ALIGNMENT);
+
+    CooSavedTag *tags = 0;
+    int tags_count = 0, tags_capacity = 0;
+    uint64_t offset = data_offset;
+    for (int i = 0; i < s->allocs_count; ++i) {
+        CooAlloc *a = s->allocs[i];
+        int size = a->is_ptr ? sizeof(void *) : a->type->size;
+        for (CooTag *tag = a->first; tag; tag = tag->next) {
+            if (tags_count == tags_capacity) {
+                tags_capacity = tags_capacity ? tags_capacity * 2 : 64;
+                tags = realloc(tags, sizeof(CooSavedTag) * tags_capacity);
+            }
+            CooSavedTag *t = tags + tags_count++;
+            t->begin = (char *)(tag + 1);
+            t->end = t->begin + (size_t)size * tag->count;
+            t->offset = _tag_offset(offset, a) + sizeof(CooTag);
+            offset = t->offset + (size_t)size * tag->count;
+        }
+    }
+    if (tags_count)
+        qsort(tags, tags_count, sizeof(CooSavedTag), _compare_saved_tags);
+
+    CooWriter checker = { 0, data_offset };
+    int is_saved = _write_batches(&checker, s, tags, tags_count); /* pointers to host memory can't be saved */
+    FILE *file = is_saved ? fopen(path, "wb") : 0;
+    if (file) {
+        CooWriter writer = { file, 0 };
+        _write_meta(&writer, s, data_offset);
+        _write_padding(&writer, COO_FILE_ALIGNMENT);
+        _write_batches(&writer, s, tags, tags_count);
+        int is_written = ferror(file) == 0;
+        is_saved = fclose(file) == 0 && is_written;
+    }
+    else
+        is_saved = false;
+    free(tags);
+    _deactivate_forwards(&s->forwards);
+    return is_saved;
+}
+
+/* loading */
+
+typedef struct CooReader {
+    char *mem, *end;
+    int is_valid;
+} CooReader;
+
+static void *_read(CooReader *r, size_t size) {
+    if (r->is_valid == false || (size_t)(r->end - r->mem) < size) {
+        r->is_valid = false;
+        return 0;
+    }
+    void *data = r->mem;
+    r->mem += size;
+    return data;
+}
+
+static uint32_t _read_u32(CooReader *r) {
+    uint32_t value = 0;
+    void *data = _read(r, sizeof(value));
+    if (data)
+        memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint64_t _read_u64(CooReader *r) {
+    uint64_t value = 0;
+    void *data = _read(r, sizeof(value));
+    if (data)
+        memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static const char *_read_string(CooReader *r) {
+    uint32_t size = _read_u32(r);
+    const char *s = _read(r, size);
+    if (s == 0 || size == 0 || s[size - 1] != 0) {
+        r->is_valid = false;
+        return 0;
+    }
+    return s;
+}
+
+static CooType *_find_primitive(const char *name) {
+    CooType *primitives[] = { &CooI8, &CooI16, &CooI32, &CooI64, &CooF32, &CooF64 };
+    for (int i = 0; i < (int)(sizeof(primitives) / sizeof(primitives[0])); ++i)
+        if (strcmp(primitives[i]->name, name) == 0)
+            return primitives[i];
+    return 0;
+}
+
+static CooType *_loaded_type(CooState *s, const char *name, CooType ***created, int *created_count) {
+    CooType *t = _find_primitive(name);
+    if (t)
+        return t;
+    t = _find_type(s, name);
+    if (t)
+        return t;
+    t = coo_create_type(s, name); /* type only exists on disk, its layout is kept */
+    *created = realloc(*created, sizeof(CooType *) * (*created_count + 1));
+    (*created)[(*created_count)++] = t;
+    return t;
+}
+
+typedef struct CooVarRecord {
+    const char *name, *type_name;
+    int count, is_ptr, offset;
+} CooVarRecord;
+
+typedef struct CooTypeRecord { /* type as stored in file, applied to types in state once whole file is valid */
+    const char *name;
+    int size, alignment, vars_count;
+    int packing, min_alignment; /* only used by types missing in running code, others are set by code */
+    CooVarRecord *vars;
+    CooPtrRun *ptr_runs; /* flattened offsets of pointers in layout on disk */
+    int ptr_runs_count, ptr_runs_capacity;
+    int ptr_runs_state; /* 1 while runs are collected, 2 once they are done */
+} CooTypeRecord;
+
+static CooTypeRecord *_find_record(CooTypeRecord *records, int count, const char *name) {
+    for (int i = 0; i < count; ++i)
+        if (strcmp(records[i].name, name) == 0)
+            return records + i;
+    return 0;
+}
+
+/* variables have to fit into their types, types of variables are primitive or stored in file */
+static int _is_valid_record(CooTypeRecord *records, int count, CooTypeRecord *record) {
+    if (_find_primitive(record->name) || _find_record(records, (int)(record - records), record->name) ||
+        record->alignment <= 0 || (record->alignment & (record->alignment - 1)) || record->size < 0 ||
+        record->packing < 0 || (record->packing & (record->packing - 1)) ||
+        record->min_alignment < 0 || (record->min_alignment & (record->min_alignment - 1)))
+        return false;
+    for (int i = 0; i < record->vars_count; ++i) {
+        CooVarRecord *v = record->vars + i;
+        CooType *primitive = _find_primitive(v->type_name);
+        CooTypeRecord *v_record = _find_record(records, count, v->type_name);
+        if (primitive == 0 && v_record == 0)
+            return false;
+        uint64_t size = v->is_ptr ? sizeof(void *) : primitive ? (uint64_t)primitive->size : (uint64_t)v_record->size;
+        if (v->count <= 0 || v->offset < 0 || (uint64_t)v->offset + size * v->count > (uint64_t)record->size)
+            return false;
+    }
+    return true;
+}
+
+static void _push_record_run(CooTypeRecord *record, int offset, int count) {
+    if (record->ptr_runs_count) { /* try to extend previous run */
+        CooPtrRun *last = record->ptr_runs + record->ptr_runs_count - 1;
+        if (last->offset + last->count * (int)sizeof(void *) == offset) {
+            last->count += count;
+            return;
+        }
+    }
+    if (record->ptr_runs_count == record->ptr_runs_capacity) {
+        record->ptr_runs_capacity = record->ptr_runs_capacity ? record->ptr_runs_capacity * 2 : 4;
+        record->ptr_runs = realloc(record->ptr_runs, sizeof(CooPtrRun) * record->ptr_runs_capacity);
+    }
+    CooPtrRun *r = record->ptr_runs + record->ptr_runs_count++;
+    r->offset = offset;
+    r->count = count;
+}
+
+/* all pointers in layout on disk are stored as offsets, false if type contains itself */
+static int _collect_record_runs(CooTypeRecord *records, int count, CooTypeRecord *record) {
+    if (record->ptr_runs_state)
+        return record->ptr_runs_state == 2;
+    record->ptr_runs_state = 1;
+    for (int i = 0; i < record->vars_count; ++i) {
+        CooVarRecord *v = record->vars + i;
+        CooTypeRecord *v_record = _find_record(records, count, v->type_name);
+        if (v->is_ptr)
+            _push_record_run(record, v->offset, v->count);
+        else if (v_record) { /* flatten nested struct pointers */
+            if (_collect_record_runs(records, count, v_record) == false)
+                return false;
+            for (int j = 0; j < v->count; ++j)
+                for (int k = 0; k < v_record->ptr_runs_count; ++k) {
+                    CooPtrRun *r = v_record->ptr_runs + k;
+                    _push_record_run(record, v->offset + j * v_record->size + r->offset, r->count);
+                }
+        }
+    }
+    record->ptr_runs_state = 2;
+    return true;
+}
+
+static void _free_records(CooTypeRecord *records, int count) {
+    for (int i = 0; i < count; ++i) {
+        free(records[i].vars);
+        free(records[i].ptr_runs);
+    }
+    free(records);
+}
+
+/* type table is read without changing state */
+static int _read_records(CooReader *r, int types_count, CooTypeRecord **records, int *records_count) {
+    int capacity = 0;
+    for (int i = 0; i < types_count && r->is_valid; ++i) {
+        if (*records_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            *records = realloc(*records, sizeof(CooTypeRecord) * capacity);
+        }
+        CooTypeRecord *record = *records + (*records_count)++;
+        memset(record, 0, sizeof(CooTypeRecord));
+        record->name = _read_string(r);
+        record->size = _read_u32(r);
+        record->alignment = _read_u32(r);
+        record->packing = _read_u32(r);
+        record->min_alignment = _read_u32(r);
+        int vars_count = _read_u32(r);
+        if (vars_count < 0 || (size_t)vars_count > (size_t)(r->end - r->mem)) /* each var takes some bytes */
+            r->is_valid = false;
+        for (int j = 0; j < vars_count && r->is_valid; ++j) {
+            if (j == 0)
+                record->vars = malloc(sizeof(CooVarRecord) * vars_count);
+            CooVarRecord *v = record->vars + record->vars_count++;
+            v->name = _read_string(r);
+            v->type_name = _read_string(r);
+            v->count = _read_u32(r);
+            v->is_ptr = _read_u32(r);
+            v->offset = _read_u32(r);
+        }
+    }
+    for (int i = 0; i < *records_count && r->is_valid; ++i)
+        r->is_valid = _is_valid_record(*records, *records_count, *records + i);
+    for (int i = 0; i < *records_count && r->is_valid; ++i)
+        r->is_valid = _collect_record_runs(*records, *records_count, *records + i);
+    return r->is_valid;
+}
+
+/* types on disk become old layouts of types in state, update then migrates loaded data to layouts
+   defined by running code */
+static void _apply_records(CooState *s, CooTypeRecord *records, int records_count) {
+    CooType **created = 0, **loaded = malloc(sizeof(CooType *) * (records_count + 1));
+    int created_count = 0;
+    for (int i = 0; i < records_count; ++i) {
+        CooTypeRecord *record = records + i;
+        CooType *t = loaded[i] = _loaded_type(s, record->name, &created, &created_count);
+        t->vars = realloc(t->vars, sizeof(CooVar) * (record->vars_count + 1));
+        t->vars_capacity = record->vars_count + 1;
+        t->vars_count = record->vars_count;
+        for (int j = 0; j < record->vars_count; ++j) {
+            CooVarRecord *v_record = record->vars + j;
+            CooVar *v = t->vars + j;
+            v->name = _intern_name(&s->names, v_record->name);
+            v->type = _loaded_type(s, v_record->type_name, &created, &created_count);
+            v->count = v_record->count;
+            v->is_ptr = v_record->is_ptr;
+            v->offset = v_record->offset;
+            v->old_index = j;
+            v->has_default = false; /* defaults only matter for new variables, which come from code */
+            v->is_cold = false;
+            v->points_to_moved = false;
+        }
+        t->size = record->size;
+        t->alignment = record->alignment;
+        t->is_modified = true;
+    }
+    for (int i = 0; i < created_count; ++i) { /* types missing in running code keep their layout */
+        CooType *t = created[i];
+        CooTypeRecord *record = _find_record(records, records_count, t->name);
+        t->packing = record->packing;
+        t->min_alignment = record->min_alignment;
+        t->new_vars = realloc(t->new_vars, sizeof(CooVar) * (t->vars_count + 1));
+        t->new_vars_capacity = t->vars_count + 1;
+        memcpy(t->new_vars, t->vars, sizeof(CooVar) * t->vars_count);
+        t->new_vars_count = t->vars_count;
+    }
+    for (int i = 0; i < records_count; ++i) { /* variables are matched by name */
+        CooType *t = loaded[i];
+        for (int j = 0; j < t->new_vars_count; ++j) {
+            CooVar *v = t->new_vars + j;
+            v->old_index = -1;
+            for (int k = 0; k < t->vars_count; ++k)
+                if (t->vars[k].name == v->name)
+                    v->old_index = k;
+        }
+    }
+    free(created);
+    free(loaded);
+}
+
+typedef struct CooAllocRecord { /* alloc as stored in file, created once whole file is valid */
+    const char *type_name;
+    int is_ptr;
+    CooTypeRecord *record; /* layout of elements on disk, 0 for primitive types and pointers */
+} CooAllocRecord;
+
+typedef struct CooBatchRecord { /* batch as stored in file, its tag is written once whole file is valid */
+    int alloc; /* index of alloc record */
+    char *begin, *end; /* tag and data */
+    int count;
+} CooBatchRecord;
+
+static int _compare_batch_records(const void *a, const void *b) {
+    char *a_begin = ((CooBatchRecord *)a)->begin;
+    char *b_begin = ((CooBatchRecord *)b)->begin;
+    return (a_begin > b_begin) - (a_begin < b_begin);
+}
+
+/* offsets in file are mapped to loaded batches sorted by address, false if one points outside of them */
+static int _read_pointers(char *mem, int count, char *base, CooBatchRecord *sorted, int sorted_count) {
+    for (int i = 0; i < count; ++i) {
+        uint64_t offset;
+        memcpy(&offset, mem, sizeof(offset));
+        char *ptr = 0;
+        if (offset) {
+            if (offset > (uint64_t)(sorted[sorted_count - 1].end - base))
+                return false;
+            ptr = base + offset;
+            int begin = 0, end = sorted_count;
+            while (begin < end) {
+                int middle = (begin + end) / 2;
+                CooBatchRecord *b = sorted + middle;
+                char *data = b->begin + sizeof(CooTag);
+                if (ptr < data)
+                    end = middle;
+                else if (ptr >= b->end && ptr != data)
+                    begin = middle + 1;
+                else
+                    break;
+            }
+            if (begin == end)
+                return false;
+        }
+        memcpy(mem, &ptr, sizeof(ptr));
+        mem += sizeof(void *);
+    }
+    return true;
+}
+
+static int _read_batch_pointers(CooBatchRecord *b, CooAllocRecord *a, char *base, CooBatchRecord *sorted,
+                                int sorted_count) {
+    char *data = b->begin + sizeof(CooTag);
+    if (a->is_ptr)
+        return _read_pointers(data, b->count, base, sorted, sorted_count);
+    for (int k = 0; k < b->count && a->record; ++k)
+        for (int l = 0; l < a->record->ptr_runs_count; ++l)
+            if (_read_pointers(data + (size_t)a->record->size * k + a->record->ptr_runs[l].offset,
+                               a->record->ptr_runs[l].count, base, sorted, sorted_count) == false)
+                return false;
+    return true;
+}
+
+/* alloc table is checked against mapped file, pointers are translated in mapped memory, state isn't changed */
+static int _read_allocs(CooReader *r, int allocs_count, char *mem, size_t size, CooTypeRecord *records,
+                        int records_count, CooAllocRecord **allocs, CooBatchRecord **batches, int *batches_count) {
+    int batches_capacity = 0;
+    for (int i = 0; i < allocs_count && r->is_valid; ++i) {
+        *allocs = realloc(*allocs, sizeof(CooAllocRecord) * (i + 1));
+        CooAllocRecord *a = *allocs + i;
+        a->type_name = _read_string(r);
+        a->is_ptr = _read_u32(r);
+        int tags_count = _read_u32(r);
+        if (r->is_valid == false)
+            break;
+        CooType *primitive = _find_primitive(a->type_name);
+        a->record = primitive ? 0 : _find_record(records, records_count, a->type_name);
+        for (int j = 0; j < i && r->is_valid; ++j) /* each alloc is stored once */
+            if ((*allocs)[j].is_ptr == a->is_ptr && strcmp((*allocs)[j].type_name, a->type_name) == 0)
+                r->is_valid = false;
+        if (primitive == 0 && a->record == 0)
+            r->is_valid = false;
+        if (r->is_valid == false)
+            break;
+        size_t element_size = a->is_ptr ? sizeof(void *) : primitive ? (size_t)primitive->size : (size_t)a->record->size;
+        size_t alignment = _data_alignment(primitive ? primitive->alignment : a->record->alignment, a->is_ptr);
+        for (int j = 0; j < tags_count && r->is_valid; ++j) {
+            uint64_t offset = _read_u64(r);
+            int count = _read_u32(r);
+            if (r->is_valid == false || (offset + sizeof(CooTag)) % alignment || count < 0 || offset > size ||
+                size - offset < sizeof(CooTag) ||
+                (element_size && (size - offset - sizeof(CooTag)) / element_size < (size_t)count)) {
+                r->is_valid = false;
+                break;
+            }
+            if (*batches_count == batches_capacity) {
+                batches_capacity = batches_capacity ? batches_capacity * 2 : 64;
+                *batches = realloc(*batches, sizeof(CooBatchRecord) * batches_capacity);
+            }
+            CooBatchRecord *b = *batches + (*batches_count)++;
+            b->alloc = i;
+            b->begin = mem + offset;
+            b->end = b->begin + sizeof(CooTag) + element_size * count;
+            b->count = count;
+        }
+    }
+    CooBatchRecord *sorted = malloc(sizeof(CooBatchRecord) * (*batches_count + 1));
+    if (*batches_count)
+        memcpy(sorted, *batches, sizeof(CooBatchRecord) * *batches_count);
+    qsort(sorted, *batches_count, sizeof(CooBatchRecord), _compare_batch_records);
+    for (int i = 1; i < *batches_count && r->is_valid; ++i)
+        if (sorted[i].begin < sorted[i - 1].end) /* tags are written into file memory */
+            r->is_valid = false;
+    for (int i = 0; i < *batches_count && r->is_valid; ++i) {
+        CooBatchRecord *b = *batches + i;
+        r->is_valid = _read_batch_pointers(b, *allocs + b->alloc, mem, sorted, *batches_count);
+    }
+    free(sorted);
+    return r->is_valid;
+}
+
+int coo_load_state(CooState *s, const char *path) {
+    assert(s->is_async == false);
+    for (int i = 0; i < s->allocs_count; ++i)
+        assert(s->allocs[i]->first == 0); /* loaded data replaces all data */
+    size_t size = 0;
+    char *mem = _map_file(path, &size);
+    if (mem == 0)
+        return false;
+    CooReader r = { mem, mem + size, true };
+    CooFileHeader *header = _read(&r, sizeof(CooFileHeader));
+    if (header == 0 || memcmp(header->magic, COO_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != COO_FILE_VERSION || header->ptr_size != sizeof(void *) ||
+        header->tag_size != sizeof(CooTag)) {
+        _unmap_file(mem, size);
+        return false;
+    }
+
+    /* whole file is validated before state is changed */
+    CooTypeRecord *records = 0;
+    int records_count = 0;
+    CooAllocRecord *allocs = 0;
+    CooBatchRecord *batches = 0;
+    int batches_count = 0;
+    if (_read_records(&r, header->types_count, &records, &records_count) == false ||
+        _read_allocs(&r, header->allocs_count, mem, size, records, records_count, &allocs, &batches,
+                     &batches_count) == false) {
+        _free_records(records, records_count);
+        free(allocs);
+        free(batches);
+        _unmap_file(mem, size);
+        return false;
+    }
+
+    _apply_records(s, records, records_count);
+    CooMappedAllocator *m = malloc(sizeof(CooMappedAllocator));
+    m->base.alloc = _mapped_alloc;
+    m->base.free = _mapped_free;
+    m->base.resize = 0;
+    m->base.destroy = _mapped_destroy;
+    m->mem = mem;
+    m->size = size;
+    m->live_count = 1; /* released after loading */
+    CooTag *last = 0;
+    for (int i = 0; i < batches_count; ++i) {
+        CooBatchRecord *b = batches + i;
+        CooAllocRecord *a_record = allocs + b->alloc;
+        CooType *type = _find_primitive(a_record->type_name);
+        if (type == 0)
+            type = _find_type(s, a_record->type_name);
+        CooAlloc *a = a_record->is_ptr ? coo_get_ptr_alloc(s, type) : coo_get_alloc(s, type);
+        CooTag *tag = (CooTag *)b->begin;
+        if (i == 0 || batches[i - 1].alloc != b->alloc)
+            last = 0;
+        tag->prev = last;
+        tag->next = 0;
+        tag->redirect = 0;
+        tag->allocator = &m->base;
+        tag->alloc = a;
+        tag->version = a->type->version;
+        tag->is_dirty = false;
+        tag->bytes = b->end - b->begin;
+        tag->count = b->count;
+        tag->columns_count = 0;
+        tag->padding = 0;
+        tag->cold = 0;
+        if (last)
+            last->next = tag;
+        else
+            a->first = tag;
+        last = tag;
+        ++m->live_count;
+    }
+    _free_records(records, records_count);
+    free(allocs);
+    free(batches);
+    _mapped_free(&m->base, 0, 0);
+
+    coo_begin_update(s); /* migrate loaded data to current layouts */
+    coo_end_update(s);
+    return true;
+}
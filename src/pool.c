@@ -0,0 +1,207 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE CooThread;
+typedef CRITICAL_SECTION CooMutex;
+typedef CONDITION_VARIABLE CooCond;
+
+static void _mutex_init(CooMutex *m) { InitializeCriticalSection(m); }
+static void _mutex_destroy(CooMutex *m) { DeleteCriticalSection(m); }
+static void _mutex_lock(CooMutex *m) { EnterCriticalSection(m); }
+static void _mutex_unlock(CooMutex *m) { LeaveCriticalSection(m); }
+static void _cond_init(CooCond *c) { InitializeConditionVariable(c); }
+static void _cond_destroy(CooCond *c) { (void)c; }
+static void _cond_wait(CooCond *c, CooMutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static void _cond_broadcast(CooCond *c) { WakeAllConditionVariable(c); }
+
+static SRWLOCK _shared_lock = SRWLOCK_INIT;
+void _lock_shared() { AcquireSRWLockExclusive(&_shared_lock); }
+void _unlock_shared() { ReleaseSRWLockExclusive(&_shared_lock); }
+#else
+#include <pthread.h>
+
+typedef pthread_t CooThread;
+typedef pthread_mutex_t CooMutex;
+typedef pthread_cond_t CooCond;
+
+static void _mutex_init(CooMutex *m) { pthread_mutex_init(m, 0); }
+static void _mutex_destroy(CooMutex *m) { pthread_mutex_destroy(m); }
+static void _mutex_lock(CooMutex *m) { pthread_mutex_lock(m); }
+static void _mutex_unlock(CooMutex *m) { pthread_mutex_unlock(m); }
+static void _cond_init(CooCond *c) { pthread_cond_init(c, 0); }
+static void _cond_destroy(CooCond *c) { pthread_cond_destroy(c); }
+static void _cond_wait(CooCond *c, CooMutex *m) { pthread_cond_wait(c, m); }
+static void _cond_broadcast(CooCond *c) { pthread_cond_broadcast(c); }
+
+static pthread_mutex_t _shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+void _lock_shared() { pthread_mutex_lock(&_shared_mutex); }
+void _unlock_shared() { pthread_mutex_unlock(&_shared_mutex); }
+#endif
+
+#define COO_BATCHES_PER_THREAD 8
+
+
+struct CooPool {
+    CooThread *threads;
+    int threads_count; /* workers, not counting calling thread */
+    CooMutex mutex;
+    CooCond work_cond; /* new jobs or stopping */
+    CooCond done_cond; /* all jobs done */
+    int generation; /* incremented for each run */
+    int stopping;
+    int busy_count; /* workers currently running jobs */
+    COO_JOB_FUNC func;
+    void *jobs;
+    int jobs_count, next_job, batch;
+};
+
+/* called with mutex locked, takes batches of jobs until there are none left */
+static void _work(CooPool *p) {
+    while (p->next_job < p->jobs_count) {
+        int begin = p->next_job;
+        int end = begin + p->batch;
+        if (end > p->jobs_count)
+            end = p->jobs_count;
+        p->next_job = end;
+        COO_JOB_FUNC func = p->func;
+        void *jobs = p->jobs;
+        _mutex_unlock(&p->mutex);
+        for (int i = begin; i < end; ++i)
+            func(jobs, i);
+        _mutex_lock(&p->mutex);
+    }
+}
+
+static void _worker_loop(CooPool *p) {
+    int generation = 0;
+    _mutex_lock(&p->mutex);
+    while (true) {
+        while (p->stopping == false && p->generation == generation)
+            _cond_wait(&p->work_cond, &p->mutex);
+        if (p->stopping)
+            break;
+        generation = p->generation;
+        ++p->busy_count;
+        _work(p);
+        if (--p->busy_count == 0)
+            _cond_broadcast(&p->done_cond);
+    }
+    _mutex_unlock(&p->mutex);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI _worker_main(LPVOID p) {
+    _worker_loop(p);
+    return 0;
+}
+#else
+static void *_worker_main(void *p) {
+    _worker_loop(p);
+    return 0;
+}
+#endif
+
+CooPool *_create_pool(int threads_count) {
+    if (threads_count <= 1)
+        return 0;
+    CooPool *p = malloc(sizeof(CooPool));
+    p->threads_count = threads_count - 1;
+    p->threads = malloc(sizeof(CooThread) * p->threads_count);
+    _mutex_init(&p->mutex);
+    _cond_init(&p->work_cond);
+    _cond_init(&p->done_cond);
+    p->generation = 0;
+    p->stopping = false;
+    p->busy_count = 0;
+    p->jobs_count = 0;
+    p->next_job = 0;
+    for (int i = 0; i < p->threads_count; ++i) {
+#ifdef _WIN32
+        p->threads[i] = CreateThread(0, 0, _worker_main, p, 0, 0);
+        assert(p->threads[i] != 0);
+#else
+        int result = pthread_create(p->threads + i, 0, _worker_main, p);
+        assert(result == 0);
+        (void)result;
+#endif
+    }
+    return p;
+}
+
+void _destroy_pool(CooPool *p) {
+    if (p == 0)
+        return;
+    _mutex_lock(&p->mutex);
+    p->stopping = true;
+    _cond_broadcast(&p->work_cond);
+    _mutex_unlock(&p->mutex);
+    for (int i = 0; i < p->threads_count; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(p->threads[i], INFINITE);
+        CloseHandle(p->threads[i]);
+#else
+        pthread_join(p->threads[i], 0);
+#endif
+    }
+    _cond_destroy(&p->done_cond);
+    _cond_destroy(&p->work_cond);
+    _mutex_destroy(&p->mutex);
+    free(p->threads);
+    free(p);
+}
+
+/* called with mutex locked */
+static void _post_jobs(CooPool *p, COO_JOB_FUNC func, void *jobs, int jobs_count) {
+    p->func = func;
+    p->jobs = jobs;
+    p->jobs_count = jobs_count;
+    p->next_job = 0;
+    p->batch = jobs_count / ((p->threads_count + 1) * COO_BATCHES_PER_THREAD);
+    if (p->batch < 1)
+        p->batch = 1;
+    ++p->generation;
+    _cond_broadcast(&p->work_cond);
+}
+
+/* called with mutex locked */
+static void _wait_jobs(CooPool *p) {
+    _work(p);
+    while (p->busy_count)
+        _cond_wait(&p->done_cond, &p->mutex);
+}
+
+void _run_jobs(CooPool *p, COO_JOB_FUNC func, void *jobs, int jobs_count) {
+    if (p == 0 || jobs_count <= 1) {
+        for (int i = 0; i < jobs_count; ++i)
+            func(jobs, i);
+        return;
+    }
+    _mutex_lock(&p->mutex);
+    _post_jobs(p, func, jobs, jobs_count);
+    _wait_jobs(p);
+    _mutex_unlock(&p->mutex);
+}
+
+void _start_jobs(CooPool *p, COO_JOB_FUNC func, void *jobs, int jobs_count) {
+    _mutex_lock(&p->mutex);
+    _post_jobs(p, func, jobs, jobs_count);
+    _mutex_unlock(&p->mutex);
+}
+
+int _are_jobs_done(CooPool *p) {
+    _mutex_lock(&p->mutex);
+    int is_done = p->next_job >= p->jobs_count && p->busy_count == 0;
+    _mutex_unlock(&p->mutex);
+    return is_done;
+}
+
+void _finish_jobs(CooPool *p) {
+    _mutex_lock(&p->mutex);
+    _wait_jobs(p);
+    _mutex_unlock(&p->mutex);
+}
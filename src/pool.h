@@ -0,0 +1,26 @@
+#ifndef coo_pool_h
+#define coo_pool_h
+
+
+typedef void (*COO_JOB_FUNC)(void *jobs, int index);
+
+typedef struct CooPool CooPool;
+
+/* worker pool, calling thread participates in running jobs so pool has threads_count - 1 workers */
+CooPool *_create_pool(int threads_count);
+void _destroy_pool(CooPool *p);
+
+/* runs func for each job index and returns when all jobs are done, runs serially if pool is 0 */
+void _run_jobs(CooPool *p, COO_JOB_FUNC func, void *jobs, int jobs_count);
+
+/* runs jobs on workers only and returns right away, pool can't be 0, jobs have to be finished
+   before any other jobs are run */
+void _start_jobs(CooPool *p, COO_JOB_FUNC func, void *jobs, int jobs_count);
+int _are_jobs_done(CooPool *p);
+void _finish_jobs(CooPool *p); /* calling thread helps with remaining jobs and returns when all are done */
+
+/* process-wide lock for the little that is shared by all states */
+void _lock_shared();
+void _unlock_shared();
+
+#endif
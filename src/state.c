@@ -1,65 +1,76 @@
 #include "state.h"
+#include "coo.h"
 #include "layout.h"
+#include "pool.h"
+#include "bounded.h"
+#include "lazy.h"
+#include "cast.h"
+#include "map.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <time.h>
 
 
 int primitives_inited = 0;
 
 CooType CooI8, CooI16, CooI32, CooI64, CooF32, CooF64;
 
-static void _i8_to_i16(void *src, void *dst) { *(int16_t *)dst = *(int8_t *)src; }
-static void _i8_to_i32(void *src, void *dst) { *(int32_t *)dst = *(int8_t *)src; }
-static void _i8_to_i64(void *src, void *dst) { *(int64_t *)dst = *(int8_t *)src; }
-static void _i8_to_f32(void *src, void *dst) { *(float *)dst = *(int8_t *)src; }
-static void _i8_to_f64(void *src, void *dst) { *(double *)dst = *(int8_t *)src; }
-static void _i16_to_i32(void *src, void *dst) { *(int32_t *)dst = *(int16_t *)src; }
-static void _i16_to_i64(void *src, void *dst) { *(int64_t *)dst = *(int16_t *)src; }
-static void _i16_to_f32(void *src, void *dst) { *(float *)dst = *(int16_t *)src; }
-static void _i16_to_f64(void *src, void *dst) { *(double *)dst = *(int16_t *)src; }
-static void _i32_to_i64(void *src, void *dst) { *(int64_t *)dst = *(int32_t *)src; }
-static void _i32_to_f64(void *src, void *dst) { *(double *)dst = *(int32_t *)src; }
-static void _f32_to_f64(void *src, void *dst) { *(double *)dst = *(float *)src; }
-
-static void _add_cast(CooType *t, CooType *to_type, COO_CAST_FUNC func) {
-    assert(func != 0);
-    assert(t->casts_count < COO_MAX_CASTS);
-    CooCast *c = t->casts + t->casts_count++;
-    c->to_type = to_type;
-    c->func = func;
+static void _init_primitives() { /* casts can be registered before first state is created */
+    if (primitives_inited)
+        return;
+    _init_type(&CooI8, 0, "i8", sizeof(int8_t));
+    _init_type(&CooI16, 0, "i16", sizeof(int16_t));
+    _init_type(&CooI32, 0, "i32", sizeof(int32_t));
+    _init_type(&CooI64, 0, "i64", sizeof(int64_t));
+    _init_type(&CooF32, 0, "f32", sizeof(float));
+    _init_type(&CooF64, 0, "f64", sizeof(double));
+    _add_primitive_casts();
+    primitives_inited = 1;
 }
 
 CooState *coo_create_state() {
     CooState *s = malloc(sizeof(CooState));
+    s->allocs = 0;
     s->allocs_count = 0;
+    s->allocs_capacity = 0;
+    _init_map(&s->allocs_map);
+    s->types = 0;
     s->types_count = 0;
+    s->types_capacity = 0;
+    _init_map(&s->types_map);
+    _init_names(&s->names);
     s->update_id = 0;
-
-    if (primitives_inited == 0) {
-        _init_type(&CooI8, "i8", sizeof(int8_t));
-        _init_type(&CooI16, "i16", sizeof(int16_t));
-        _init_type(&CooI32, "i32", sizeof(int32_t));
-        _init_type(&CooI64, "i64", sizeof(int64_t));
-        _init_type(&CooF32, "f32", sizeof(float));
-        _init_type(&CooF64, "f64", sizeof(double));
-
-        _add_cast(&CooI8, &CooI16, _i8_to_i16);
-        _add_cast(&CooI8, &CooI32, _i8_to_i32);
-        _add_cast(&CooI8, &CooI64, _i8_to_i64);
-        _add_cast(&CooI8, &CooF32, _i8_to_f32);
-        _add_cast(&CooI8, &CooF64, _i8_to_f64);
-        _add_cast(&CooI16, &CooI32, _i16_to_i32);
-        _add_cast(&CooI16, &CooI64, _i16_to_i64);
-        _add_cast(&CooI16, &CooF32, _i16_to_f32);
-        _add_cast(&CooI16, &CooF64, _i16_to_f64);
-        _add_cast(&CooI32, &CooI64, _i32_to_i64);
-        _add_cast(&CooI32, &CooF64, _i32_to_f64);
-        _add_cast(&CooF32, &CooF64, _f32_to_f64);
-    }
-
+    s->is_relocated = false;
+    s->pool = 0;
+    s->threads_count = 1;
+    s->jobs.jobs = 0;
+    s->jobs.jobs_count = 0;
+    s->jobs.jobs_capacity = 0;
+    s->async_jobs_count = 0;
+    s->is_async = false;
+    s->is_lazy = false;
+    s->is_lazy_update = false;
+    s->update_budget = 0;
+    s->bounded = 0;
+    s->forwards.forwards = 0;
+    s->forwards.forwards_count = 0;
+    s->forwards.forwards_capacity = 0;
+    s->forwards.starts = 0;
+    s->forwards.starts_capacity = 0;
+    s->forwards.starts_shift = 64;
+    s->forwards.is_active = false;
+    s->allocator = &CooMallocAllocator;
+    s->update_allocator = 0;
+    memset(&s->stats, 0, sizeof(CooUpdateStats));
+    s->roots = 0;
+    s->roots_count = 0;
+    s->roots_capacity = 0;
+    s->stats_func = 0;
+    s->stats_context = 0;
+    _init_primitives();
     return s;
 }
 
@@ -69,115 +80,436 @@ static void _delete_alloc(CooAlloc *a) {
 }
 
 static void _delete_type(CooType *t) {
+    _deinit_type(t);
     free(t);
 }
 
 void coo_destroy_state(CooState *s) {
+    if (s->is_async) { /* workers can't migrate data that is about to be freed */
+        coo_finish_update(s);
+        coo_end_update(s);
+    }
     for (int i = 0; i < s->allocs_count; ++i)
         _delete_alloc(s->allocs[i]);
     s->allocs_count = 0;
     for (int i = 0; i < s->types_count; ++i)
         _delete_type(s->types[i]);
     s->types_count = 0;
+    free(s->allocs);
+    free(s->types);
+    _deinit_map(&s->allocs_map);
+    _deinit_map(&s->types_map);
+    _deinit_names(&s->names);
+    _destroy_pool(s->pool);
+    free(s->jobs.jobs);
+    free(s->forwards.forwards);
+    free(s->forwards.starts);
+    free(s->roots);
     free(s);
 }
 
-static int _find_type(CooState *s, const char *name) {
-    for (int i = 0; i < s->types_count; ++i)
-        if (strcmp(name, s->types[i]->name) == 0)
-            return i;
-    return -1;
+static int _type_has_name(const void *key, void *value) {
+    return strcmp(key, ((CooType *)value)->name) == 0;
+}
+
+CooType *_find_type(CooState *s, const char *name) {
+    return _map_find(&s->types_map, _hash_string(name), name, _type_has_name);
 }
 
 CooType *coo_create_type(CooState *s, const char *name) {
-    assert(_find_type(s, name) == -1);
-    assert(s->types_count < COO_MAX_TYPES);
+    assert(_find_type(s, name) == 0);
+    if (s->types_count == s->types_capacity) {
+        s->types_capacity = s->types_capacity ? s->types_capacity * 2 : 32;
+        s->types = realloc(s->types, sizeof(CooType *) * s->types_capacity);
+    }
     CooType *type = malloc(sizeof(CooType));
-    _init_type(type, name, 0);
+    _init_type(type, &s->names, name, 0);
+    type->index = s->types_count;
+    _map_insert(&s->types_map, _hash_string(type->name), type);
     return s->types[s->types_count++] = type;
 }
 
-static void _remove_allocs_of_type(CooState *s, CooType *type) {
-    int removed = 0;
-    for (int i = 0; i < s->allocs_count; ++i)
-        if (s->allocs[i]->type == type) {
-            _delete_alloc(s->allocs[i]);
-            ++removed;
-        }
-        else if (removed)
-            s->allocs[i - removed] = s->allocs[i];
-    s->allocs_count -= removed;
+typedef struct CooAllocKey {
+    CooType *type;
+    int is_ptr, is_soa;
+} CooAllocKey;
+
+static int _alloc_has_key(const void *key, void *value) {
+    const CooAllocKey *k = key;
+    CooAlloc *a = value;
+    return a->type == k->type && a->is_ptr == k->is_ptr && a->is_soa == k->is_soa;
+}
+
+static uint64_t _alloc_hash(CooType *type, int is_ptr, int is_soa) {
+    return _hash_pointer(type, is_ptr | is_soa << 1);
+}
+
+static CooAlloc *_find_alloc_of_kind(CooState *s, CooType *type, int is_ptr, int is_soa) {
+    CooAllocKey key = { type, is_ptr, is_soa };
+    return _map_find(&s->allocs_map, _alloc_hash(type, is_ptr, is_soa), &key, _alloc_has_key);
+}
+
+CooAlloc *_find_alloc(CooState *s, CooType *type, int is_ptr) {
+    return _find_alloc_of_kind(s, type, is_ptr, false);
+}
+
+static void _remove_alloc(CooState *s, CooType *type, int is_ptr, int is_soa) {
+    CooAlloc *alloc = _find_alloc_of_kind(s, type, is_ptr, is_soa);
+    if (alloc == 0)
+        return;
+    _map_remove(&s->allocs_map, _alloc_hash(type, is_ptr, is_soa), alloc);
+    CooAlloc *last = s->allocs[--s->allocs_count]; /* move last alloc into the gap */
+    s->allocs[alloc->index] = last;
+    last->index = alloc->index;
+    _delete_alloc(alloc);
 }
 
 void coo_remove_type(CooState *s, const char *name) {
-    int index = _find_type(s, name);
-    if (index == -1)
+    CooType *type = _find_type(s, name);
+    if (type == 0)
         return;
-    _delete_type(s->types[index]);
-    _remove_allocs_of_type(s, s->types[index]);
-    for (int i = index + 1; i < s->types_count; ++i)
-        s->types[i - 1] = s->types[i];
-    --s->types_count;
+    _remove_alloc(s, type, false, false);
+    _remove_alloc(s, type, true, false);
+    _remove_alloc(s, type, false, true);
+    _map_remove(&s->types_map, _hash_string(name), type);
+    CooType *last = s->types[--s->types_count]; /* move last type into the gap */
+    s->types[type->index] = last;
+    last->index = type->index;
+    _delete_type(type);
 }
 
-static int _index_of_alloc(CooState *s, CooType *type, int is_ptr) {
-    for (int i = 0; i < s->allocs_count; ++i)
-        if (s->allocs[i]->type == type && s->allocs[i]->is_ptr == is_ptr)
-            return i;
-    return -1;
-}
-
-static CooAlloc *_get_alloc(CooState *s, CooType *type, int is_ptr) {
-    int index = _index_of_alloc(s, type, is_ptr);
-    if (index != -1)
-        return s->allocs[index];
-    assert(s->allocs_count < COO_MAX_ALLOCS);
-    CooAlloc *alloc = malloc(sizeof(CooAlloc));
-    _init_alloc(alloc, type, is_ptr);
+static CooAlloc *_get_alloc(CooState *s, CooType *type, int is_ptr, int is_soa) {
+    CooAlloc *alloc = _find_alloc_of_kind(s, type, is_ptr, is_soa);
+    if (alloc)
+        return alloc;
+    if (s->allocs_count == s->allocs_capacity) {
+        s->allocs_capacity = s->allocs_capacity ? s->allocs_capacity * 2 : 32;
+        s->allocs = realloc(s->allocs, sizeof(CooAlloc *) * s->allocs_capacity);
+    }
+    alloc = malloc(sizeof(CooAlloc));
+    _init_alloc(alloc, type, is_ptr, is_soa, s->allocator, s->update_allocator ? s->update_allocator : s->allocator,
+                &s->forwards);
+    alloc->index = s->allocs_count;
+    _map_insert(&s->allocs_map, _alloc_hash(type, is_ptr, is_soa), alloc);
     return s->allocs[s->allocs_count++] = alloc;
 }
 
 CooAlloc *coo_get_alloc(CooState *s, CooType *type) {
-    return _get_alloc(s, type, false);
+    return _get_alloc(s, type, false, false);
 }
 
 CooAlloc *coo_get_ptr_alloc(CooState *s, CooType *type) {
-    return _get_alloc(s, type, true);
+    return _get_alloc(s, type, true, false);
 }
 
-static void _remove_alloc(CooState *s, CooType *type, int is_ptr) {
-    int index = _index_of_alloc(s, type, is_ptr);
-    if (index == -1)
-        return;
-    _delete_alloc(s->allocs[index]);
-    for (int i = index + 1; i < s->allocs_count; ++i)
-        s->allocs[i - 1] = s->allocs[i];
-    --s->allocs_count;
+CooAlloc *coo_get_soa_alloc(CooState *s, CooType *type) {
+    assert(type->is_fixed == false); /* struct types only */
+    return _get_alloc(s, type, false, true);
 }
 
 void coo_remove_alloc(CooState *s, CooType *type) {
-    _remove_alloc(s, type, false);
+    _remove_alloc(s, type, false, false);
 }
 
 void coo_remove_ptr_alloc(CooState *s, CooType *type) {
-    _remove_alloc(s, type, true);
+    _remove_alloc(s, type, true, false);
+}
+
+void coo_remove_soa_alloc(CooState *s, CooType *type) {
+    _remove_alloc(s, type, false, true);
+}
+
+void coo_set_allocator(CooState *s, CooAllocator *allocator) {
+    s->allocator = allocator ? allocator : &CooMallocAllocator;
+    for (int i = 0; i < s->allocs_count; ++i) {
+        s->allocs[i]->allocator = s->allocator;
+        if (s->update_allocator == 0)
+            s->allocs[i]->update_allocator = s->allocator;
+    }
+}
+
+void coo_set_update_allocator(CooState *s, CooAllocator *allocator) {
+    s->update_allocator = allocator;
+    for (int i = 0; i < s->allocs_count; ++i)
+        s->allocs[i]->update_allocator = allocator ? allocator : s->allocator;
 }
 
 void coo_clear_alloc(CooAlloc *a) {
     _clear_alloc(a);
 }
 
-void coo_begin_update(CooState *s) {
+void coo_set_threads_count(CooState *s, int threads_count) {
+    if (threads_count < 1)
+        threads_count = 1;
+    if (threads_count == s->threads_count)
+        return;
+    _destroy_pool(s->pool);
+    s->pool = _create_pool(threads_count);
+    s->threads_count = threads_count;
+}
+
+void coo_set_update_budget(CooState *s, size_t budget) {
+    s->update_budget = budget;
+}
+
+void coo_set_lazy_update(CooState *s, int is_lazy) {
+    s->is_lazy = is_lazy;
+}
+
+void coo_touch(CooAlloc *a) {
+    _touch_alloc(a);
+}
+
+void *coo_next_batch(CooAlloc *a, void *batch, int *count) {
+    CooTag *tag = batch ? ((CooTag *)batch - 1)->next : a->first;
+    if (tag == 0)
+        return 0;
+    tag = _touch_tag(tag);
+    if (count)
+        *count = tag->count;
+    return tag + 1;
+}
+
+static double _now() {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* data of relocated types is redirected in current update, primitive types are shared between
+   states, so they are relocated if any data of state is, since pointers to them can point into any struct */
+static void _update_relocations(CooState *s) {
+    s->is_relocated = false;
+    for (int i = 0; i < s->types_count; ++i)
+        s->types[i]->is_relocated = false;
+    for (int i = 0; i < s->types_count; ++i) {
+        CooType *t = s->types[i];
+        if (t->is_affected || t->moved_batches_count) {
+            _relocate_type(t);
+            s->is_relocated = true;
+        }
+    }
+    for (int i = 0; i < s->allocs_count; ++i)
+        s->is_relocated |= s->allocs[i]->moved != 0;
+    for (int i = 0; i < s->allocs_count; ++i) {
+        CooAlloc *a = s->allocs[i];
+        a->points_to_moved = a->is_ptr && _is_relocated(a->type, s->is_relocated);
+    }
+}
+
+static void _update_layouts(CooState *s, int is_lazy, int is_async) {
+    memset(&s->stats, 0, sizeof(CooUpdateStats));
+    for (int i = 0; i < s->allocs_count; ++i)
+        memset(&s->allocs[i]->stats, 0, sizeof(CooUpdateStats));
+    double begin = _now();
     ++s->update_id;
+    if (is_lazy == false) /* versions only describe migrations from current layouts */
+        _finish_lazy_updates(s);
+    for (int i = 0; i < s->types_count; ++i) {
+        CooType *t = s->types[i];
+        _update_type_layout(t, s->update_id);
+        if (is_async && t->is_in_place) { /* old data is still in use while it is migrated */
+            t->is_in_place = false;
+            t->is_moved = true;
+        }
+    }
+    for (int i = 0; i < s->allocs_count; ++i) {
+        CooType *t = s->allocs[i]->type;
+        if (s->allocs[i]->is_soa && t->is_in_place) { /* soa batches always move, so pointers to them are redirected */
+            t->is_in_place = false;
+            t->is_moved = true;
+        }
+    }
+    _update_relocations(s);
     for (int i = 0; i < s->types_count; ++i)
-        _update_type_layout(s->types[i], s->update_id);
+        _update_type_pointers(s->types[i], s->update_id, is_lazy ? CPK_LAZY : CPK_MOVED, s->is_relocated);
+    s->stats.layout_time = _now() - begin;
+}
+
+/* old batches are indexed by address, so pointers anywhere inside them are redirected */
+static void _forward_old_data(CooState *s) {
     for (int i = 0; i < s->allocs_count; ++i)
-        _update_alloc_data_layout(s->allocs[i]);
+        _add_alloc_forwards(&s->forwards, s->allocs[i]);
+    _sort_forwards(&s->forwards);
+    _activate_forwards(&s->forwards);
 }
 
-void coo_end_update(CooState *s) {
+/* moves jobs for which is_front returns true to start of jobs, returns their count */
+static int _partition_jobs(CooJobs *jobs, int (*is_front)(CooJob *j)) {
+    int count = 0;
+    for (int i = 0; i < jobs->jobs_count; ++i)
+        if (is_front(jobs->jobs + i)) {
+            CooJob job = jobs->jobs[count];
+            jobs->jobs[count++] = jobs->jobs[i];
+            jobs->jobs[i] = job;
+        }
+    return count;
+}
+
+static int _has_split_data(CooState *s) { /* soa batches or batches with cold side buffers */
+    for (int i = 0; i < s->allocs_count; ++i) {
+        CooAlloc *a = s->allocs[i];
+        if (a->is_soa || (a->is_ptr == false && _has_cold_vars(a->type)))
+            return true;
+    }
+    return false;
+}
+
+void coo_begin_update(CooState *s) {
+    assert(s->is_async == false);
+    assert((s->is_lazy == false && s->update_budget == 0) || _has_split_data(s) == false);
+    _update_layouts(s, s->is_lazy, false);
+    if (s->is_lazy) {
+        s->is_lazy_update = true;
+        _begin_lazy_update(s);
+        return;
+    }
+    double begin = _now();
+    if (s->update_budget) { /* migration and redirection are interleaved, all of it counts as migration */
+        _forward_old_data(s);
+        _begin_bounded_update(s);
+        s->stats.migration_time = _now() - begin;
+        return;
+    }
+    s->jobs.jobs_count = 0;
     for (int i = 0; i < s->allocs_count; ++i)
-        _update_alloc_pointers(s->allocs[i]);
+        _update_alloc_data_layout(s->allocs[i], &s->jobs);
+    _forward_old_data(s);
+    int count = _partition_jobs(&s->jobs, _is_migration_job);
+    _run_jobs(s->pool, _run_migration_job, s->jobs.jobs, count);
+    double migrated = _now();
+    s->stats.migration_time = migrated - begin;
+    _run_jobs(s->pool, _run_migration_job, s->jobs.jobs + count, s->jobs.jobs_count - count);
+    s->stats.redirection_time = _now() - migrated;
+}
+
+static int _is_async_job(CooJob *j) { /* other jobs modify old data */
+    return j->job_type == CJT_MIGRATE || j->job_type == CJT_MIGRATE_COLUMN;
+}
+
+void coo_begin_update_async(CooState *s) {
+    assert(s->is_async == false);
+    _update_layouts(s, false, true);
+    s->jobs.jobs_count = 0;
+    for (int i = 0; i < s->allocs_count; ++i)
+        _update_alloc_data_layout(s->allocs[i], &s->jobs);
+    _forward_old_data(s);
+    int count = _partition_jobs(&s->jobs, _is_async_job); /* background jobs run first */
+    s->async_jobs_count = count;
+    s->is_async = true;
+    if (s->pool)
+        _start_jobs(s->pool, _run_migration_job, s->jobs.jobs, count);
+}
+
+int coo_is_update_ready(CooState *s) {
+    return s->is_async == false || s->pool == 0 || _are_jobs_done(s->pool);
+}
+
+void coo_finish_update(CooState *s) {
+    assert(s->is_async);
+    double begin = _now(); /* time spent in background before finishing is not counted */
+    if (s->pool)
+        _finish_jobs(s->pool);
+    else
+        _run_jobs(0, _run_migration_job, s->jobs.jobs, s->async_jobs_count);
+    s->is_async = false;
+    if (s->pool) /* otherwise data was migrated after all writes */
+        for (int i = 0; i < s->allocs_count; ++i)
+            _remigrate_dirty_data(s->allocs[i]);
+    double migrated = _now();
+    s->stats.migration_time = migrated - begin;
+    _run_jobs(s->pool, _run_migration_job, s->jobs.jobs + s->async_jobs_count,
+              s->jobs.jobs_count - s->async_jobs_count);
+    s->stats.redirection_time = _now() - migrated;
+}
+
+static void _update_roots(CooState *s) { /* while old data still exists */
+    double begin = _now();
+    for (int i = 0; i < s->roots_count; ++i) {
+        _update_pointers(&s->forwards, s->roots[i].ptrs, s->roots[i].count);
+        s->stats.redirected_pointers += s->roots[i].count;
+    }
+    s->stats.redirection_time += _now() - begin;
+}
+
+void coo_end_update(CooState *s) {
+    assert(s->is_async == false);
+    _update_roots(s);
+    double begin = _now();
+    if (s->is_lazy_update)
+        s->is_lazy_update = false; /* batches moved by coo_realloc are kept until an update redirects pointers to them */
+    else if (s->bounded) {
+        _end_bounded_update(s);
+        for (int i = 0; i < s->allocs_count; ++i)
+            _free_moved_batches(s->allocs[i]);
+        s->stats.migration_time += _now() - begin;
+    }
+    else {
+        for (int i = 0; i < s->allocs_count; ++i)
+            _link_new_versions_of_data(s->allocs[i]);
+        for (int i = 0; i < s->allocs_count; ++i) {
+            _free_old_versions_of_data(s->allocs[i]);
+            _free_moved_batches(s->allocs[i]);
+        }
+        _deactivate_forwards(&s->forwards);
+        s->stats.free_time = _now() - begin;
+    }
+    if (s->stats_func) {
+        CooUpdateStats stats = coo_get_update_stats(s);
+        s->stats_func(s->stats_context, s, &stats);
+    }
+}
+
+CooUpdateStats coo_get_update_stats(CooState *s) {
+    CooUpdateStats stats = s->stats;
     for (int i = 0; i < s->allocs_count; ++i)
-        _free_old_versions_of_data(s->allocs[i]);
+        _add_update_stats(&stats, &s->allocs[i]->stats);
+    return stats;
+}
+
+CooUpdateStats coo_get_type_update_stats(CooState *s, CooType *t) {
+    CooUpdateStats stats;
+    memset(&stats, 0, sizeof(CooUpdateStats));
+    for (int kind = 0; kind < 3; ++kind) { /* alloc, ptr alloc and soa alloc */
+        CooAlloc *a = _find_alloc_of_kind(s, t, kind == 1, kind == 2);
+        if (a)
+            _add_update_stats(&stats, &a->stats);
+    }
+    return stats;
+}
+
+CooUpdateStats coo_get_alloc_update_stats(CooAlloc *a) {
+    return a->stats;
+}
+
+void coo_register_cast(CooType *from_type, CooType *to_type, COO_CAST_FUNC func) {
+    _init_primitives();
+    _add_cast(from_type, to_type, func);
+}
+
+void coo_add_roots(CooState *s, void **ptrs, size_t count) {
+    for (int i = 0; i < s->roots_count; ++i)
+        if (s->roots[i].ptrs == ptrs) {
+            s->roots[i].count = count;
+            return;
+        }
+    if (s->roots_count == s->roots_capacity) {
+        s->roots_capacity = s->roots_capacity ? s->roots_capacity * 2 : 8;
+        s->roots = realloc(s->roots, sizeof(CooRoots) * s->roots_capacity);
+    }
+    s->roots[s->roots_count].ptrs = ptrs;
+    s->roots[s->roots_count++].count = count;
+}
+
+void coo_remove_roots(CooState *s, void **ptrs) {
+    for (int i = 0; i < s->roots_count; ++i)
+        if (s->roots[i].ptrs == ptrs) {
+            s->roots[i] = s->roots[--s->roots_count];
+            return;
+        }
+}
+
+void coo_set_update_stats_callback(CooState *s, COO_UPDATE_STATS_FUNC func, void *context) {
+    s->stats_func = func;
+    s->stats_context = context;
 }
@@ -1,16 +1,46 @@
 #ifndef coo_state_h
 #define coo_state_h
 
-#define COO_MAX_ALLOCS 32
-#define COO_MAX_TYPES  32
+#include "layout.h"
+#include "map.h"
+#include <stddef.h>
 
 
+typedef struct CooRoots { /* host array of pointers */
+    void **ptrs;
+    size_t count;
+} CooRoots;
+
 typedef struct CooState {
-    struct CooAlloc *allocs[COO_MAX_ALLOCS];
-    int allocs_count;
-    struct CooType *types[COO_MAX_TYPES];
-    int types_count;
+    struct CooAlloc **allocs;
+    int allocs_count, allocs_capacity;
+    CooMap allocs_map; /* by type and is_ptr */
+    struct CooType **types;
+    int types_count, types_capacity;
+    CooMap types_map; /* by name */
+    CooNames names; /* interned type and variable names */
     int update_id;
+    int is_relocated; /* derived, data of state moves in current update, so pointers to primitive types are redirected */
+    struct CooPool *pool; /* 0 if updates are single threaded */
+    int threads_count;
+    CooJobs jobs; /* migration jobs of current update */
+    int async_jobs_count; /* migration jobs at start of jobs that run in background during async update */
+    int is_async; /* between async update begin and finish */
+    int is_lazy; /* data is migrated on first access instead of during update */
+    int is_lazy_update; /* between lazy update begin and end */
+    size_t update_budget; /* 0 if update duplicates all data */
+    struct CooBounded *bounded; /* only used between bounded update begin and end */
+    CooForwards forwards; /* old batches, only used between update begin and end if update is not lazy */
+    CooAllocator *allocator; /* for new allocs */
+    CooAllocator *update_allocator; /* for new allocs, 0 to use allocator */
+    CooUpdateStats stats; /* times of last update, counters are kept by allocs */
+    CooRoots *roots; /* updated when update ends */
+    int roots_count, roots_capacity;
+    COO_UPDATE_STATS_FUNC stats_func; /* called when update ends, 0 if not set */
+    void *stats_context;
 } CooState;
 
+CooType *_find_type(CooState *s, const char *name);
+CooAlloc *_find_alloc(CooState *s, CooType *type, int is_ptr);
+
 #endif
@@ -1,7 +1,10 @@
 #include "test.h"
 #include "coo.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <string.h>
 
 
 void coo_test_basics() {
@@ -267,8 +270,1808 @@ void coo_test_struct_composition() {
     coo_destroy_state(coo);
 }
 
+void coo_test_arrays() {
+    CooState *coo = coo_create_state();
+    coo_set_threads_count(coo, 4);
+
+    typedef struct {
+        char c;
+        int i;
+    } A1;
+
+    typedef struct {
+        int x;
+        A1 a[3];
+        float f;
+    } B1;
+
+    CooType *A_type = coo_create_type(coo, "A");
+    coo_add_var(A_type, "c", &CooI8);
+    coo_add_var(A_type, "i", &CooI32);
+
+    CooType *B_type = coo_create_type(coo, "B");
+    CooAlloc *B_alloc = coo_get_alloc(coo, B_type);
+    coo_add_var(B_type, "x", &CooI32);
+    coo_add_arr(B_type, "a", A_type, 3);
+    coo_add_var(B_type, "f", &CooF32);
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    /* unchanged prefix and suffix of instances and arrays large enough to be migrated by multiple threads */
+
+    B1 *b1 = coo_alloc(B_alloc, 20000);
+    for (int i = 0; i < 20000; ++i) {
+        b1[i].x = i;
+        for (int j = 0; j < 3; ++j) {
+            b1[i].a[j].c = (char)j;
+            b1[i].a[j].i = i + j;
+        }
+        b1[i].f = (float)i;
+    }
+
+    typedef struct {
+        char c;
+        short s;
+        int i;
+    } A2;
+
+    typedef struct {
+        int x;
+        A2 a[3];
+        double f;
+        int y;
+    } B2;
+
+    coo_ins_var(A_type, "s", &CooI16, 1);
+    coo_retype_var(B_type, "f", &CooF64);
+    coo_add_var(B_type, "y", &CooI32);
+
+    coo_begin_update(coo);
+    B2 *b2 = coo_update_pointer(b1);
+    coo_end_update(coo);
+
+    for (int i = 0; i < 20000; ++i) {
+        assert(b2[i].x == i);
+        for (int j = 0; j < 3; ++j) {
+            assert(b2[i].a[j].c == j);
+            assert(b2[i].a[j].s == 0);
+            assert(b2[i].a[j].i == i + j);
+        }
+        assert(b2[i].f == (double)i);
+        assert(b2[i].y == 0);
+    }
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_unaffected_types() {
+    CooState *coo = coo_create_state();
+
+    typedef struct {
+        int a;
+    } A1;
+
+    typedef struct {
+        A1 *a;
+        int b;
+    } B1;
+
+    typedef struct C1 {
+        struct C1 *c;
+        B1 *b;
+    } C1;
+
+    CooType *A_type = coo_create_type(coo, "A");
+    CooAlloc *A_alloc = coo_get_alloc(coo, A_type);
+    coo_add_var(A_type, "a", &CooI32);
+
+    CooType *B_type = coo_create_type(coo, "B");
+    CooAlloc *B_alloc = coo_get_alloc(coo, B_type);
+    coo_add_ptr_var(B_type, "a", A_type);
+    coo_add_var(B_type, "b", &CooI32);
+
+    CooType *C_type = coo_create_type(coo, "C");
+    CooAlloc *C_alloc = coo_get_alloc(coo, C_type);
+    coo_add_ptr_var(C_type, "c", C_type);
+    coo_add_ptr_var(C_type, "b", B_type);
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    A1 *a1 = coo_alloc(A_alloc, 1);
+    a1->a = 1;
+    B1 *b1 = coo_alloc(B_alloc, 1);
+    b1->a = a1;
+    b1->b = 2;
+    C1 *c1 = coo_alloc(C_alloc, 1);
+    c1->c = c1;
+    c1->b = b1;
+
+    /* change only B, A and C data stays in place while pointers to B are redirected */
+
+    typedef struct {
+        int b;
+        A1 *a;
+        double d;
+    } B2;
+
+    typedef struct C2 {
+        struct C2 *c;
+        B2 *b;
+    } C2;
+
+    coo_move_var(B_type, "b", 0);
+    coo_add_var(B_type, "d", &CooF64);
+    coo_begin_update(coo);
+    A1 *a2 = coo_update_pointer(a1);
+    B2 *b2 = coo_update_pointer(b1);
+    C2 *c2 = coo_update_pointer(c1);
+    coo_end_update(coo);
+
+    assert(a2 == a1);
+    assert((void *)c2 == (void *)c1);
+    assert((void *)b2 != (void *)b1);
+    assert(c2->c == c2);
+    assert(c2->b == b2);
+    assert(b2->a == a2);
+    assert(b2->b == 2);
+    assert(b2->d == 0.0);
+    assert(a2->a == 1);
+
+    /* update without changes keeps all data in place */
+
+    coo_begin_update(coo);
+    assert(coo_update_pointer(b2) == b2);
+    coo_end_update(coo);
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_bounded_update() {
+    CooState *coo = coo_create_state();
+    coo_set_update_budget(coo, 1024);
+
+    typedef struct A1 {
+        int a;
+        struct A1 *next;
+    } A1;
+
+    typedef struct {
+        A1 *a;
+        int b;
+    } B1;
+
+    CooType *A_type = coo_create_type(coo, "A");
+    CooAlloc *A_alloc = coo_get_alloc(coo, A_type);
+    coo_add_var(A_type, "a", &CooI32);
+    coo_add_ptr_var(A_type, "next", A_type);
+
+    CooType *B_type = coo_create_type(coo, "B");
+    CooAlloc *B_alloc = coo_get_alloc(coo, B_type);
+    CooAlloc *A_alloc_ptrs = coo_get_ptr_alloc(coo, A_type);
+    coo_add_ptr_var(B_type, "a", A_type);
+    coo_add_var(B_type, "b", &CooI32);
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    /* linked list of batches, array pointing into the list and array of pointers to the list */
+
+    A1 *a1_root = 0;
+    for (int i = 99; i >= 0; --i) {
+        A1 *a1 = coo_alloc(A_alloc, 10);
+        a1->a = i;
+        a1->next = a1_root;
+        a1_root = a1;
+    }
+    B1 *b1 = coo_alloc(B_alloc, 100);
+    A1 **v1 = coo_alloc(A_alloc_ptrs, 100);
+    int i = 0;
+    for (A1 *a1 = a1_root; a1; a1 = a1->next, ++i) {
+        b1[i].a = a1;
+        b1[i].b = i;
+        v1[i] = a1;
+    }
+
+    /* budget is much smaller than the data so old batches are freed during migration */
+
+    typedef struct A2 {
+        struct A2 *next;
+        double d;
+        int a;
+    } A2;
+
+    typedef struct {
+        int b;
+        A2 *a;
+    } B2;
+
+    coo_move_var(A_type, "a", 1);
+    coo_ins_var(A_type, "d", &CooF64, 1);
+    coo_move_var(B_type, "b", 0);
+    coo_begin_update(coo);
+    A2 *a2_root = coo_update_pointer(a1_root);
+    B2 *b2 = coo_update_pointer(b1);
+    coo_end_update(coo);
+
+    A2 **v2 = (A2 **)v1;
+    i = 0;
+    for (A2 *a2 = a2_root; a2; a2 = a2->next, ++i) {
+        assert(a2->a == i);
+        assert(a2->d == 0.0);
+        assert(b2[i].a == a2);
+        assert(b2[i].b == i);
+        assert(v2[i] == a2);
+    }
+    assert(i == 100);
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_in_place() {
+    CooState *coo = coo_create_state();
+
+    typedef struct {
+        int a;
+        int b;
+        double c;
+        short d[4];
+    } A1;
+
+    typedef struct {
+        A1 *a;
+    } B1;
+
+    CooType *A_type = coo_create_type(coo, "A");
+    CooAlloc *A_alloc = coo_get_alloc(coo, A_type);
+    coo_add_var(A_type, "a", &CooI32);
+    coo_add_var(A_type, "b", &CooI32);
+    coo_add_var(A_type, "c", &CooF64);
+    coo_add_arr(A_type, "d", &CooI16, 4);
+
+    CooType *B_type = coo_create_type(coo, "B");
+    CooAlloc *B_alloc = coo_get_alloc(coo, B_type);
+    coo_add_ptr_var(B_type, "a", A_type);
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    A1 *a1 = coo_alloc(A_alloc, 1000);
+    for (int i = 0; i < 1000; ++i) {
+        a1[i].a = i;
+        a1[i].b = -i;
+        a1[i].c = i * 0.5;
+        for (int j = 0; j < 4; ++j)
+            a1[i].d[j] = (short)(i + j);
+    }
+    B1 *b1 = coo_alloc(B_alloc, 1);
+    b1->a = a1;
+
+    /* swap variables of same size, data stays in the same batch */
+
+    typedef struct {
+        int b;
+        int a;
+        double c;
+        short d[4];
+    } A2;
+
+    coo_move_var(A_type, "b", 0);
+    coo_begin_update(coo);
+    A2 *a2 = coo_update_pointer(a1);
+    assert(coo_update_pointer(b1) == b1);
+    coo_end_update(coo);
+
+    assert((void *)a2 == (void *)a1);
+    for (int i = 0; i < 1000; ++i) {
+        assert(a2[i].a == i);
+        assert(a2[i].b == -i);
+        assert(a2[i].c == i * 0.5);
+        for (int j = 0; j < 4; ++j)
+            assert(a2[i].d[j] == i + j);
+    }
+
+    /* remove variables and move remaining ones, instances shrink within the same batch */
+
+    typedef struct {
+        short d[2];
+        int a;
+    } A3;
+
+    coo_remove_var(A_type, "b");
+    coo_remove_var(A_type, "c");
+    coo_resize_array(A_type, "d", 2);
+    coo_move_var(A_type, "d", 0);
+    coo_begin_update(coo);
+    A3 *a3 = coo_update_pointer(a2);
+    coo_end_update(coo);
+
+    assert((void *)a3 == (void *)a1);
+    assert((void *)b1->a == (void *)a3);
+    for (int i = 0; i < 1000; ++i) {
+        assert(a3[i].a == i);
+        assert(a3[i].d[0] == i);
+        assert(a3[i].d[1] == i + 1);
+    }
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_allocators() {
+    CooAllocator *slab = coo_create_slab_allocator();
+    CooAllocator *arena = coo_create_arena_allocator(4096);
+    CooState *coo = coo_create_state();
+    coo_set_allocator(coo, slab);
+    coo_set_update_allocator(coo, arena);
+
+    typedef struct A1 {
+        int a;
+        struct A1 *next;
+    } A1;
+
+    CooType *A_type = coo_create_type(coo, "A");
+    CooAlloc *A_alloc = coo_get_alloc(coo, A_type);
+    coo_add_var(A_type, "a", &CooI32);
+    coo_add_ptr_var(A_type, "next", A_type);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    /* many single instances from slab, freeing every other one */
+
+    A1 *a1_root = 0;
+    for (int i = 0; i < 1000; ++i) {
+        A1 *a1 = coo_alloc(A_alloc, 1);
+        a1->a = 999 - i;
+        a1->next = a1_root;
+        a1_root = a1;
+    }
+    for (A1 *a1 = a1_root; a1; a1 = a1->next) {
+        A1 *a1_next = a1->next;
+        if (a1_next) {
+            a1->next = a1_next->next;
+            coo_free(A_alloc, a1_next);
+        }
+    }
+    A1 *a1_big = coo_alloc(A_alloc, 10000); /* too big for slab classes */
+    a1_big[9999].a = 13;
+
+    /* new versions of data come from arena, old versions from previous update are released */
+
+    typedef struct A2 {
+        struct A2 *next;
+        double d;
+        int a;
+        long long pad[2];
+    } A2;
+
+    for (int update = 0; update < 3; ++update) {
+        if (update == 0) {
+            coo_ins_var(A_type, "d", &CooF64, 0);
+            coo_move_var(A_type, "next", 0);
+        }
+        else if (update == 1)
+            coo_add_arr(A_type, "pad", &CooI64, 1);
+        else
+            coo_resize_array(A_type, "pad", 2);
+        coo_begin_update(coo);
+        a1_root = coo_update_pointer(a1_root);
+        a1_big = coo_update_pointer(a1_big);
+        coo_end_update(coo);
+        CooUpdateStats stats = coo_get_update_stats(coo);
+        assert(stats.allocated_batches == 501 && stats.freed_batches == 501);
+    }
+
+    int i = 0;
+    for (A2 *a2 = (A2 *)a1_root; a2; a2 = a2->next, i += 2)
+        assert(a2->a == i);
+    assert(i == 1000);
+    assert(((A2 *)a1_big)[9999].a == 13);
+
+    coo_destroy_state(coo);
+    coo_destroy_allocator(arena);
+    coo_destroy_allocator(slab);
+}
+
+void coo_test_many_types() {
+    CooState *coo = coo_create_state();
+
+    /* many types, each with its own alloc holding one value */
+
+    CooType *types[1000];
+    int *values[1000];
+    char name[32];
+    for (int i = 0; i < 1000; ++i) {
+        sprintf(name, "T%d", i);
+        types[i] = coo_create_type(coo, name);
+        coo_add_var(types[i], "a", &CooI32);
+    }
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    for (int i = 0; i < 1000; ++i) {
+        values[i] = coo_alloc(coo_get_alloc(coo, types[i]), 1);
+        *values[i] = i;
+        assert(coo_get_alloc(coo, types[i]) == coo_get_alloc(coo, types[i]));
+        assert(coo_get_ptr_alloc(coo, types[i]) != coo_get_alloc(coo, types[i]));
+    }
+
+    /* remove every other type and change the remaining ones */
+
+    for (int i = 0; i < 1000; i += 2) {
+        sprintf(name, "T%d", i);
+        coo_remove_type(coo, name);
+    }
+    for (int i = 1; i < 1000; i += 2)
+        coo_ins_var(types[i], "b", &CooI64, 0);
+    coo_begin_update(coo);
+    for (int i = 1; i < 1000; i += 2)
+        values[i] = (int *)((long long *)coo_update_pointer(values[i]) + 1);
+    coo_end_update(coo);
+
+    for (int i = 1; i < 1000; i += 2)
+        assert(*values[i] == i);
+
+    /* names of removed types can be reused */
+
+    for (int i = 0; i < 1000; i += 2) {
+        sprintf(name, "T%d", i);
+        types[i] = coo_create_type(coo, name);
+    }
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_many_vars() {
+    CooState *coo = coo_create_state();
+
+    /* type with more variables than fixed size descriptors could hold, names from a reused buffer */
+
+    CooType *A = coo_create_type(coo, "A");
+    char name[32];
+    for (int i = 0; i < 300; ++i) {
+        sprintf(name, "v%d", i);
+        coo_add_var(A, name, &CooI32);
+    }
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    int *a = coo_alloc(coo_get_alloc(coo, A), 10);
+    for (int i = 0; i < 10; ++i)
+        for (int j = 0; j < 300; ++j)
+            a[i * 300 + j] = i * 1000 + j;
+
+    /* remove every other variable and retype the rest */
+
+    for (int i = 0; i < 300; i += 2) {
+        sprintf(name, "v%d", i);
+        coo_remove_var(A, name);
+    }
+    for (int i = 1; i < 300; i += 2) {
+        sprintf(name, "v%d", i);
+        coo_retype_var(A, name, &CooI64);
+    }
+    coo_begin_update(coo);
+    long long *b = coo_update_pointer(a);
+    coo_end_update(coo);
+
+    for (int i = 0; i < 10; ++i)
+        for (int j = 0; j < 150; ++j)
+            assert(b[i * 150 + j] == i * 1000 + j * 2 + 1);
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_lazy_update() {
+    CooState *coo = coo_create_state();
+
+    typedef struct {
+        int a;
+        int b;
+    } A1;
+
+    typedef struct {
+        A1 *a;
+        const char *name;
+    } B1;
+
+    typedef struct {
+        float x;
+    } R1;
+
+    CooType *A_type = coo_create_type(coo, "A");
+    CooAlloc *A_alloc = coo_get_alloc(coo, A_type);
+    coo_add_var(A_type, "a", &CooI32);
+    coo_add_var(A_type, "b", &CooI32);
+
+    CooType *B_type = coo_create_type(coo, "B");
+    CooAlloc *B_alloc = coo_get_alloc(coo, B_type);
+    coo_add_ptr_var(B_type, "a", A_type);
+    coo_add_ptr_var(B_type, "name", &CooI8); /* points to host memory */
+
+    CooType *R_type = coo_create_type(coo, "R");
+    CooAlloc *R_alloc = coo_get_alloc(coo, R_type);
+    coo_add_var(R_type, "x", &CooF32);
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    A1 *a1 = coo_alloc(A_alloc, 10);
+    for (int i = 0; i < 10; ++i) {
+        a1[i].a = i;
+        a1[i].b = -i;
+    }
+    B1 *b1 = coo_alloc(B_alloc, 1);
+    b1->a = a1;
+    b1->name = "b1";
+    R1 *r1 = coo_alloc(R_alloc, 10000);
+    for (int i = 0; i < 10000; ++i)
+        r1[i].x = (float)i;
+
+    /* lazy update doesn't touch any data */
+
+    typedef struct {
+        long long c;
+        int a;
+        int b;
+    } A2;
+
+    coo_set_lazy_update(coo, 1);
+    coo_ins_var(A_type, "c", &CooI64, 0);
+    coo_retype_var(R_type, "x", &CooF64);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    assert(b1->a == a1);
+    for (int i = 0; i < 10000; ++i)
+        assert(r1[i].x == (float)i);
+
+    /* other states update and redirect interior pointers while data is stale */
+
+    CooState *other = coo_create_state();
+    CooType *O_type = coo_create_type(other, "O");
+    coo_add_var(O_type, "x", &CooI32);
+    coo_add_var(O_type, "y", &CooI32);
+    coo_begin_update(other);
+    coo_end_update(other);
+    int *o1 = coo_alloc(coo_get_alloc(other, O_type), 4);
+    o1[7] = 7;
+    coo_ins_var(O_type, "w", &CooI32, 0);
+    coo_begin_update(other);
+    int *o2 = coo_update_pointer(o1 + 7); /* y of last element */
+    coo_end_update(other);
+    assert(*o2 == 7 && o2[-2] == 0);
+    coo_destroy_state(other);
+
+    /* data reachable through updated pointer is migrated with it */
+
+    B1 *b2 = coo_update_pointer(b1);
+    assert(b2 == b1 && strcmp(b2->name, "b1") == 0);
+    A2 *a2 = (A2 *)b2->a;
+    assert((void *)a2 != (void *)a1);
+    assert(coo_update_pointer(a1) == a2);
+    for (int i = 0; i < 10; ++i) {
+        assert(a2[i].a == i);
+        assert(a2[i].b == -i);
+        assert(a2[i].c == 0);
+    }
+
+    /* data not accessed since previous update is migrated through both versions */
+
+    typedef struct {
+        int y;
+        double x;
+    } R3;
+
+    coo_ins_var(R_type, "y", &CooI32, 0);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    int count = 0;
+    R3 *r3 = coo_next_batch(R_alloc, 0, &count);
+    assert(count == 10000);
+    assert(coo_next_batch(R_alloc, r3, 0) == 0);
+    for (int i = 0; i < 10000; ++i) {
+        assert(r3[i].x == i);
+        assert(r3[i].y == 0);
+    }
+
+    /* update that is not lazy migrates remaining data first */
+
+    typedef struct {
+        int a;
+    } A4;
+
+    coo_set_lazy_update(coo, 0);
+    coo_remove_var(A_type, "c");
+    coo_remove_var(A_type, "b");
+    coo_begin_update(coo);
+    B1 *b4 = coo_update_pointer(b2);
+    coo_end_update(coo);
+
+    A4 *a4 = (A4 *)b4->a;
+    for (int i = 0; i < 10; ++i)
+        assert(a4[i].a == i);
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_async_update() {
+    CooState *coo = coo_create_state();
+    coo_set_threads_count(coo, 4);
+
+    typedef struct {
+        int a;
+        int b;
+    } A1;
+
+    typedef struct {
+        A1 *a;
+    } B1;
+
+    CooType *A_type = coo_create_type(coo, "A");
+    CooAlloc *A_alloc = coo_get_alloc(coo, A_type);
+    coo_add_var(A_type, "a", &CooI32);
+    coo_add_var(A_type, "b", &CooI32);
+
+    CooType *B_type = coo_create_type(coo, "B");
+    CooAlloc *B_alloc = coo_get_alloc(coo, B_type);
+    coo_add_ptr_var(B_type, "a", A_type);
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    A1 *a1 = coo_alloc(A_alloc, 100000);
+    for (int i = 0; i < 100000; ++i) {
+        a1[i].a = i;
+        a1[i].b = -i;
+    }
+    B1 *b1 = coo_alloc(B_alloc, 1);
+    b1->a = a1;
+
+    CooState *other = coo_create_state();
+    CooType *O_type = coo_create_type(other, "O");
+    coo_add_var(O_type, "x", &CooI32);
+    coo_begin_update(other);
+    coo_end_update(other);
+    int *o1 = coo_alloc(coo_get_alloc(other, O_type), 1);
+    *o1 = 3;
+
+    /* old data is used while it is migrated in background, written batch is migrated again, other
+       states can be updated meanwhile */
+
+    typedef struct {
+        long long c;
+        int a;
+        int b;
+    } A2;
+
+    coo_ins_var(A_type, "c", &CooI64, 0);
+    coo_begin_update_async(coo);
+    coo_ins_var(O_type, "w", &CooI64, 0);
+    coo_begin_update(other);
+    int *o2 = (int *)((long long *)coo_update_pointer(o1) + 1);
+    coo_end_update(other);
+    assert(*o2 == 3);
+    coo_destroy_state(other);
+    while (coo_is_update_ready(coo) == 0)
+        assert(b1->a[5].a == 5);
+    b1->a[5].a = 555;
+    coo_mark_dirty(b1->a);
+    coo_mark_dirty(b1); /* doesn't move, ignored */
+    coo_finish_update(coo);
+    B1 *b2 = coo_update_pointer(b1);
+    A2 *a2 = coo_update_pointer(a1);
+    coo_end_update(coo);
+
+    assert(b2 == b1);
+    assert((void *)b2->a == (void *)a2);
+    for (int i = 0; i < 100000; ++i) {
+        assert(a2[i].a == (i == 5 ? 555 : i));
+        assert(a2[i].b == -i);
+        assert(a2[i].c == 0);
+    }
+
+    /* shrinking data is moved too since old data can't be overwritten, single thread migrates
+       when update is finished */
+
+    typedef struct {
+        int a;
+    } A3;
+
+    coo_set_threads_count(coo, 1);
+    coo_remove_var(A_type, "b");
+    coo_remove_var(A_type, "c");
+    coo_begin_update_async(coo);
+    assert(coo_is_update_ready(coo));
+    a2[7].a = 777;
+    coo_mark_dirty(a2);
+    coo_finish_update(coo);
+    A3 *a3 = coo_update_pointer(a2);
+    coo_end_update(coo);
+    assert(coo_get_type_update_stats(coo, A_type).copied_bytes == 100000 * sizeof(int)); /* migrated once */
+
+    assert((void *)a3 != (void *)a2);
+    assert((void *)b2->a == (void *)a3);
+    for (int i = 0; i < 100000; ++i)
+        assert(a3[i].a == (i == 5 ? 555 : i == 7 ? 777 : i));
+
+    /* pointers to primitive types are redirected when written batch is migrated again, even if
+       another state updated meanwhile without moving data */
+
+    coo_set_threads_count(coo, 4);
+    CooType *U_type = coo_create_type(coo, "U");
+    coo_add_var(U_type, "v", &CooI32);
+    coo_add_ptr_var(U_type, "target", &CooI32);
+    coo_set_var_cold(U_type, "target", 1);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    int *u1 = coo_alloc(coo_get_alloc(coo, U_type), 10);
+    int **targets = coo_get_cold(u1);
+    for (int i = 0; i < 10; ++i)
+        targets[i] = u1 + i;
+    other = coo_create_state();
+    coo_add_var(coo_create_type(other, "O"), "x", &CooI32);
+    coo_begin_update(other);
+    coo_end_update(other);
+    coo_add_var(U_type, "w", &CooI32);
+    coo_begin_update_async(coo);
+    coo_begin_update(other);
+    coo_end_update(other);
+    coo_mark_dirty(u1);
+    coo_finish_update(coo);
+    int *u2 = coo_update_pointer(u1);
+    coo_end_update(coo);
+    coo_destroy_state(other);
+
+    assert(u2 != u1);
+    targets = coo_get_cold(u2);
+    for (int i = 0; i < 10; ++i)
+        assert(targets[i] == u2 + 2 * i);
+
+    coo_destroy_state(coo);
+}
+
+static char *_read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    assert(file);
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = malloc(*size);
+    assert(fread(data, 1, *size, file) == *size);
+    fclose(file);
+    return data;
+}
+
+static void _write_file(const char *path, const char *data, size_t size) {
+    FILE *file = fopen(path, "wb");
+    assert(file && fwrite(data, 1, size, file) == size);
+    fclose(file);
+}
+
+void coo_test_save_load() {
+    CooState *coo = coo_create_state();
+
+    typedef struct {
+        float x;
+        int y[3];
+    } B1;
+
+    typedef struct {
+        int a;
+        B1 *b;
+    } A1;
+
+    CooType *B_type = coo_create_type(coo, "B");
+    coo_add_var(B_type, "x", &CooF32);
+    coo_add_arr(B_type, "y", &CooI32, 3);
+
+    CooType *A_type = coo_create_type(coo, "A");
+    coo_add_var(A_type, "a", &CooI32);
+    coo_add_ptr_var(A_type, "b", B_type);
+
+    CooType *C_type = coo_create_type(coo, "C"); /* only exists on disk once saved */
+    coo_add_var(C_type, "c", &CooI32);
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    B1 *b1 = coo_alloc(coo_get_alloc(coo, B_type), 100);
+    for (int i = 0; i < 100; ++i) {
+        b1[i].x = i * 0.5f;
+        for (int j = 0; j < 3; ++j)
+            b1[i].y[j] = i + j;
+    }
+    A1 *a1 = coo_alloc(coo_get_alloc(coo, A_type), 1);
+    a1->a = 42;
+    a1->b = b1;
+    B1 **p1 = coo_alloc(coo_get_ptr_alloc(coo, B_type), 2);
+    p1[1] = b1;
+    int *c1 = coo_alloc(coo_get_alloc(coo, C_type), 1);
+    *c1 = 7;
+    int *i1 = coo_alloc(coo_get_alloc(coo, &CooI32), 4);
+    for (int i = 0; i < 4; ++i)
+        i1[i] = i * 3;
+    int **pi1 = coo_alloc(coo_get_ptr_alloc(coo, &CooI32), 2);
+    pi1[0] = i1;
+    pi1[1] = i1 + 2;
+
+    assert(coo_save_state(coo, "coo_test_state.bin"));
+    coo_destroy_state(coo);
+
+    /* running code has different layout of B, loaded data is migrated */
+
+    typedef struct {
+        int y[2];
+        double x;
+    } B2;
+
+    typedef struct {
+        int a;
+        B2 *b;
+    } A2;
+
+    coo = coo_create_state();
+    B_type = coo_create_type(coo, "B");
+    coo_add_arr(B_type, "y", &CooI32, 2);
+    coo_add_var(B_type, "x", &CooF64);
+
+    A_type = coo_create_type(coo, "A");
+    coo_add_var(A_type, "a", &CooI32);
+    coo_add_ptr_var(A_type, "b", B_type);
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    assert(coo_load_state(coo, "missing_coo_test_state.bin") == 0);
+
+    /* truncated and corrupted files don't load and leave types and allocs as they are */
+
+    assert(coo_save_state(coo, "coo_test_before.bin"));
+    size_t size = 0;
+    char *file = _read_file("coo_test_state.bin", &size);
+    for (size_t i = 0; i < size; i += 7) {
+        _write_file("coo_test_corrupt.bin", file, i);
+        assert(coo_load_state(coo, "coo_test_corrupt.bin") == 0);
+    }
+    long long outside = 8; /* last pointer points into header */
+    memcpy(file + size - sizeof(outside), &outside, sizeof(outside));
+    _write_file("coo_test_corrupt.bin", file, size);
+    assert(coo_load_state(coo, "coo_test_corrupt.bin") == 0);
+    remove("coo_test_corrupt.bin");
+    free(file);
+    assert(coo_save_state(coo, "coo_test_after.bin"));
+    size_t before_size = 0, after_size = 0;
+    char *before = _read_file("coo_test_before.bin", &before_size);
+    char *after = _read_file("coo_test_after.bin", &after_size);
+    assert(before_size == after_size && memcmp(before, after, before_size) == 0);
+    remove("coo_test_before.bin");
+    remove("coo_test_after.bin");
+    free(before);
+    free(after);
+    B2 *b = coo_alloc(coo_get_alloc(coo, B_type), 1);
+    b->x = 1.5;
+    coo_begin_update(coo);
+    b = coo_update_pointer(b);
+    coo_end_update(coo);
+    assert(b->x == 1.5);
+    coo_free(coo_get_alloc(coo, B_type), b);
+
+    assert(coo_load_state(coo, "coo_test_state.bin"));
+    remove("coo_test_state.bin");
+
+    int count = 0;
+    A2 *a2 = coo_next_batch(coo_get_alloc(coo, A_type), 0, &count);
+    assert(count == 1);
+    assert(a2->a == 42);
+    B2 *b2 = coo_next_batch(coo_get_alloc(coo, B_type), 0, &count);
+    assert(count == 100);
+    assert(a2->b == b2);
+    for (int i = 0; i < 100; ++i) {
+        assert(b2[i].x == i * 0.5);
+        for (int j = 0; j < 2; ++j)
+            assert(b2[i].y[j] == i + j);
+    }
+    B2 **p2 = coo_next_batch(coo_get_ptr_alloc(coo, B_type), 0, &count);
+    assert(count == 2);
+    assert(p2[0] == 0);
+    assert(p2[1] == b2);
+    int *i2 = coo_next_batch(coo_get_alloc(coo, &CooI32), 0, &count);
+    assert(count == 4);
+    for (int i = 0; i < 4; ++i)
+        assert(i2[i] == i * 3);
+    int **pi2 = coo_next_batch(coo_get_ptr_alloc(coo, &CooI32), 0, &count);
+    assert(count == 2);
+    assert(pi2[0] == i2);
+    assert(pi2[1] == i2 + 2);
+
+    /* loaded data can be freed and changed like any other data */
+
+    coo_free(coo_get_alloc(coo, A_type), a2);
+    coo_remove_var(B_type, "y");
+    coo_begin_update(coo);
+    p2 = coo_update_pointer(p2);
+    coo_end_update(coo);
+
+    assert(((double *)p2[1])[99] == 99 * 0.5);
+
+    /* pointers to host memory can't be saved */
+
+    const char *host = "host";
+    const char **name = coo_alloc(coo_get_ptr_alloc(coo, &CooI8), 1);
+    *name = host;
+    remove("coo_test_host.bin");
+    assert(coo_save_state(coo, "coo_test_host.bin") == 0);
+    assert(fopen("coo_test_host.bin", "rb") == 0);
+
+    coo_destroy_state(coo);
+}
+
+static void _count_update(void *context, CooState *s, const CooUpdateStats *stats) {
+    (void)s;
+    *(size_t *)context += stats->cast_values;
+}
+
+void coo_test_update_stats() {
+    CooState *coo = coo_create_state();
+    size_t callback_cast_values = 0;
+    coo_set_update_stats_callback(coo, _count_update, &callback_cast_values);
+
+    CooType *A = coo_create_type(coo, "A");
+    coo_add_var(A, "x", &CooI32);
+    coo_add_arr(A, "y", &CooI32, 3);
+    CooType *B = coo_create_type(coo, "B");
+    coo_add_ptr_var(B, "a", A);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    CooAlloc *a_alloc = coo_get_alloc(coo, A);
+    int *a[4];
+    for (int i = 0; i < 4; ++i)
+        a[i] = coo_alloc(a_alloc, 10);
+    void **b = coo_alloc(coo_get_alloc(coo, B), 5);
+    for (int i = 0; i < 5; ++i)
+        b[i] = a[i % 4];
+    void **p = coo_alloc(coo_get_ptr_alloc(coo, A), 2);
+    p[0] = a[0];
+    p[1] = a[1];
+
+    /* retype array and add variable, A moves and pointers to it are redirected */
+
+    coo_retype_var(A, "y", &CooF64);
+    coo_add_var(A, "z", &CooI32);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    CooUpdateStats stats = coo_get_alloc_update_stats(a_alloc);
+    assert(stats.cast_values == 40 * 3);
+    assert(stats.cast_bytes == 40 * 3 * sizeof(double));
+    assert(stats.copied_bytes == 40 * sizeof(int));
+    assert(stats.zeroed_bytes == 40 * sizeof(int));
+    assert(stats.allocated_batches == 4);
+    assert(stats.freed_batches == 4);
+    assert(stats.redirected_pointers == 0);
+
+    stats = coo_get_type_update_stats(coo, B);
+    assert(stats.redirected_pointers == 5);
+    assert(stats.allocated_batches == 0 && stats.copied_bytes == 0);
+
+    stats = coo_get_update_stats(coo);
+    assert(stats.redirected_pointers == 7);
+    assert(stats.cast_values == 40 * 3);
+    assert(stats.layout_time >= 0 && stats.migration_time >= 0);
+    assert(callback_cast_values == 40 * 3);
+
+    /* update without changes resets statistics */
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    stats = coo_get_update_stats(coo);
+    assert(stats.cast_values == 0 && stats.allocated_batches == 0 && stats.redirected_pointers == 0);
+
+    coo_destroy_state(coo);
+}
+
+typedef struct TestVec2 {
+    float x, y;
+} TestVec2;
+
+typedef struct TestPolar {
+    double r2, y_over_x;
+} TestPolar;
+
+static void _vec2_to_polar(const void *src, void *dst, int count, int src_stride, int dst_stride) {
+    for (int i = 0; i < count; ++i) {
+        const TestVec2 *v = (const TestVec2 *)((const char *)src + (size_t)src_stride * i);
+        TestPolar *p = (TestPolar *)((char *)dst + (size_t)dst_stride * i);
+        p->r2 = (double)v->x * v->x + (double)v->y * v->y;
+        p->y_over_x = (double)v->y / v->x;
+    }
+}
+
+static void _f64_to_i32_truncated(const void *src, void *dst, int count, int src_stride, int dst_stride) {
+    for (int i = 0; i < count; ++i)
+        *(int32_t *)((char *)dst + (size_t)dst_stride * i) = (int32_t)*(const double *)((const char *)src + (size_t)src_stride * i);
+}
+
+static void _f64_to_i32_rounded(const void *src, void *dst, int count, int src_stride, int dst_stride) {
+    for (int i = 0; i < count; ++i) {
+        double value = *(const double *)((const char *)src + (size_t)src_stride * i);
+        *(int32_t *)((char *)dst + (size_t)dst_stride * i) = (int32_t)(value < 0 ? value - 0.5 : value + 0.5);
+    }
+}
+
+void coo_test_casts() {
+    CooState *coo = coo_create_state();
+
+    /* arrays long enough for simd kernels and their tails, single values cast across elements */
+
+    CooType *Vec2 = coo_create_type(coo, "Vec2");
+    coo_add_var(Vec2, "x", &CooF32);
+    coo_add_var(Vec2, "y", &CooF32);
+    CooType *Polar = coo_create_type(coo, "Polar");
+    coo_add_var(Polar, "r2", &CooF64);
+    coo_add_var(Polar, "y_over_x", &CooF64);
+    coo_register_cast(Vec2, Polar, _vec2_to_polar);
+
+    CooType *A = coo_create_type(coo, "A");
+    coo_add_arr(A, "i8", &CooI8, 37);
+    coo_add_arr(A, "i16", &CooI16, 19);
+    coo_add_arr(A, "i32", &CooI32, 1001);
+    coo_add_arr(A, "f32", &CooF32, 7);
+    coo_add_var(A, "v", &CooI32);
+    coo_add_var(A, "vec", Vec2);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    struct A1 {
+        int8_t i8[37];
+        int16_t i16[19];
+        int32_t i32[1001];
+        float f32[7];
+        int32_t v;
+        TestVec2 vec;
+    } *a = coo_alloc(coo_get_alloc(coo, A), 3);
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 37; ++j)
+            a[i].i8[j] = (int8_t)(j * 7 - 128);
+        for (int j = 0; j < 19; ++j)
+            a[i].i16[j] = (int16_t)(j * 1000 - 9000);
+        for (int j = 0; j < 1001; ++j)
+            a[i].i32[j] = (j - 500) * 100000 + i;
+        for (int j = 0; j < 7; ++j)
+            a[i].f32[j] = j * -0.25f;
+        a[i].v = -i - 1;
+        a[i].vec.x = 2.0f;
+        a[i].vec.y = (float)i;
+    }
+
+    coo_retype_var(A, "i8", &CooI64);
+    coo_retype_var(A, "i16", &CooF64);
+    coo_retype_var(A, "i32", &CooF64);
+    coo_retype_var(A, "f32", &CooF64);
+    coo_retype_var(A, "v", &CooI64);
+    coo_retype_var(A, "vec", Polar);
+    coo_begin_update(coo);
+    struct A2 {
+        int64_t i8[37];
+        double i16[19];
+        double i32[1001];
+        double f32[7];
+        int64_t v;
+        TestPolar vec;
+    } *b = coo_update_pointer(a);
+    coo_end_update(coo);
+
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 37; ++j)
+            assert(b[i].i8[j] == j * 7 - 128);
+        for (int j = 0; j < 19; ++j)
+            assert(b[i].i16[j] == j * 1000 - 9000);
+        for (int j = 0; j < 1001; ++j)
+            assert(b[i].i32[j] == (j - 500) * 100000 + i);
+        for (int j = 0; j < 7; ++j)
+            assert(b[i].f32[j] == j * -0.25);
+        assert(b[i].v == -i - 1);
+        assert(b[i].vec.r2 == 4.0 + i * i);
+        assert(b[i].vec.y_over_x == i * 0.5);
+    }
+    assert(coo_get_update_stats(coo).cast_values == 3 * (37 + 19 + 1001 + 7 + 1 + 1));
+
+    /* cast registered before any state was created, registering it again changes lazily migrated data
+       that is not migrated yet */
+
+    coo_set_lazy_update(coo, 1);
+    coo_retype_var(A, "f32", &CooI32);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    coo_register_cast(&CooF64, &CooI32, _f64_to_i32_rounded);
+    struct A3 {
+        int64_t i8[37];
+        double i16[19];
+        double i32[1001];
+        int32_t f32[7];
+        int64_t v;
+        TestPolar vec;
+    } *c = coo_update_pointer(b);
+    for (int j = 0; j < 7; ++j)
+        assert(c[2].f32[j] == -(j + 2) / 4); /* j * -0.25 rounded */
+    coo_register_cast(&CooF64, &CooI32, _f64_to_i32_truncated);
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_defaults() {
+    CooState *coo = coo_create_state();
+
+    CooType *A = coo_create_type(coo, "A");
+    coo_add_var(A, "x", &CooI32);
+    CooType *B = coo_create_type(coo, "B");
+    coo_add_var(B, "k", &CooI32);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    int *a = coo_alloc(coo_get_alloc(coo, A), 3);
+    int *b = coo_alloc(coo_get_alloc(coo, B), 2);
+    for (int i = 0; i < 3; ++i)
+        a[i] = i + 1;
+    b[0] = 10;
+    b[1] = 20;
+
+    /* new variables get their defaults, old ones keep their values, nested struct gets defaults of its type */
+
+    float hp = 100.0f;
+    short id = -1;
+    int x = 7;
+    coo_add_var(A, "hp", &CooF32);
+    coo_set_var_default(A, "hp", &hp);
+    coo_add_arr(A, "ids", &CooI16, 5);
+    coo_set_var_default(A, "ids", &id);
+    coo_set_var_default(A, "x", &x);
+    coo_add_var(B, "a", A);
+    coo_begin_update(coo);
+    struct A2 {
+        int x;
+        float hp;
+        short ids[5];
+    } *a2 = coo_update_pointer(a);
+    struct B2 {
+        int k;
+        struct A2 a;
+    } *b2 = coo_update_pointer(b);
+    coo_end_update(coo);
+
+    for (int i = 0; i < 3; ++i) {
+        assert(a2[i].x == i + 1 && a2[i].hp == 100.0f);
+        for (int j = 0; j < 5; ++j)
+            assert(a2[i].ids[j] == -1);
+    }
+    for (int i = 0; i < 2; ++i) {
+        assert(b2[i].k == (i + 1) * 10);
+        assert(b2[i].a.x == 7 && b2[i].a.hp == 100.0f && b2[i].a.ids[4] == -1);
+    }
+    assert(coo_get_update_stats(coo).defaulted_bytes > 0);
+
+    /* new data starts with defaults, new array elements get defaults too */
+
+    struct A2 *n = coo_alloc(coo_get_alloc(coo, A), 4);
+    for (int i = 0; i < 4; ++i)
+        assert(n[i].x == 7 && n[i].hp == 100.0f && n[i].ids[2] == -1);
+
+    a2[0].ids[0] = 5;
+    coo_resize_array(A, "ids", 8);
+    coo_begin_update(coo);
+    struct A3 {
+        int x;
+        float hp;
+        short ids[8];
+    } *a3 = coo_update_pointer(a2);
+    coo_end_update(coo);
+
+    assert(a3[0].ids[0] == 5 && a3[0].ids[4] == -1 && a3[0].ids[7] == -1);
+    assert(a3[2].x == 3 && a3[2].hp == 100.0f);
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_soa() {
+    CooState *coo = coo_create_state();
+
+    CooType *P = coo_create_type(coo, "P");
+    coo_add_var(P, "x", &CooF32);
+    coo_add_var(P, "y", &CooF32);
+    coo_add_var(P, "id", &CooI32);
+    CooType *H = coo_create_type(coo, "H");
+    coo_add_ptr_var(H, "p", P);
+    coo_add_var(P, "h", H); /* nested struct column with pointers */
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    CooAlloc *soa = coo_get_soa_alloc(coo, P);
+    void *batch = coo_alloc(soa, 100);
+    float *x = coo_get_column(soa, batch, "x");
+    float *y = coo_get_column(soa, batch, "y");
+    int *id = coo_get_column(soa, batch, "id");
+    void **h = coo_get_column(soa, batch, "h");
+    for (int i = 0; i < 100; ++i) {
+        x[i] = i * 0.5f;
+        y[i] = -i * 1.0f;
+        id[i] = i;
+        h[i] = batch;
+    }
+    void **holder = coo_alloc(coo_get_alloc(coo, H), 1);
+    holder[0] = batch;
+    int **ids = coo_alloc(coo_get_ptr_alloc(coo, &CooI32), 3);
+    ids[0] = id + 5;
+    ids[1] = (int *)(y + 5);
+    ids[2] = (int *)(x + 5);
+
+    /* x is kept, y is removed, id is cast, z is new with default */
+
+    double z = 2.5;
+    coo_remove_var(P, "y");
+    coo_retype_var(P, "id", &CooI64);
+    coo_add_var(P, "z", &CooF64);
+    coo_set_var_default(P, "z", &z);
+    coo_begin_update(coo);
+    void *batch2 = coo_update_pointer(batch);
+    coo_end_update(coo);
+
+    assert(batch2 != batch);
+    assert(coo_get_column(soa, batch2, "x") == x); /* unchanged column didn't move */
+    long long *id2 = coo_get_column(soa, batch2, "id");
+    double *z2 = coo_get_column(soa, batch2, "z");
+    void **h2 = coo_get_column(soa, batch2, "h");
+    for (int i = 0; i < 100; ++i) {
+        assert(x[i] == i * 0.5f && id2[i] == i && z2[i] == 2.5);
+        assert(h2[i] == batch2);
+    }
+    assert(holder[0] == batch2);
+    assert((void *)ids[0] == (void *)(id2 + 5) && ids[1] == 0 && (void *)ids[2] == (void *)(x + 5)); /* into columns */
+    CooUpdateStats stats = coo_get_alloc_update_stats(soa);
+    assert(stats.cast_values == 100 && stats.defaulted_bytes == 100 * sizeof(double));
+    assert(stats.copied_bytes == 0 && stats.redirected_pointers == 100);
+
+    /* async update migrates columns in background, written batch is migrated again */
+
+    coo_set_threads_count(coo, 4);
+    coo_retype_var(P, "x", &CooF64);
+    coo_begin_update_async(coo);
+    while (coo_is_update_ready(coo) == 0)
+        ;
+    void *batch4 = coo_update_pointer(batch2);
+    double *x4 = coo_get_column(soa, batch4, "x");
+    for (int i = 0; i < 100; ++i)
+        assert(x4[i] == i * 0.5); /* before update is finished */
+    x[3] = 1.25f;
+    coo_mark_dirty(batch2);
+    coo_finish_update(coo);
+    assert(coo_update_pointer(batch2) == batch4);
+    coo_end_update(coo);
+
+    for (int i = 0; i < 100; ++i)
+        assert(x4[i] == (i == 3 ? 1.25 : i * 0.5) && ((void **)coo_get_column(soa, batch4, "h"))[i] == batch4);
+    assert(holder[0] == batch4);
+    stats = coo_get_alloc_update_stats(soa);
+    assert(stats.cast_values == 200); /* in background and once more after write */
+
+    /* new batches get defaults, freeing frees all columns */
+
+    void *batch3 = coo_alloc(soa, 10);
+    assert(((double *)coo_get_column(soa, batch3, "z"))[9] == 2.5);
+    coo_free(soa, batch3);
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_huge_pages() {
+    CooState *coo = coo_create_state();
+    CooAllocator *huge = coo_create_huge_page_allocator(1 << 20, 4);
+    coo_set_allocator(coo, huge);
+
+    CooType *A = coo_create_type(coo, "A");
+    coo_add_var(A, "x", &CooI64);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    /* large batch is mapped, small one is not, both migrate into new mapped or small batches */
+
+    CooAlloc *a_alloc = coo_get_alloc(coo, A);
+    long long *large = coo_alloc(a_alloc, 300000);
+    long long *small = coo_alloc(a_alloc, 10);
+    for (int i = 0; i < 300000; ++i)
+        large[i] = i;
+    small[9] = 9;
+
+    coo_ins_var(A, "y", &CooI32, 0);
+    coo_begin_update(coo);
+    struct A2 {
+        int y;
+        long long x;
+    } *large2 = coo_update_pointer(large), *small2 = coo_update_pointer(small);
+    coo_end_update(coo);
+
+    for (int i = 0; i < 300000; ++i)
+        assert(large2[i].x == i && large2[i].y == 0);
+    assert(small2[9].x == 9);
+
+    coo_free(a_alloc, large2);
+    coo_destroy_state(coo);
+    coo_destroy_allocator(huge);
+}
+
+void coo_test_realloc() {
+    CooState *coo = coo_create_state();
+    CooType *Item = coo_create_type(coo, "Item");
+    coo_add_var(Item, "v", &CooI32);
+    int one = 1;
+    coo_set_var_default(Item, "v", &one);
+    CooType *Node = coo_create_type(coo, "Node");
+    coo_add_ptr_var(Node, "items", Item);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    /* appending one element at a time only moves batch a few times, new elements get defaults */
+
+    CooAlloc *item_alloc = coo_get_alloc(coo, Item);
+    int **node = coo_alloc(coo_get_alloc(coo, Node), 1);
+    int *items = coo_alloc(item_alloc, 1);
+    items[0] = 0;
+    *node = items;
+    int moves_count = 0;
+    for (int i = 1; i < 1000; ++i) {
+        int *grown = coo_realloc(item_alloc, items, i + 1);
+        moves_count += grown != items;
+        assert(grown[i] == 1);
+        grown[i] = i;
+        items = grown;
+    }
+    assert(moves_count < 20);
+    assert(coo_update_pointer(*node) == items); /* old batches still redirect */
+
+    /* update without layout changes redirects pointers to moved batches, then frees old ones */
+
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    assert(*node == items);
+    for (int i = 0; i < 1000; ++i)
+        assert(items[i] == i);
+    assert(coo_realloc(item_alloc, items, 10) == items); /* shrinking keeps capacity */
+    assert(coo_realloc(item_alloc, items, 1000) == items && items[999] == 1);
+
+    /* migrated data keeps redirecting to batch moved after lazy update */
+
+    coo_set_lazy_update(coo, 1);
+    coo_ins_var(Item, "w", &CooI32, 0);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    int *moved = coo_realloc(item_alloc, items, 5000);
+    assert(moved[2 * 9] == 0 && moved[2 * 9 + 1] == 9 && moved[2 * 999 + 1] == 1 && moved[2 * 4999 + 1] == 1);
+    coo_set_lazy_update(coo, 0);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    assert(*node == moved);
+
+    /* slab chunks grow in place, soa columns grow separately */
+
+    CooAllocator *slab = coo_create_slab_allocator();
+    coo_set_alloc_allocator(item_alloc, slab);
+    int *small = coo_alloc(item_alloc, 1);
+    assert(coo_realloc(item_alloc, small, 2) == small);
+    coo_realloc(item_alloc, small, 1000); /* moved, old batch is freed with state */
+
+    CooAlloc *soa = coo_get_soa_alloc(coo, Item);
+    void *batch = coo_alloc(soa, 10);
+    ((int *)coo_get_column(soa, batch, "v"))[9] = 9;
+    assert(coo_realloc(soa, batch, 100000) == batch);
+    int *vs = coo_get_column(soa, batch, "v");
+    assert(vs[9] == 9 && vs[99999] == 1);
+
+    coo_destroy_state(coo);
+    coo_destroy_allocator(slab);
+}
+
+void coo_test_interior_pointers() {
+    CooState *coo = coo_create_state();
+    CooType *Item = coo_create_type(coo, "Item");
+    coo_add_var(Item, "a", &CooI32);
+    coo_add_arr(Item, "b", &CooF32, 4);
+    CooType *Holder = coo_create_type(coo, "Holder");
+    coo_add_ptr_var(Holder, "elem", Item);
+    coo_add_ptr_var(Holder, "field", &CooF32);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    struct Item1 {
+        int a;
+        float b[4];
+    } *items = coo_alloc(coo_get_alloc(coo, Item), 100);
+    struct Holder {
+        void *elem;
+        float *field;
+    } *holder = coo_alloc(coo_get_alloc(coo, Holder), 1);
+    holder->elem = items + 42;
+    holder->field = &items[42].b[2];
+    items[42].b[2] = 2.0f;
+
+    /* pointers to elements and fields are mapped to new layout of moved batch */
+
+    coo_ins_var(Item, "z", &CooI64, 0);
+    coo_resize_array(Item, "b", 6);
+    coo_begin_update(coo);
+    struct Item2 {
+        long long z;
+        int a;
+        float b[6];
+    } *items2 = coo_update_pointer(items);
+    assert(coo_update_pointer(&items[7].b[1]) == &items2[7].b[1]);
+    coo_end_update(coo);
+    assert(holder->elem == items2 + 42);
+    assert(holder->field == &items2[42].b[2] && *holder->field == 2.0f);
+
+    /* batch migrated in place, and with bounded update */
+
+    coo_remove_var(Item, "z");
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    struct Item3 {
+        int a;
+        float b[6];
+    } *items3 = (struct Item3 *)items2;
+    assert(holder->elem == items3 + 42 && holder->field == &items3[42].b[2]);
+
+    coo_set_update_budget(coo, 1);
+    coo_ins_var(Item, "y", &CooI32, 0);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    coo_set_update_budget(coo, 0);
+    struct Item4 {
+        int y, a;
+        float b[6];
+    } *items4 = (struct Item4 *)holder->elem - 42;
+    assert(holder->field == &items4[42].b[2] && *holder->field == 2.0f);
+
+    /* realloc keeps offsets, removed values are nulled */
+
+    struct Item4 *items5 = coo_realloc(coo_get_alloc(coo, Item), items4, 100000);
+    coo_resize_array(Item, "b", 2);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    assert(holder->elem == (char *)items5 + 42 * coo_type_size(Item) && holder->field == 0);
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_update_pointers() {
+    CooState *coo = coo_create_state();
+    CooType *Item = coo_create_type(coo, "Item");
+    coo_add_var(Item, "a", &CooI32);
+    coo_add_var(Item, "b", &CooI32);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    /* starts of single batches, elements and fields of an array, repeated pointers and nulls */
+
+    enum { SINGLES = 2000, POINTERS = 5000 };
+    CooAlloc *a = coo_get_alloc(coo, Item);
+    void *singles[SINGLES];
+    for (int i = 0; i < SINGLES; ++i)
+        singles[i] = coo_alloc(a, 1);
+    int *array = coo_alloc(a, 1000);
+    void **ptrs = malloc(sizeof(void *) * POINTERS), **roots = malloc(sizeof(void *) * POINTERS);
+    unsigned int random = 1;
+    for (int i = 0; i < POINTERS; ++i) {
+        random = random * 1103515245 + 12345;
+        int r = (random >> 8) % 4000;
+        ptrs[i] = r < SINGLES ? singles[r] : r < 3900 ? (void *)(array + (r - SINGLES) % 2000) : 0;
+    }
+    memcpy(roots, ptrs, sizeof(void *) * POINTERS);
+    coo_add_roots(coo, roots, POINTERS);
+
+    coo_ins_var(Item, "z", &CooI64, 1);
+    coo_begin_update(coo);
+    void *small[3] = { singles[0], array + 1, 0 };
+    coo_update_pointers(small, 3);
+    assert(small[0] == coo_update_pointer(singles[0]) && small[1] == coo_update_pointer(array + 1) && small[2] == 0);
+    for (int i = 0; i < POINTERS; ++i) {
+        void *ptr = ptrs[i];
+        ptrs[i] = coo_update_pointer(ptr);
+        assert(ptrs[i] == 0 || ptrs[i] != ptr);
+    }
+    for (int i = 0; i < SINGLES; ++i)
+        singles[i] = coo_update_pointer(singles[i]);
+    coo_end_update(coo);
+    assert(memcmp(roots, ptrs, sizeof(void *) * POINTERS) == 0); /* sorted update of roots matches single updates */
+
+    /* outside of update batches moved by realloc are resolved through their headers */
+
+    for (int i = 0; i < POINTERS; ++i)
+        roots[i] = ptrs[i] = singles[i % SINGLES];
+    for (int i = 0; i < SINGLES; i += 2)
+        singles[i] = coo_realloc(a, roots[i], 10);
+    coo_update_pointers(ptrs, POINTERS);
+    for (int i = 0; i < POINTERS; ++i)
+        assert(ptrs[i] == (i % SINGLES % 2 ? roots[i] : singles[i % SINGLES]));
+
+    coo_remove_roots(coo, roots);
+    coo_destroy_state(coo);
+    free(ptrs);
+    free(roots);
+}
+
+void coo_test_optimized_layout() {
+    CooState *coo = coo_create_state();
+    CooType *Inner = coo_create_type(coo, "Inner");
+    coo_add_var(Inner, "c", &CooI8);
+    coo_add_var(Inner, "i", &CooI32);
+    CooType *Packed = coo_create_type(coo, "Packed");
+    coo_add_var(Packed, "a", &CooI8);
+    coo_add_var(Packed, "d", &CooF64);
+    coo_add_var(Packed, "b", &CooI8);
+    coo_add_var(Packed, "in", Inner);
+    coo_add_arr(Packed, "s", &CooI16, 3);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    assert(coo_type_size(Packed) == 40 && coo_var_offset(Packed, "in") == 20);
+
+    struct Declared { int8_t a; double d; int8_t b; struct { int8_t c; int32_t i; } in; int16_t s[3]; };
+    CooAlloc *a = coo_get_alloc(coo, Packed);
+    struct Declared *p = coo_alloc(a, 2);
+    p[1].a = 1; p[1].d = 2.5; p[1].b = 3; p[1].in.c = 4; p[1].in.i = 5; p[1].s[2] = 6;
+
+    /* variables ordered by alignment, nested type keeps its order */
+
+    coo_set_optimized_layout(Packed, 1);
+    coo_begin_update(coo);
+    struct Optimized { double d; struct { int8_t c; int32_t i; } in; int16_t s[3]; int8_t a; int8_t b; } *o;
+    o = coo_update_pointer(p);
+    coo_end_update(coo);
+    assert(coo_type_size(Packed) == sizeof(struct Optimized) && coo_type_size(Packed) == 24);
+    assert(coo_var_offset(Packed, "in") == 8 && coo_var_offset(Packed, "a") == 22 && coo_var_offset(Packed, "x") == -1);
+    assert(o[1].a == 1 && o[1].d == 2.5 && o[1].b == 3 && o[1].in.c == 4 && o[1].in.i == 5 && o[1].s[2] == 6);
+
+    /* header lists variables in offset order */
+
+    assert(coo_write_header(coo, "coo_test_header.h"));
+    FILE *file = fopen("coo_test_header.h", "r");
+    char text[1024];
+    text[fread(text, 1, sizeof(text) - 1, file)] = 0;
+    fclose(file);
+    remove("coo_test_header.h");
+    const char *inner = strstr(text, "struct Inner {"), *packed = strstr(text, "struct Packed {");
+    assert(inner && packed && inner < packed);
+    assert(strstr(packed, "double d;") < strstr(packed, "struct Inner in;"));
+    assert(strstr(packed, "int16_t s[3];") < strstr(packed, "int8_t a;"));
+    assert(strstr(packed, "sizeof(struct Packed) == 24"));
+
+    coo_destroy_state(coo);
+}
+
+void coo_test_cold_vars() {
+    CooState *coo = coo_create_state();
+    CooType *Unit = coo_create_type(coo, "Unit");
+    coo_add_var(Unit, "x", &CooF32);
+    coo_add_ptr_var(Unit, "target", Unit);
+    coo_add_var(Unit, "hp", &CooF32);
+    coo_add_arr(Unit, "history", &CooI64, 4);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+
+    struct Whole { float x; void *target; float hp; int64_t history[4]; };
+    CooAlloc *a = coo_get_alloc(coo, Unit);
+    struct Whole *single = coo_alloc(a, 1), *array = coo_alloc(a, 100);
+    for (int i = 0; i < 100; ++i) {
+        array[i].x = (float)i;
+        array[i].hp = 100.0f + i;
+        array[i].target = single;
+        array[i].history[3] = i * 10;
+    }
+    float *hp = &array[42].hp;
+
+    /* cold variables move into side buffers, with a new cold variable that has a default */
+
+    int level = 7;
+    coo_set_var_cold(Unit, "target", 1);
+    coo_set_var_cold(Unit, "history", 1);
+    coo_add_var(Unit, "level", &CooI32);
+    coo_set_var_default(Unit, "level", &level);
+    coo_set_var_cold(Unit, "level", 1);
+    coo_begin_update(coo);
+    struct Hot { float x, hp; } *hot = coo_update_pointer(array);
+    struct Cold { void *target; int64_t history[4]; int32_t level; } *cold = coo_get_cold(hot);
+    void *n_single = coo_update_pointer(single);
+    hp = coo_update_pointer(hp);
+    coo_end_update(coo);
+    assert(coo_type_size(Unit) == sizeof(struct Hot) && coo_cold_size(Unit) == sizeof(struct Cold));
+    assert(coo_var_offset(Unit, "hp") == 4 && coo_var_offset(Unit, "history") == 8);
+    assert(hp == &hot[42].hp);
+    for (int i = 0; i < 100; ++i) {
+        assert(hot[i].x == (float)i && hot[i].hp == 100.0f + i);
+        assert(cold[i].target == n_single && cold[i].history[3] == i * 10 && cold[i].level == 7);
+    }
+
+    /* grown batch gets cold parts too, and cold pointers to moved batches are redirected */
+
+    hot = coo_realloc(a, hot, 300);
+    cold = coo_get_cold(hot);
+    assert(cold[99].history[3] == 990 && cold[299].level == 7 && cold[299].target == 0);
+    single = coo_realloc(a, n_single, 50);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    assert(cold[0].target == single && cold[99].target == single);
+
+    /* variable moved back to hot part */
+
+    coo_set_var_cold(Unit, "history", 0);
+    coo_begin_update(coo);
+    struct Hot2 { float x, hp; int64_t history[4]; } *hot2 = coo_update_pointer(hot);
+    coo_end_update(coo);
+    struct Cold2 { void *target; int32_t level; } *cold2 = coo_get_cold(hot2);
+    assert(coo_type_size(Unit) == sizeof(struct Hot2) && coo_cold_size(Unit) == sizeof(struct Cold2));
+    assert(hot2[99].history[3] == 990 && hot2[99].hp == 199.0f && cold2[99].level == 7);
+    assert(coo_save_state(coo, "coo_test_cold.bin") == 0);
+
+    coo_destroy_state(coo);
+}
+
+static void *_offset_alloc(void *context, size_t size) { /* data after tag is never 128 aligned */
+    (void)context;
+    char *raw = malloc(size + 288);
+    char *aligned = (char *)(((uintptr_t)raw + 255) / 128 * 128);
+    memcpy(aligned - sizeof(raw), &raw, sizeof(raw));
+    return aligned + 16;
+}
+
+static void _offset_free(void *context, void *ptr, size_t size) {
+    (void)context;
+    (void)size;
+    char *raw;
+    memcpy(&raw, (char *)ptr - 16 - sizeof(raw), sizeof(raw));
+    free(raw);
+}
+
+static CooState *_create_aligned_state(CooType **counter, CooType **record) {
+    CooState *coo = coo_create_state();
+    *counter = coo_create_type(coo, "Counter");
+    coo_add_var(*counter, "count", &CooI64);
+    coo_set_type_alignment(*counter, 64);
+    *record = coo_create_type(coo, "Record");
+    coo_add_var(*record, "kind", &CooI8);
+    coo_add_var(*record, "id", &CooI32);
+    coo_add_ptr_var(*record, "next", *record);
+    coo_set_type_packing(*record, 1);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    return coo;
+}
+
+void coo_test_packing_and_alignment() {
+    CooType *Counter, *Record;
+    CooState *coo = _create_aligned_state(&Counter, &Record);
+    assert(coo_type_size(Counter) == 64 && coo_type_size(Record) == 13);
+    assert(coo_var_offset(Record, "id") == 1 && coo_var_offset(Record, "next") == 5);
+
+    /* batches of over-aligned types start at their alignment with any allocator */
+
+    CooType *Counters = coo_create_type(coo, "Counters");
+    coo_add_var(Counters, "total", &CooI32);
+    coo_add_arr(Counters, "per_thread", Counter, 4);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    assert(coo_type_size(Counters) == 320 && coo_var_offset(Counters, "per_thread") == 64);
+    CooAllocator *slab = coo_create_slab_allocator();
+    CooAlloc *a = coo_get_alloc(coo, Counter);
+    for (int i = 0; i < 2; ++i) {
+        int64_t *counters = coo_alloc(a, 3);
+        assert((uintptr_t)counters % 64 == 0);
+        counters[8] = 5;
+        counters = coo_realloc(a, counters, 100);
+        assert((uintptr_t)counters % 64 == 0 && counters[8] == 5);
+        assert((uintptr_t)coo_alloc(coo_get_alloc(coo, Counters), 1) % 64 == 0);
+        coo_set_alloc_allocator(a, slab);
+        coo_set_alloc_allocator(coo_get_alloc(coo, Counters), slab);
+    }
+
+    /* packed values and unaligned pointers are migrated and redirected */
+
+    char *records = coo_alloc(coo_get_alloc(coo, Record), 10), *target = coo_alloc(coo_get_alloc(coo, Record), 1);
+    for (int i = 0; i < 10; ++i) {
+        int32_t id = 1000 + i;
+        records[13 * i] = (char)i;
+        memcpy(records + 13 * i + 1, &id, sizeof(id));
+        memcpy(records + 13 * i + 5, &target, sizeof(target));
+    }
+    coo_retype_var(Record, "id", &CooI64);
+    coo_set_type_packing(Record, 2);
+    coo_begin_update(coo);
+    char *n_records = coo_update_pointer(records), *n_target = coo_update_pointer(target);
+    coo_end_update(coo);
+    assert(coo_type_size(Record) == 18 && coo_var_offset(Record, "id") == 2 && coo_var_offset(Record, "next") == 10);
+    for (int i = 0; i < 10; ++i) {
+        int64_t id;
+        char *next;
+        memcpy(&id, n_records + 18 * i + 2, sizeof(id));
+        memcpy(&next, n_records + 18 * i + 10, sizeof(next));
+        assert(n_records[18 * i] == i && id == 1000 + i && next == n_target);
+    }
+
+    /* raising alignment alone moves data to aligned batches */
+
+    CooType *Pair = coo_create_type(coo, "Pair");
+    coo_add_arr(Pair, "v", &CooI64, 16);
+    coo_begin_update(coo);
+    coo_end_update(coo);
+    CooAllocator *offset = coo_create_allocator(_offset_alloc, _offset_free, 0);
+    coo_set_alloc_allocator(coo_get_alloc(coo, Pair), offset);
+    int64_t *pairs = coo_alloc(coo_get_alloc(coo, Pair), 3);
+    assert((uintptr_t)pairs % 128);
+    pairs[47] = 47;
+    coo_set_type_alignment(Pair, 128);
+    coo_begin_update(coo);
+    int64_t *n_pairs = coo_update_pointer(pairs);
+    coo_end_update(coo);
+    assert(coo_type_size(Pair) == 128 && n_pairs != pairs && (uintptr_t)n_pairs % 128 == 0 && n_pairs[47] == 47);
+
+    /* alignment is kept in saved data */
+
+    int64_t *counters = coo_alloc(a, 2);
+    counters[8] = 7;
+    assert(coo_save_state(coo, "coo_test_aligned.bin"));
+    coo_destroy_state(coo);
+    coo_destroy_allocator(slab);
+    coo_destroy_allocator(offset);
+    coo = _create_aligned_state(&Counter, &Record);
+    assert(coo_load_state(coo, "coo_test_aligned.bin"));
+    remove("coo_test_aligned.bin");
+    int found = 0, count;
+    for (int64_t *batch = coo_next_batch(coo_get_alloc(coo, Counter), 0, &count); batch;
+         batch = coo_next_batch(coo_get_alloc(coo, Counter), batch, &count)) {
+        assert((uintptr_t)batch % 64 == 0);
+        found += count == 2 && batch[8] == 7;
+    }
+    assert(found == 1);
+
+    /* types missing in running code keep their packing and alignment when saved again */
+
+    assert(coo_save_state(coo, "coo_test_aligned.bin"));
+    coo_destroy_state(coo);
+    coo = _create_aligned_state(&Counter, &Record);
+    Pair = coo_create_type(coo, "Pair");
+    coo_add_arr(Pair, "v", &CooI64, 16);
+    coo_set_type_alignment(Pair, 128);
+    assert(coo_load_state(coo, "coo_test_aligned.bin"));
+    remove("coo_test_aligned.bin");
+    assert(coo_get_type_update_stats(coo, Pair).allocated_batches == 0); /* loaded layout is current one */
+    pairs = coo_next_batch(coo_get_alloc(coo, Pair), 0, &count);
+    assert(count == 3 && (uintptr_t)pairs % 128 == 0 && pairs[47] == 47);
+    coo_destroy_state(coo);
+}
+
 void coo_test_alloc() {
+    coo_register_cast(&CooF64, &CooI32, _f64_to_i32_truncated); /* before any state exists, used by coo_test_casts */
     coo_test_basics();
     coo_test_pointers();
     coo_test_struct_composition();
+    coo_test_arrays();
+    coo_test_unaffected_types();
+    coo_test_bounded_update();
+    coo_test_in_place();
+    coo_test_allocators();
+    coo_test_many_types();
+    coo_test_many_vars();
+    coo_test_lazy_update();
+    coo_test_async_update();
+    coo_test_save_load();
+    coo_test_update_stats();
+    coo_test_casts();
+    coo_test_defaults();
+    coo_test_soa();
+    coo_test_huge_pages();
+    coo_test_realloc();
+    coo_test_interior_pointers();
+    coo_test_update_pointers();
+    coo_test_optimized_layout();
+    coo_test_cold_vars();
+    coo_test_packing_and_alignment();
 }